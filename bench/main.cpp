@@ -0,0 +1,441 @@
+import codec;
+import cppl;
+import http_client;
+import lzma;
+import md5;
+import message_queue;
+import metadata;
+import package;
+import read_stream;
+import tree_hash;
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <cstdio>
+#include <cstring>
+#include <format>
+#include <functional>
+#include <lzma.h>
+#include <memory>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+#include <zstd.h>
+
+using cppl::task_state_t;
+using cppl::task_t;
+using namespace std::chrono_literals;
+
+struct Options {
+    bool help {};
+    bool json {};
+    std::string filter {};
+};
+
+struct result_t {
+    std::string name {};
+    size_t iterations {};
+    double ns_per_op {};
+    // Zero for benchmarks that don't process a byte stream.
+    double bytes_per_second {};
+};
+
+struct benchmark_t {
+    std::string name {};
+    // Operations and bytes processed by one call of `run`.
+    size_t ops_per_run { 1 };
+    size_t bytes_per_run {};
+    std::function<void()> run {};
+};
+
+static Options parse_options(int& argc, const char**& argv)
+{
+    auto options = Options {};
+    while (argc && **argv == '-') {
+        if (!strcmp(*argv + 1, "h") || !strcmp(*argv + 1, "-help")) {
+            options.help = true;
+        } else if (!strcmp(*argv + 1, "-json")) {
+            options.json = true;
+        } else if (!strcmp(*argv + 1, "-csv")) {
+            options.json = false;
+        } else {
+            fprintf(stderr, "unknown option: %s\n", *argv);
+            exit(1);
+        }
+        --argc;
+        ++argv;
+    }
+    if (argc) {
+        options.filter = *argv;
+    }
+    return options;
+}
+
+static void print_help()
+{
+    fprintf(stdout, R"(Microbenchmarks of the app hot paths
+Usage: bench [OPTIONS] [FILTER]
+
+Options:
+    -h,--help                   Print this help message and exit
+    --csv                       Print results as CSV (default)
+    --json                      Print results as JSON
+
+Parameters:
+    FILTER                      Only run benchmarks whose name contains FILTER
+)");
+}
+
+// Calls `benchmark.run` in doubling batches until one batch takes at least MIN_TIME, so the
+// clock overhead is amortized for nanosecond-scale operations too.
+static result_t measure(const benchmark_t& benchmark)
+{
+    constexpr auto MIN_TIME = 500ms;
+
+    // Warm up caches and lazily initialized state.
+    benchmark.run();
+
+    for (size_t runs = 1;; runs *= 2) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < runs; ++i) {
+            benchmark.run();
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        if (elapsed >= MIN_TIME) {
+            auto seconds = std::chrono::duration<double>(elapsed).count();
+            return {
+                .name = benchmark.name,
+                .iterations = runs * benchmark.ops_per_run,
+                .ns_per_op = seconds * 1e9 / (runs * benchmark.ops_per_run),
+                .bytes_per_second = benchmark.bytes_per_run * runs / seconds,
+            };
+        }
+    }
+}
+
+static std::vector<uint8_t> random_bytes(size_t size)
+{
+    auto rng = std::mt19937 { 42 };
+    auto data = std::vector<uint8_t>(size);
+    for (auto& byte : data) {
+        byte = rng();
+    }
+    return data;
+}
+
+// Text that compresses about as well as package payloads do.
+static std::vector<uint8_t> text_bytes(size_t size)
+{
+    static const char* words[] = { "static", "linux", "app", "package", "lib", "usr", "bin", "share", "include", "config" };
+    auto rng = std::mt19937 { 42 };
+    auto data = std::vector<uint8_t> {};
+    data.reserve(size + 16);
+    while (data.size() < size) {
+        auto word = words[rng() % std::size(words)];
+        data.insert(data.end(), word, word + strlen(word));
+        data.push_back(rng() % 8 ? ' ' : '\n');
+    }
+    data.resize(size);
+    return data;
+}
+
+static std::vector<uint8_t> xz_compress(std::span<const uint8_t> data)
+{
+    auto out = std::vector<uint8_t>(lzma_stream_buffer_bound(data.size()));
+    size_t out_pos {};
+    if (auto ret = lzma_easy_buffer_encode(/*preset=*/6, LZMA_CHECK_CRC64, nullptr, data.data(), data.size(), out.data(), &out_pos, out.size()); ret != LZMA_OK) {
+        throw std::runtime_error { std::format("lzma encode failed: {}", (int)ret) };
+    }
+    out.resize(out_pos);
+    return out;
+}
+
+// `long_window` enables long distance matching with a 128MB window, as `zstd --long` does.
+static std::vector<uint8_t> zstd_compress(std::span<const uint8_t> data, bool long_window = false)
+{
+    auto cctx = std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> { ZSTD_createCCtx(), &ZSTD_freeCCtx };
+    ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_compressionLevel, 19);
+    if (long_window) {
+        ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_enableLongDistanceMatching, 1);
+        ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_windowLog, 27);
+    }
+    auto out = std::vector<uint8_t>(ZSTD_compressBound(data.size()));
+    auto size = ZSTD_compress2(cctx.get(), out.data(), out.size(), data.data(), data.size());
+    if (ZSTD_isError(size)) {
+        throw std::runtime_error { std::format("zstd encode failed: {}", ZSTD_getErrorName(size)) };
+    }
+    out.resize(size);
+    return out;
+}
+
+// A metadata document in the format served by the mirrors, with `entries` files.
+static std::string synthetic_metadata(size_t entries)
+{
+    auto rng = std::mt19937 { 42 };
+    auto yaml = std::string { "files:\n" };
+    for (size_t i = 0; i < entries; ++i) {
+        std::format_to(std::back_inserter(yaml), "  - {:08x}{:08x}{:08x}{:08x} -rwxr-xr-x {} usr/lib/pkg{}/file{}.so\n",
+            rng(), rng(), rng(), rng(), rng() % 1000000, i / 100, i);
+    }
+    return yaml;
+}
+
+// A non-blocking connected pair: data written to [1] is read from [0].
+static std::pair<read_stream_t, int> stream_pair()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+        throw std::system_error { errno, std::system_category(), "socketpair failed" };
+    }
+    return { read_stream_t { fds[0] }, fds[1] };
+}
+
+static void write_all(int fd, std::span<const uint8_t> data)
+{
+    while (!data.empty()) {
+        auto num = write(fd, data.data(), data.size());
+        if (num < 0) {
+            throw std::system_error { errno, std::system_category(), "write failed" };
+        }
+        data = data.subspan(num);
+    }
+}
+
+static task_t<void> read_lines_async(read_stream_t& stream, size_t lines)
+{
+    for (size_t i = 0; i < lines; ++i) {
+        co_await stream.read_line_async();
+    }
+}
+
+static task_t<int> ready_async(int value)
+{
+    co_return value;
+}
+
+static task_t<int> await_ready_tasks_async(size_t count)
+{
+    int sum {};
+    for (size_t i = 0; i < count; ++i) {
+        sum += co_await ready_async(1);
+    }
+    co_return sum;
+}
+
+static task_t<void> await_state_async(std::shared_ptr<task_state_t<int>> state)
+{
+    co_await task_t<int> { std::move(state) };
+}
+
+static std::vector<benchmark_t> benchmarks()
+{
+    auto& queue = message_queue_t::current();
+    auto list = std::vector<benchmark_t> {};
+
+    for (size_t size : { 64, 4096, 1 << 20 }) {
+        auto data = std::make_shared<std::vector<uint8_t>>(random_bytes(size));
+        list.push_back({
+            .name = std::format("md5/{}", size),
+            .bytes_per_run = size,
+            .run = [data] { md5_string(*data); },
+        });
+    }
+
+    {
+        auto data = std::make_shared<std::vector<uint8_t>>(random_bytes(1 << 20));
+        list.push_back({
+            .name = "blake3/1048576",
+            .bytes_per_run = data->size(),
+            .run = [data] { blake3(*data); },
+        });
+
+        // Chunks are hashed on the worker pool, as pulls verify them.
+        auto tree_data = std::make_shared<std::vector<uint8_t>>(random_bytes(4 << 20));
+        list.push_back({
+            .name = "tree_digest/4194304",
+            .bytes_per_run = tree_data->size(),
+            .run = [tree_data] { tree_digest(*tree_data, 256 << 10); },
+        });
+    }
+
+    {
+        auto raw = text_bytes(4 << 20);
+        auto compressed = std::make_shared<std::vector<uint8_t>>(xz_compress(raw));
+        list.push_back({
+            .name = "lzma/decode/4194304",
+            .bytes_per_run = raw.size(),
+            .run = [compressed] { lzma_decompress(*compressed); },
+        });
+
+        // The same file as a v2 package stores it, decoded on the worker pool.
+        constexpr size_t BLOCK_SIZE = 256 << 10;
+        auto file = std::make_shared<Metadata::File>();
+        auto blocks = std::make_shared<std::vector<uint8_t>>();
+        for (size_t at = 0; at < raw.size(); at += BLOCK_SIZE) {
+            auto block = xz_compress(std::span { raw }.subspan(at, std::min(BLOCK_SIZE, raw.size() - at)));
+            file->blocks.push_back({ .offset = blocks->size(), .compressed_size = block.size(), .size = std::min(BLOCK_SIZE, raw.size() - at), .crc32 = crc32(block) });
+            blocks->insert(blocks->end(), block.begin(), block.end());
+        }
+        list.push_back({
+            .name = "package/decode/v2/4194304",
+            .bytes_per_run = raw.size(),
+            .run = [file, blocks] { decompress_file(*file, *blocks); },
+        });
+
+        for (auto long_window : { false, true }) {
+            auto zstd_compressed = std::make_shared<std::vector<uint8_t>>(zstd_compress(raw, long_window));
+            list.push_back({
+                .name = long_window ? "zstd/decode/long/4194304" : "zstd/decode/4194304",
+                .bytes_per_run = raw.size(),
+                .run = [zstd_compressed] { decompress(codec_t::zstd, *zstd_compressed); },
+            });
+        }
+    }
+
+    for (size_t entries : { 1000, 10000, 100000 }) {
+        auto yaml = std::make_shared<std::string>(synthetic_metadata(entries));
+        list.push_back({
+            .name = std::format("metadata/parse/{}", entries),
+            .bytes_per_run = yaml->size(),
+            .run = [yaml] { parse_metadata(*yaml); },
+        });
+    }
+
+    // The socket benchmarks include the write that feeds each read; it is small next to the
+    // buffering done by read_stream_t.
+    {
+        auto [stream, writer] = stream_pair();
+        auto pair = std::make_shared<std::pair<read_stream_t, int>>(std::move(stream), writer);
+        auto chunk = std::make_shared<std::vector<uint8_t>>(random_bytes(64 << 10));
+        list.push_back({
+            .name = "read_stream/read_async/65536",
+            .bytes_per_run = chunk->size(),
+            .run = [&queue, pair, chunk] {
+                write_all(pair->second, *chunk);
+                queue.wait(pair->first.read_async(chunk->size()));
+            },
+        });
+    }
+
+    {
+        constexpr size_t LINES = 1000;
+        auto [stream, writer] = stream_pair();
+        auto pair = std::make_shared<std::pair<read_stream_t, int>>(std::move(stream), writer);
+        auto text = std::make_shared<std::vector<uint8_t>>();
+        for (size_t i = 0; i < LINES; ++i) {
+            std::format_to(std::back_inserter(*text), "{:0>78}\r\n", i);
+        }
+        list.push_back({
+            .name = "read_stream/read_line_async/80",
+            .ops_per_run = LINES,
+            .bytes_per_run = text->size(),
+            .run = [&queue, pair, text] {
+                write_all(pair->second, *text);
+                queue.wait(read_lines_async(pair->first, LINES));
+            },
+        });
+    }
+
+    {
+        auto [stream, writer] = stream_pair();
+        auto pair = std::make_shared<std::pair<read_stream_t, int>>(std::move(stream), writer);
+        auto head = std::string_view {
+            "HTTP/1.1 206 Partial Content\r\n"
+            "Server: nginx/1.24.0\r\n"
+            "Date: Mon, 19 Oct 2026 00:00:00 GMT\r\n"
+            "Content-Type: application/octet-stream\r\n"
+            "Content-Length: 1048576\r\n"
+            "Last-Modified: Sun, 18 Oct 2026 00:00:00 GMT\r\n"
+            "Connection: keep-alive\r\n"
+            "ETag: \"6531a5c0-100000\"\r\n"
+            "Content-Range: bytes 0-1048575/8388608\r\n"
+            "Accept-Ranges: bytes\r\n"
+            "\r\n"
+        };
+        list.push_back({
+            .name = "http/read_response_head",
+            .bytes_per_run = head.size(),
+            .run = [&queue, pair, head] {
+                write_all(pair->second, { (const uint8_t*)head.data(), head.size() });
+                queue.wait(http_read_response_head_async(pair->first));
+            },
+        });
+    }
+
+    {
+        constexpr size_t COUNT = 1000;
+        list.push_back({
+            .name = "task/co_await_ready",
+            .ops_per_run = COUNT,
+            .run = [&queue] { queue.wait(await_ready_tasks_async(COUNT)); },
+        });
+        list.push_back({
+            .name = "task/suspend_resume",
+            .ops_per_run = COUNT,
+            .run = [] {
+                for (size_t i = 0; i < COUNT; ++i) {
+                    auto state = std::make_shared<task_state_t<int>>();
+                    auto task = await_state_async(state);
+                    state->set_value(1);
+                }
+            },
+        });
+    }
+
+    return list;
+}
+
+static void print_csv(const std::vector<result_t>& results)
+{
+    fprintf(stdout, "name,iterations,ns_per_op,bytes_per_second\n");
+    for (const auto& result : results) {
+        fprintf(stdout, "%s,%zu,%.2f,%.0f\n", result.name.c_str(), result.iterations, result.ns_per_op, result.bytes_per_second);
+    }
+}
+
+static void print_json(const std::vector<result_t>& results)
+{
+    fprintf(stdout, "{\"benchmarks\":[");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const auto& result = results[i];
+        fprintf(stdout, "%s\n  {\"name\":\"%s\",\"iterations\":%zu,\"ns_per_op\":%.2f,\"bytes_per_second\":%.0f}",
+            i ? "," : "", result.name.c_str(), result.iterations, result.ns_per_op, result.bytes_per_second);
+    }
+    fprintf(stdout, "\n]}\n");
+}
+
+int main(int argc, const char* argv[])
+{
+    --argc;
+    ++argv;
+
+    auto options = parse_options(argc, argv);
+    if (options.help) {
+        print_help();
+        return 0;
+    }
+
+    try {
+        auto results = std::vector<result_t> {};
+        for (const auto& benchmark : benchmarks()) {
+            if (benchmark.name.find(options.filter) == std::string::npos) {
+                continue;
+            }
+            results.push_back(measure(benchmark));
+            fprintf(stderr, "%s done\n", benchmark.name.c_str());
+        }
+
+        if (options.json) {
+            print_json(results);
+        } else {
+            print_csv(results);
+        }
+    } catch (const std::exception& ex) {
+        fprintf(stderr, "bench failed: %s\n", ex.what());
+        return 1;
+    }
+    return 0;
+}
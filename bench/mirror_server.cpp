@@ -0,0 +1,551 @@
+module;
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <coroutine>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <format>
+#include <functional>
+#include <lzma.h>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <optional>
+#include <random>
+#include <span>
+#include <string>
+#include <sys/socket.h>
+#include <system_error>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <zstd.h>
+
+export module mirror_server;
+import codec;
+import cppl;
+import http_client;
+import md5;
+import message_queue;
+import read_stream;
+import string_utils;
+import tree_hash;
+
+using cppl::task_state_t;
+using cppl::task_t;
+using namespace std::chrono_literals;
+
+// How the stand-in misbehaves, all defaults describe a fast and reliable mirror.
+export struct mirror_server_options_t {
+    // 0 picks an ephemeral port.
+    uint16_t port {};
+    // Added to every response, measured from the arrival of its request, so pipelined requests
+    // overlap like they would over a link with this round trip time.
+    std::chrono::milliseconds latency {};
+    // Per connection, in bytes per second; 0 is unlimited.
+    size_t bandwidth {};
+    // Probability that a response is cut off halfway through its body and the connection closed.
+    double drop_rate {};
+    // Responses served per connection before it is closed; 1 disables keep-alive.
+    size_t max_keep_alive { 100 };
+    // Idle keep-alive connections are closed after this long.
+    std::chrono::milliseconds keep_alive_timeout { 5s };
+    // Shape of every synthetic package.
+    size_t files { 8 };
+    uint64_t file_size { 64 << 10 };
+    // .slp layout, 2 splits files into blocks of `block_size` bytes.
+    int format_version { 1 };
+    size_t block_size { 1 << 20 };
+    // Compression of the files, the metadata is always xz.
+    codec_t codec { codec_t::xz };
+    // Lists a BLAKE3 tree digest of every file, chunked by blocks in v2 and by 1MB in v1.
+    bool digests {};
+    // Serves packages whose files repeat one block, see make_generated_package(), so files of
+    // many gigabytes cost no memory. `format_version` and `digests` don't apply.
+    bool generated {};
+};
+
+// A synthetic .slp package: in v1 the header, padded xz metadata, then one xz stream per file; in
+// v2 the header, xz metadata, the block index, then each file as xz blocks.
+export struct synthetic_package_t {
+    std::vector<uint8_t> data {};
+    std::vector<std::string> filepaths {};
+    // A generated package keeps only its head in `data`, the body after it is `block` over and
+    // over for `body_size` bytes.
+    std::vector<uint8_t> block {};
+    uint64_t body_size {};
+
+    uint64_t size() const
+    {
+        return data.size() + body_size;
+    }
+
+    // The bytes at `offset`, at most `max` of them, up to the end of `data` or of a block.
+    std::string_view piece(uint64_t offset, uint64_t max) const
+    {
+        if (offset < data.size()) {
+            return { (const char*)data.data() + offset, (size_t)std::min<uint64_t>(max, data.size() - offset) };
+        }
+        auto at = (offset - data.size()) % block.size();
+        return { (const char*)block.data() + at, (size_t)std::min<uint64_t>(max, block.size() - at) };
+    }
+};
+
+static std::vector<uint8_t> xz_compress(std::span<const uint8_t> data)
+{
+    auto out = std::vector<uint8_t>(lzma_stream_buffer_bound(data.size()));
+    size_t out_pos {};
+    if (auto ret = lzma_easy_buffer_encode(/*preset=*/6, LZMA_CHECK_CRC64, nullptr, data.data(), data.size(), out.data(), &out_pos, out.size()); ret != LZMA_OK) {
+        throw std::runtime_error { std::format("lzma encode failed: {}", (int)ret) };
+    }
+    out.resize(out_pos);
+    return out;
+}
+
+static std::vector<uint8_t> zstd_compress(std::span<const uint8_t> data)
+{
+    auto out = std::vector<uint8_t>(ZSTD_compressBound(data.size()));
+    auto size = ZSTD_compress(out.data(), out.size(), data.data(), data.size(), /*level=*/19);
+    if (ZSTD_isError(size)) {
+        throw std::runtime_error { std::format("zstd encode failed: {}", ZSTD_getErrorName(size)) };
+    }
+    out.resize(size);
+    return out;
+}
+
+static std::vector<uint8_t> compress(codec_t codec, std::span<const uint8_t> data)
+{
+    return codec == codec_t::zstd ? zstd_compress(data) : xz_compress(data);
+}
+
+template <typename T>
+static void append_le(std::vector<uint8_t>& out, T value)
+{
+    auto p = (const uint8_t*)&value;
+    out.insert(out.end(), p, p + sizeof(value));
+}
+
+// The v2 header, the xz metadata and the block index, whose offsets are relative to the body
+// until here.
+static std::vector<uint8_t> make_v2_head(const std::string& metadata, std::vector<uint8_t> block_index, size_t block_size)
+{
+    auto compressed_metadata = xz_compress({ (const uint8_t*)metadata.data(), metadata.size() });
+    auto head = std::vector<uint8_t> { 0xF1, 'S', 'L', 'P', 0x02, 0, 0, 0 };
+    append_le<uint64_t>(head, compressed_metadata.size());
+    append_le<uint64_t>(head, block_index.size());
+    append_le<uint32_t>(head, block_size);
+    append_le<uint32_t>(head, 0);
+    head.insert(head.end(), compressed_metadata.begin(), compressed_metadata.end());
+
+    auto body_offset = head.size() + block_index.size();
+    for (size_t at = 0; at < block_index.size(); at += 24) {
+        uint64_t offset {};
+        memcpy(&offset, &block_index[at], sizeof(offset));
+        offset += body_offset;
+        memcpy(&block_index[at], &offset, sizeof(offset));
+    }
+    head.insert(head.end(), block_index.begin(), block_index.end());
+    return head;
+}
+
+// The package is derived from its path, so every server instance serves identical bytes.
+export synthetic_package_t make_synthetic_package(std::string_view path, size_t files, size_t file_size, int format_version = 1, size_t block_size = 1 << 20, codec_t codec = codec_t::xz, bool digests = false)
+{
+    static const char* words[] = { "static", "linux", "app", "package", "lib", "usr", "bin", "share", "include", "config" };
+    auto rng = std::mt19937 { (uint32_t)std::hash<std::string_view> {}(path) };
+
+    auto package = synthetic_package_t {};
+    auto metadata = std::string { "files:\n" };
+    auto digest_section = std::string { "digests:\n" };
+    auto contents = std::vector<uint8_t> {};
+    // Block offsets are relative to `contents` until its position is known.
+    auto block_index = std::vector<uint8_t> {};
+    for (size_t i = 0; i < files; ++i) {
+        auto raw = std::vector<uint8_t> {};
+        raw.reserve(file_size + 16);
+        while (raw.size() < file_size) {
+            auto word = words[rng() % std::size(words)];
+            raw.insert(raw.end(), word, word + strlen(word));
+            raw.push_back(rng() % 8 ? ' ' : '\n');
+        }
+        raw.resize(file_size);
+
+        auto compressed = std::vector<uint8_t> {};
+        if (format_version == 1) {
+            compressed = compress(codec, raw);
+        } else {
+            for (size_t at = 0; at < raw.size(); at += block_size) {
+                auto block = compress(codec, std::span { raw }.subspan(at, std::min(block_size, raw.size() - at)));
+                append_le<uint64_t>(block_index, contents.size() + compressed.size());
+                append_le<uint32_t>(block_index, block.size());
+                append_le<uint32_t>(block_index, std::min(block_size, raw.size() - at));
+                append_le<uint32_t>(block_index, i);
+                append_le<uint32_t>(block_index, lzma_crc32(block.data(), block.size(), 0));
+                compressed.insert(compressed.end(), block.begin(), block.end());
+            }
+        }
+        auto filepath = std::format("file{}.dat", i);
+        auto tag = codec == codec_t::xz ? std::string {} : std::format("[{}] ", codec_name(codec));
+        std::format_to(std::back_inserter(metadata), "  - {} -rw-r--r-- {} {}{}\n", md5_string(raw), compressed.size(), tag, filepath);
+        if (digests) {
+            auto digest = tree_digest(raw, format_version == 1 ? 1 << 20 : block_size);
+            std::format_to(std::back_inserter(digest_section), "  {}:\n    blake3: {}\n    chunk_size: {}\n    chunks:\n", filepath, to_hex(digest.root), digest.chunk_size);
+            for (const auto& chunk : digest.chunks) {
+                std::format_to(std::back_inserter(digest_section), "      - {}\n", to_hex(chunk));
+            }
+        }
+        contents.insert(contents.end(), compressed.begin(), compressed.end());
+        package.filepaths.push_back(std::move(filepath));
+    }
+    if (digests) {
+        metadata += digest_section;
+    }
+
+    if (format_version != 1) {
+        package.data = make_v2_head(metadata, std::move(block_index), block_size);
+        package.data.insert(package.data.end(), contents.begin(), contents.end());
+        return package;
+    }
+
+    // The header stores the metadata length in its upper 24 bits, so the length is padded to a
+    // multiple of 256; xz accepts zero padding after a stream.
+    auto compressed_metadata = xz_compress({ (const uint8_t*)metadata.data(), metadata.size() });
+    compressed_metadata.resize((compressed_metadata.size() + 0xff) & ~0xff);
+    uint32_t metadata_len = compressed_metadata.size();
+
+    package.data = { 0xF1, 'S', 'L', 'P', 0x00, 0, 0, 0 };
+    memcpy(package.data.data() + 5, (const uint8_t*)&metadata_len + 1, 3);
+    package.data.insert(package.data.end(), compressed_metadata.begin(), compressed_metadata.end());
+    package.data.insert(package.data.end(), contents.begin(), contents.end());
+    return package;
+}
+
+// A v2 package whose files are one random block of `block_size` bytes repeated, rounded up to
+// whole blocks. Only that block is compressed and held, so files of many gigabytes are cheap to
+// serve; the random content makes the compressed size as large as the file. Files are checked by
+// their MD5, no digests are listed.
+export synthetic_package_t make_generated_package(std::string_view path, size_t files, uint64_t file_size, size_t block_size = 1 << 20, codec_t codec = codec_t::xz)
+{
+    auto rng = std::mt19937 { (uint32_t)std::hash<std::string_view> {}(path) };
+    auto raw = std::vector<uint8_t>(block_size);
+    for (auto& byte : raw) {
+        byte = rng();
+    }
+
+    auto package = synthetic_package_t { .block = compress(codec, raw) };
+    auto blocks = std::max<uint64_t>((file_size + block_size - 1) / block_size, 1);
+    auto hasher = md5_hasher_t {};
+    for (uint64_t i = 0; i < blocks; ++i) {
+        hasher.update(raw);
+    }
+    auto md5 = hasher.finish();
+    auto crc = lzma_crc32(package.block.data(), package.block.size(), 0);
+
+    auto metadata = std::string { "files:\n" };
+    auto block_index = std::vector<uint8_t> {};
+    auto tag = codec == codec_t::xz ? std::string {} : std::format("[{}] ", codec_name(codec));
+    for (size_t i = 0; i < files; ++i) {
+        for (uint64_t j = 0; j < blocks; ++j) {
+            append_le<uint64_t>(block_index, (i * blocks + j) * package.block.size());
+            append_le<uint32_t>(block_index, package.block.size());
+            append_le<uint32_t>(block_index, block_size);
+            append_le<uint32_t>(block_index, i);
+            append_le<uint32_t>(block_index, crc);
+        }
+        auto filepath = std::format("file{}.dat", i);
+        std::format_to(std::back_inserter(metadata), "  - {} -rw-r--r-- {} {}{}\n", md5, blocks * package.block.size(), tag, filepath);
+        package.filepaths.push_back(std::move(filepath));
+    }
+    package.data = make_v2_head(metadata, std::move(block_index), block_size);
+    package.body_size = files * blocks * package.block.size();
+    return package;
+}
+
+// Serves synthetic packages for any /NAME/VERSION/ARCH/NAME-VERSION-ARCH.slp path, with Range
+// support, from the message_queue_t of the thread running serve_async().
+export class mirror_server_t {
+public:
+    explicit mirror_server_t(mirror_server_options_t options)
+        : m_options { std::move(options) }
+        , m_rng { std::random_device {}() }
+    {
+        m_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+        if (m_listen_fd < 0) {
+            throw std::system_error { errno, std::system_category(), "create socket failed" };
+        }
+
+        int yes = 1;
+        setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+        auto address = sockaddr_in {
+            .sin_family = AF_INET,
+            .sin_port = htons(m_options.port),
+            .sin_addr = { htonl(INADDR_LOOPBACK) },
+        };
+        if (bind(m_listen_fd, (const sockaddr*)&address, sizeof(address)) < 0) {
+            throw std::system_error { errno, std::system_category(), std::format("bind to port {} failed", m_options.port) };
+        }
+        if (listen(m_listen_fd, SOMAXCONN) < 0) {
+            throw std::system_error { errno, std::system_category(), "listen failed" };
+        }
+
+        socklen_t len = sizeof(address);
+        getsockname(m_listen_fd, (sockaddr*)&address, &len);
+        m_port = ntohs(address.sin_port);
+    }
+
+    mirror_server_t(const mirror_server_t&) = delete;
+
+    ~mirror_server_t()
+    {
+        close(m_listen_fd);
+    }
+
+    mirror_server_t& operator=(const mirror_server_t&) = delete;
+
+    uint16_t port() const
+    {
+        return m_port;
+    }
+
+    std::string base_url() const
+    {
+        return std::format("http://127.0.0.1:{}", m_port);
+    }
+
+    // Builds a package ahead of time, so that the first request for it isn't slowed down by the
+    // compression. Not thread-safe, call it before serve_async().
+    void preload(const std::string& path)
+    {
+        find_package(path);
+    }
+
+    // Accepts connections forever.
+    task_t<void> serve_async()
+    {
+        auto& queue = message_queue_t::current();
+        while (true) {
+            auto fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    co_await queue.await(m_listen_fd, EPOLLIN);
+                    continue;
+                } else if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                throw std::system_error { errno, std::system_category(), "accept failed" };
+            }
+
+            int yes = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+            auto connection = std::make_shared<connection_t>(fd);
+            connection->stream.set_idle_timeout(m_options.keep_alive_timeout);
+            read_requests_async(connection);
+            write_responses_async(this, connection);
+        }
+    }
+
+private:
+    struct request_t {
+        std::string path {};
+        std::string range {};
+        bool close {};
+        std::chrono::steady_clock::time_point arrival {};
+    };
+
+    // Requests are parsed as soon as they arrive and answered in order by a separate writer, so
+    // that the latency of pipelined requests overlaps.
+    struct connection_t {
+        explicit connection_t(int fd)
+            : stream { fd }
+            , write_fd { fcntl(fd, F_DUPFD_CLOEXEC, 0) }
+        {
+        }
+
+        ~connection_t()
+        {
+            close(write_fd);
+        }
+
+        read_stream_t stream;
+        // message_queue_t allows one waiter per fd, the writer waits on its own descriptor.
+        int write_fd {};
+        std::deque<request_t> requests {};
+        bool reading_done {};
+        std::shared_ptr<task_state_t<void>> wake {};
+
+        void notify()
+        {
+            if (auto wake_state = std::exchange(wake, nullptr)) {
+                wake_state->set_value();
+            }
+        }
+    };
+
+    static task_t<void> read_requests_async(std::shared_ptr<connection_t> connection)
+    {
+        try {
+            while (true) {
+                auto line = co_await connection->stream.read_line_async();
+                if (line.empty()) {
+                    // Tolerate blank lines between requests.
+                    continue;
+                }
+
+                auto request = request_t { .arrival = std::chrono::steady_clock::now() };
+                auto method_end = line.find(' ');
+                auto path_end = line.find(' ', method_end + 1);
+                if (method_end == std::string::npos || path_end == std::string::npos) {
+                    break;
+                }
+                request.path = line.substr(method_end + 1, path_end - method_end - 1);
+
+                while (true) {
+                    auto header = co_await connection->stream.read_line_async();
+                    if (header.empty()) {
+                        break;
+                    }
+                    auto colon = header.find(':');
+                    if (colon == std::string::npos) {
+                        continue;
+                    }
+                    auto name = tolower(header.substr(0, colon));
+                    auto value = trim(header.substr(colon + 1));
+                    if (name == "range") {
+                        request.range = value;
+                    } else if (name == "connection") {
+                        request.close = tolower(value) == "close";
+                    }
+                }
+
+                connection->requests.push_back(std::move(request));
+                connection->notify();
+            }
+        } catch (...) {
+            // The client closed, went idle or the writer shut the connection down.
+        }
+        connection->reading_done = true;
+        connection->notify();
+    }
+
+    static task_t<void> write_responses_async(mirror_server_t* server, std::shared_ptr<connection_t> connection)
+    {
+        size_t served {};
+        try {
+            while (true) {
+                if (connection->requests.empty()) {
+                    if (connection->reading_done) {
+                        break;
+                    }
+                    connection->wake = std::make_shared<task_state_t<void>>();
+                    co_await task_t<void> { connection->wake };
+                    continue;
+                }
+
+                auto request = std::move(connection->requests.front());
+                connection->requests.pop_front();
+
+                auto& options = server->m_options;
+                if (auto ready = request.arrival + options.latency; ready > std::chrono::steady_clock::now()) {
+                    co_await sleep_for(std::chrono::ceil<std::chrono::milliseconds>(ready - std::chrono::steady_clock::now()));
+                }
+
+                auto last = ++served >= options.max_keep_alive || request.close;
+                auto drop = std::uniform_real_distribution<double> {}(server->m_rng) < options.drop_rate;
+                co_await server->respond_async(connection->write_fd, request, last, drop);
+                if (last || drop) {
+                    break;
+                }
+            }
+        } catch (...) {
+            // The client went away mid-response.
+        }
+
+        // Unblocks the reader, which releases the connection.
+        shutdown(connection->write_fd, SHUT_RDWR);
+    }
+
+    task_t<void> respond_async(int fd, const request_t& request, bool last, bool drop)
+    {
+        const auto* package = find_package(request.path);
+        if (!package) {
+            co_await write_async(fd, std::format("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: {}\r\n\r\n", last ? "close" : "keep-alive"));
+            co_return;
+        }
+
+        auto size = package->size();
+        uint64_t first {};
+        uint64_t end = size;
+        auto status = "200 OK";
+        auto content_range = std::string {};
+        if (!request.range.empty()) {
+            if (auto range = parse_range_header(request.range, size)) {
+                std::tie(first, end) = *range;
+                status = "206 Partial Content";
+                content_range = std::format("Content-Range: bytes {}-{}/{}\r\n", first, end - 1, size);
+            } else {
+                co_await write_async(fd, std::format("HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\nContent-Range: bytes */{}\r\nConnection: {}\r\n\r\n", size, last ? "close" : "keep-alive"));
+                co_return;
+            }
+        }
+
+        co_await write_async(fd, std::format("HTTP/1.1 {}\r\nContent-Type: application/octet-stream\r\nContent-Length: {}\r\n{}Accept-Ranges: bytes\r\nConnection: {}\r\n\r\n", status, end - first, content_range, last ? "close" : "keep-alive"));
+
+        if (drop) {
+            end = first + (end - first) / 2;
+        }
+        // A generated body goes out a block at a time.
+        for (auto at = first; at < end;) {
+            auto piece = package->piece(at, end - at);
+            co_await write_body_async(fd, piece);
+            at += piece.size();
+        }
+    }
+
+    // Paces the body to the bandwidth cap in 16KB chunks.
+    task_t<void> write_body_async(int fd, std::string_view body)
+    {
+        if (!m_options.bandwidth) {
+            co_await write_async(fd, body);
+            co_return;
+        }
+
+        constexpr size_t CHUNK = 16 << 10;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t sent = 0; sent < body.size();) {
+            auto num = std::min(CHUNK, body.size() - sent);
+            co_await write_async(fd, body.substr(sent, num));
+            sent += num;
+
+            auto due = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>((double)sent / m_options.bandwidth));
+            if (auto now = std::chrono::steady_clock::now(); due > now) {
+                co_await sleep_for(std::chrono::ceil<std::chrono::milliseconds>(due - now));
+            }
+        }
+    }
+
+    const synthetic_package_t* find_package(const std::string& path)
+    {
+        if (!path.ends_with(".slp")) {
+            return nullptr;
+        }
+        auto it = m_packages.find(path);
+        if (it == m_packages.end()) {
+            auto package = m_options.generated
+                ? make_generated_package(path, m_options.files, m_options.file_size, m_options.block_size, m_options.codec)
+                : make_synthetic_package(path, m_options.files, m_options.file_size, m_options.format_version, m_options.block_size, m_options.codec, m_options.digests);
+            it = m_packages.emplace(path, std::move(package)).first;
+        }
+        return &it->second;
+    }
+
+    mirror_server_options_t m_options {};
+    int m_listen_fd { -1 };
+    uint16_t m_port {};
+    std::mt19937 m_rng {};
+    std::unordered_map<std::string, synthetic_package_t> m_packages {};
+};
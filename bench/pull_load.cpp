@@ -0,0 +1,332 @@
+import codec;
+import cppl;
+import http_client;
+import message_queue;
+import mirror_server;
+import pull;
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unistd.h>
+#include <vector>
+
+using cppl::task_t;
+
+struct Options {
+    bool help {};
+    bool json {};
+    bool serve {};
+    bool pipeline {};
+    size_t pulls { 200 };
+    size_t concurrency { 16 };
+    size_t packages { 4 };
+    mirror_server_options_t server {};
+};
+
+struct result_t {
+    std::string name {};
+    size_t requests {};
+    size_t failures {};
+    double elapsed_ms {};
+    size_t bytes {};
+    // Per request, in milliseconds.
+    std::vector<double> latencies {};
+};
+
+static const char* option_value(int& argc, const char**& argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "missing value for option: %s\n", *argv);
+        exit(1);
+    }
+    --argc;
+    return *++argv;
+}
+
+static Options parse_options(int& argc, const char**& argv)
+{
+    auto options = Options {};
+    while (argc && **argv == '-') {
+        auto name = *argv + 1;
+        if (!strcmp(name, "h") || !strcmp(name, "-help")) {
+            options.help = true;
+        } else if (!strcmp(name, "-json")) {
+            options.json = true;
+        } else if (!strcmp(name, "-serve")) {
+            options.serve = true;
+        } else if (!strcmp(name, "-pipeline")) {
+            options.pipeline = true;
+        } else if (!strcmp(name, "-pulls")) {
+            options.pulls = atoll(option_value(argc, argv));
+        } else if (!strcmp(name, "-concurrency")) {
+            options.concurrency = std::max(atoll(option_value(argc, argv)), 1ll);
+        } else if (!strcmp(name, "-packages")) {
+            options.packages = std::max(atoll(option_value(argc, argv)), 1ll);
+        } else if (!strcmp(name, "-port")) {
+            options.server.port = atoi(option_value(argc, argv));
+        } else if (!strcmp(name, "-latency")) {
+            options.server.latency = std::chrono::milliseconds { atoll(option_value(argc, argv)) };
+        } else if (!strcmp(name, "-bandwidth")) {
+            options.server.bandwidth = atoll(option_value(argc, argv));
+        } else if (!strcmp(name, "-drop-rate")) {
+            options.server.drop_rate = atof(option_value(argc, argv));
+        } else if (!strcmp(name, "-keep-alive")) {
+            options.server.max_keep_alive = std::max(atoll(option_value(argc, argv)), 1ll);
+        } else if (!strcmp(name, "-files")) {
+            options.server.files = std::max(atoll(option_value(argc, argv)), 1ll);
+        } else if (!strcmp(name, "-file-size")) {
+            options.server.file_size = atoll(option_value(argc, argv));
+        } else if (!strcmp(name, "-format")) {
+            options.server.format_version = atoi(option_value(argc, argv)) == 2 ? 2 : 1;
+        } else if (!strcmp(name, "-codec")) {
+            auto codec = parse_codec(option_value(argc, argv));
+            if (!codec) {
+                fprintf(stderr, "unknown codec: %s\n", *argv);
+                exit(1);
+            }
+            options.server.codec = *codec;
+        } else if (!strcmp(name, "-digests")) {
+            options.server.digests = true;
+        } else if (!strcmp(name, "-generated")) {
+            options.server.generated = true;
+        } else if (!strcmp(name, "-block-size")) {
+            options.server.block_size = std::max(atoll(option_value(argc, argv)), 1ll);
+        } else {
+            fprintf(stderr, "unknown option: %s\n", *argv);
+            exit(1);
+        }
+        --argc;
+        ++argv;
+    }
+    return options;
+}
+
+static void print_help()
+{
+    fprintf(stdout, R"(Runs concurrent pulls against a local stand-in for the package mirror
+Usage: pull-load [OPTIONS]
+
+Options:
+    -h,--help                   Print this help message and exit
+    --json                      Print results as JSON instead of CSV
+    --pulls N                   Number of pulls to run (default: 200)
+    --concurrency N             Pulls in flight at once (default: 16)
+    --packages N                Distinct packages pulled from (default: 4)
+    --pipeline                  Fetch 100 small ranges sequentially and then pipelined instead
+    --serve                     Only run the mirror until killed, see --port
+
+Mirror options:
+    --port N                    Listen on 127.0.0.1:N (default: any free port)
+    --latency MS                Delay of each response (default: 0)
+    --bandwidth BYTES           Per connection bytes per second (default: unlimited)
+    --drop-rate R               Probability of cutting a response short (default: 0)
+    --keep-alive N              Responses per connection (default: 100)
+    --files N                   Files per package (default: 8)
+    --file-size BYTES           Uncompressed size of each file (default: 65536)
+    --format 1|2                Package layout, 2 is block-indexed (default: 1)
+    --block-size BYTES          Uncompressed block size of --format 2 (default: 1048576)
+    --codec xz|zstd             Compression of the files (default: xz)
+    --digests                   List a BLAKE3 tree digest of every file
+    --generated                 Serve block-indexed files that repeat one random block, so
+                                a --file-size of many gigabytes costs no memory
+)");
+}
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct load_state_t {
+    const Options& options;
+    size_t next {};
+    result_t result {};
+};
+
+static task_t<void> pull_worker_async(load_state_t& state)
+{
+    while (state.next < state.options.pulls) {
+        auto index = state.next++;
+        auto arg = std::format("pkg{}/file{}.dat:1.0", index % state.options.packages, index % state.options.server.files);
+        const char* argv[] = { arg.c_str() };
+
+        auto start = std::chrono::steady_clock::now();
+        try {
+            co_await pull_async(1, argv);
+            state.result.latencies.push_back(elapsed_ms(start));
+            state.result.bytes += state.options.server.file_size;
+        } catch (const std::exception& ex) {
+            fprintf(stderr, "pull %s failed: %s\n", arg.c_str(), ex.what());
+            ++state.result.failures;
+        }
+    }
+}
+
+static result_t run_pulls(const Options& options)
+{
+    auto& queue = message_queue_t::current();
+    auto state = load_state_t { .options = options, .result = { .name = "pull", .requests = options.pulls } };
+
+    auto start = std::chrono::steady_clock::now();
+    auto workers = std::vector<task_t<void>> {};
+    for (size_t i = 0; i < options.concurrency; ++i) {
+        workers.push_back(pull_worker_async(state));
+    }
+    for (auto& worker : workers) {
+        queue.wait(worker);
+    }
+    state.result.elapsed_ms = elapsed_ms(start);
+    return state.result;
+}
+
+static std::unordered_multimap<std::string, std::string> range_header(size_t offset, size_t size)
+{
+    return { { "range", std::format("bytes={}-{}", offset, offset + size - 1) } };
+}
+
+// Small ranges of one package, the access pattern of a multi-file pull.
+static task_t<result_t> fetch_ranges_async(std::string base_url, bool pipelined)
+{
+    constexpr size_t REQUESTS = 100;
+    constexpr size_t RANGE_SIZE = 64;
+
+    auto url = base_url + "/pkg0/1.0/amd64/pkg0-1.0-amd64.slp";
+    auto result = result_t { .name = pipelined ? "ranges/pipelined" : "ranges/sequential", .requests = REQUESTS };
+    auto start = std::chrono::steady_clock::now();
+    if (pipelined) {
+        auto pipeline = http_pipeline_t { base_url };
+        auto tasks = std::vector<task_t<http_response_t>> {};
+        for (size_t i = 0; i < REQUESTS; ++i) {
+            tasks.push_back(pipeline.get_async(url, range_header(i * RANGE_SIZE, RANGE_SIZE)));
+        }
+        for (auto& task : tasks) {
+            auto response = co_await task;
+            if (response.status < 200 || response.status > 299) {
+                ++result.failures;
+            }
+            result.bytes += response.body.size();
+            result.latencies.push_back(elapsed_ms(start));
+        }
+    } else {
+        for (size_t i = 0; i < REQUESTS; ++i) {
+            auto request_start = std::chrono::steady_clock::now();
+            result.bytes += (co_await http_get_async(url, range_header(i * RANGE_SIZE, RANGE_SIZE))).size();
+            result.latencies.push_back(elapsed_ms(request_start));
+        }
+    }
+    result.elapsed_ms = elapsed_ms(start);
+    co_return result;
+}
+
+static void print_results(FILE* out, std::vector<result_t>& results, bool json)
+{
+    if (!json) {
+        fprintf(out, "name,requests,failures,elapsed_ms,requests_per_second,bytes_per_second,p50_ms,p95_ms,p99_ms\n");
+    } else {
+        fprintf(out, "{\"results\":[");
+    }
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto& result = results[i];
+        std::sort(result.latencies.begin(), result.latencies.end());
+        auto seconds = result.elapsed_ms / 1000;
+        auto requests_per_second = (result.requests - result.failures) / seconds;
+        auto bytes_per_second = result.bytes / seconds;
+        auto p50 = percentile(result.latencies, 0.50);
+        auto p95 = percentile(result.latencies, 0.95);
+        auto p99 = percentile(result.latencies, 0.99);
+        auto row = json
+            ? std::format("{}\n  {{\"name\":\"{}\",\"requests\":{},\"failures\":{},\"elapsed_ms\":{:.1f},\"requests_per_second\":{:.1f},\"bytes_per_second\":{:.0f},\"p50_ms\":{:.2f},\"p95_ms\":{:.2f},\"p99_ms\":{:.2f}}}",
+                i ? "," : "", result.name, result.requests, result.failures, result.elapsed_ms, requests_per_second, bytes_per_second, p50, p95, p99)
+            : std::format("{},{},{},{:.1f},{:.1f},{:.0f},{:.2f},{:.2f},{:.2f}\n",
+                result.name, result.requests, result.failures, result.elapsed_ms, requests_per_second, bytes_per_second, p50, p95, p99);
+        fputs(row.c_str(), out);
+    }
+    if (json) {
+        fprintf(out, "\n]}\n");
+    }
+}
+
+int main(int argc, const char* argv[])
+{
+    --argc;
+    ++argv;
+
+    auto options = parse_options(argc, argv);
+    if (options.help) {
+        print_help();
+        return 0;
+    }
+
+    try {
+        auto server = std::make_shared<mirror_server_t>(options.server);
+        for (size_t i = 0; i < options.packages; ++i) {
+            server->preload(std::format("/pkg{0}/1.0/amd64/pkg{0}-1.0-amd64.slp", i));
+        }
+        if (options.serve) {
+            fprintf(stderr, "serving on %s\n", server->base_url().c_str());
+            message_queue_t::current().wait(server->serve_async());
+            return 0;
+        }
+
+        // The mirror gets its own thread and message loop so it doesn't share CPU time slices
+        // with the pulls being measured.
+        std::thread { [server] {
+            try {
+                message_queue_t::current().wait(server->serve_async());
+            } catch (const std::exception& ex) {
+                fprintf(stderr, "mirror failed: %s\n", ex.what());
+                exit(1);
+            }
+        } }.detach();
+
+        auto results = std::vector<result_t> {};
+        if (options.pipeline) {
+            results.push_back(message_queue_t::current().wait(fetch_ranges_async(server->base_url(), /*pipelined=*/false)));
+            results.push_back(message_queue_t::current().wait(fetch_ranges_async(server->base_url(), /*pipelined=*/true)));
+            print_results(stdout, results, options.json);
+            return 0;
+        }
+
+        // Pulls install into HOME and read their mirror from APP_MIRRORS.
+        char home[] = "/tmp/pull-load-XXXXXX";
+        if (!mkdtemp(home)) {
+            throw std::system_error { errno, std::system_category(), "mkdtemp failed" };
+        }
+        setenv("HOME", home, 1);
+        setenv("APP_MIRRORS", server->base_url().c_str(), 1);
+
+        // pull reports progress on stdout, keep it for the results only.
+        auto report = fdopen(fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0), "w");
+        if (!report || !freopen("/dev/null", "w", stdout)) {
+            throw std::system_error { errno, std::system_category(), "redirect stdout failed" };
+        }
+
+        results.push_back(run_pulls(options));
+        std::filesystem::remove_all(home);
+        print_results(report, results, options.json);
+        fclose(report);
+    } catch (const std::exception& ex) {
+        fprintf(stderr, "pull-load failed: %s\n", ex.what());
+        return 1;
+    }
+    return 0;
+}
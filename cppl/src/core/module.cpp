@@ -1,4 +1,5 @@
 module;
 
 export module cppl.core;
-export import :task;
\ No newline at end of file
+export import :task;
+export import :trace;
\ No newline at end of file
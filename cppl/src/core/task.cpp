@@ -5,6 +5,7 @@ module;
 #include <future>
 
 export module cppl.core:task;
+import :trace;
 
 namespace cppl {
 
@@ -27,6 +28,7 @@ public:
     {
         m_promise.set_value(std::move(value));
         if (m_handle) {
+            trace::record(trace::phase_t::begin, "resume", m_handle.address());
             m_handle();
         }
     }
@@ -35,6 +37,7 @@ public:
     {
         m_promise.set_exception(std::move(ptr));
         if (this->m_handle) {
+            trace::record(trace::phase_t::begin, "resume", m_handle.address());
             this->m_handle();
         }
     }
@@ -69,6 +72,7 @@ public:
     {
         m_promise.set_value();
         if (m_handle) {
+            trace::record(trace::phase_t::begin, "resume", m_handle.address());
             m_handle();
         }
     }
@@ -77,6 +81,7 @@ public:
     {
         m_promise.set_exception(std::move(ptr));
         if (this->m_handle) {
+            trace::record(trace::phase_t::begin, "resume", m_handle.address());
             this->m_handle();
         }
     }
@@ -102,11 +107,13 @@ struct task_t {
 
         std::suspend_never initial_suspend()
         {
+            trace::record(trace::phase_t::begin, "create", std::coroutine_handle<promise_type>::from_promise(*this).address());
             return {};
         }
 
         std::suspend_never final_suspend() noexcept
         {
+            trace::record(trace::phase_t::end, "complete", std::coroutine_handle<promise_type>::from_promise(*this).address());
             return {};
         }
 
@@ -136,6 +143,7 @@ struct task_t {
 
     void await_suspend(std::coroutine_handle<> h)
     {
+        trace::record(trace::phase_t::end, "suspend", h.address());
         m_state->set_handle(std::move(h));
     }
 
@@ -158,11 +166,13 @@ struct task_t<void> {
 
         std::suspend_never initial_suspend()
         {
+            trace::record(trace::phase_t::begin, "create", std::coroutine_handle<promise_type>::from_promise(*this).address());
             return {};
         }
 
         std::suspend_never final_suspend() noexcept
         {
+            trace::record(trace::phase_t::end, "complete", std::coroutine_handle<promise_type>::from_promise(*this).address());
             return {};
         }
 
@@ -193,6 +203,7 @@ struct task_t<void> {
 
     void await_suspend(std::coroutine_handle<> h)
     {
+        trace::record(trace::phase_t::end, "suspend", h.address());
         m_state->set_handle(std::move(h));
     }
 
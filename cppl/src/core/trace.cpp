@@ -0,0 +1,179 @@
+module;
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+export module cppl.core:trace;
+
+// Records a timeline of coroutine execution in Chrome's Trace Event format, viewable in Perfetto.
+// Built only with -DCPPL_TRACE; otherwise every recording call is an empty inline function.
+namespace cppl::trace {
+
+#ifdef CPPL_TRACE
+export constexpr bool enabled = true;
+#else
+export constexpr bool enabled = false;
+#endif
+
+// Chrome trace event phases.
+export enum class phase_t : char {
+    begin = 'B',
+    end = 'E',
+    async_begin = 'b',
+    async_end = 'e',
+    instant = 'i',
+};
+
+struct event_t {
+    uint64_t ts_ns {};
+    // Must have static storage duration, only the pointer is recorded.
+    const char* name {};
+    const void* id {};
+    int64_t arg {};
+    phase_t phase {};
+};
+
+// Single producer ring buffer, owned by one thread. Keeps the newest CAPACITY events; the dump
+// reads it from another thread at exit, the release store of m_size publishes each event.
+class ring_buffer_t {
+    static constexpr size_t CAPACITY = 1 << 16;
+
+public:
+    explicit ring_buffer_t(int tid)
+        : m_tid { tid }
+    {
+    }
+
+    void push(const event_t& event)
+    {
+        auto size = m_size.load(std::memory_order_relaxed);
+        m_events[size % CAPACITY] = event;
+        m_size.store(size + 1, std::memory_order_release);
+    }
+
+    template <typename F>
+    void for_each(F&& f) const
+    {
+        auto size = m_size.load(std::memory_order_acquire);
+        for (auto i = size > CAPACITY ? size - CAPACITY : 0; i < size; ++i) {
+            f(m_events[i % CAPACITY]);
+        }
+    }
+
+    int tid() const
+    {
+        return m_tid;
+    }
+
+private:
+    int m_tid {};
+    std::atomic<uint64_t> m_size {};
+    std::unique_ptr<event_t[]> m_events { std::make_unique<event_t[]>(CAPACITY) };
+};
+
+// Owns the buffers of every thread that recorded something and writes them out at exit, to
+// $CPPL_TRACE_FILE or cppl-trace-<pid>.json.
+class registry_t {
+public:
+    static registry_t& instance()
+    {
+        static registry_t s_instance {};
+        return s_instance;
+    }
+
+    ~registry_t()
+    {
+        dump();
+    }
+
+    ring_buffer_t& register_thread()
+    {
+        auto lock = std::lock_guard { m_mutex };
+        return *m_buffers.emplace_back(std::make_unique<ring_buffer_t>((int)gettid()));
+    }
+
+    void dump()
+    {
+        auto lock = std::lock_guard { m_mutex };
+        auto path = getenv("CPPL_TRACE_FILE") ? std::string { getenv("CPPL_TRACE_FILE") } : "cppl-trace-" + std::to_string(getpid()) + ".json";
+        auto fp = fopen(path.c_str(), "w");
+        if (!fp) {
+            fprintf(stderr, "can't write trace file: %s\n", path.c_str());
+            return;
+        }
+
+        auto pid = (int)getpid();
+        auto first = true;
+        fprintf(fp, "{\"traceEvents\":[");
+        for (const auto& buffer : m_buffers) {
+            buffer->for_each([&](const event_t& event) {
+                fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"cppl\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+                    first ? "" : ",", event.name, (char)event.phase, event.ts_ns / 1000.0, pid, buffer->tid());
+                if (event.phase == phase_t::async_begin || event.phase == phase_t::async_end) {
+                    fprintf(fp, ",\"id\":\"%p\"", event.id);
+                }
+                if (event.phase == phase_t::instant) {
+                    fprintf(fp, ",\"s\":\"t\"");
+                }
+                fprintf(fp, ",\"args\":{\"id\":\"%p\",\"arg\":%lld}}", event.id, (long long)event.arg);
+                first = false;
+            });
+        }
+        fprintf(fp, "\n]}\n");
+        fclose(fp);
+    }
+
+private:
+    std::mutex m_mutex {};
+    std::vector<std::unique_ptr<ring_buffer_t>> m_buffers {};
+};
+
+export inline void record(phase_t phase, const char* name, const void* id = nullptr, int64_t arg = 0)
+{
+    if constexpr (enabled) {
+        static thread_local ring_buffer_t& t_buffer = registry_t::instance().register_thread();
+        auto ts = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        t_buffer.push({ .ts_ns = (uint64_t)ts, .name = name, .id = id, .arg = arg, .phase = phase });
+    }
+}
+
+// A user-named span, e.g. a phase of a command. It is recorded as an async event on its own track
+// because a span may stay open while its coroutine is suspended. `name` must outlive the process.
+export class span_t {
+public:
+    explicit span_t(const char* name)
+        : m_name { name }
+    {
+        record(phase_t::async_begin, m_name, this);
+    }
+
+    span_t(const span_t&) = delete;
+
+    ~span_t()
+    {
+        end();
+    }
+
+    span_t& operator=(const span_t&) = delete;
+
+    void end()
+    {
+        if (m_name) {
+            record(phase_t::async_end, m_name, this);
+            m_name = nullptr;
+        }
+    }
+
+private:
+    const char* m_name {};
+};
+
+}
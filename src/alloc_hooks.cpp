@@ -0,0 +1,116 @@
+// Replaces the global allocation functions to feed alloc_stats. Linked into the executables only
+// with -DAPP_ALLOC_STATS=ON, a replacement in a static library would never be pulled in.
+import alloc_stats;
+
+#include <algorithm>
+#include <cstdlib>
+#include <malloc.h>
+#include <new>
+
+// The usable size is counted on both sides, so sized and unsized deletes balance.
+static void* allocate(std::size_t size)
+{
+    auto ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc {};
+    }
+    alloc_stats_on_allocate(malloc_usable_size(ptr));
+    return ptr;
+}
+
+static void* allocate_aligned(std::size_t size, std::align_val_t alignment)
+{
+    auto align = std::max((std::size_t)alignment, sizeof(void*));
+    void* ptr {};
+    if (posix_memalign(&ptr, align, size ? size : 1)) {
+        throw std::bad_alloc {};
+    }
+    alloc_stats_on_allocate(malloc_usable_size(ptr));
+    return ptr;
+}
+
+static void deallocate(void* ptr) noexcept
+{
+    if (ptr) {
+        alloc_stats_on_free(malloc_usable_size(ptr));
+        free(ptr);
+    }
+}
+
+void* operator new(std::size_t size)
+{
+    return allocate(size);
+}
+
+void* operator new[](std::size_t size)
+{
+    return allocate(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    try {
+        return allocate(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    try {
+        return allocate(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    return allocate_aligned(size, alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return allocate_aligned(size, alignment);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept
+{
+    deallocate(ptr);
+}
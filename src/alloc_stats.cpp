@@ -0,0 +1,133 @@
+module;
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <sys/resource.h>
+
+export module alloc_stats;
+
+// Allocation accounting, fed by the operator new/delete replacements in alloc_hooks.cpp. Only
+// built with the APP_ALLOC_STATS CMake option; otherwise every counter stays zero.
+#ifdef APP_ALLOC_STATS
+export constexpr bool alloc_stats_enabled = true;
+#else
+export constexpr bool alloc_stats_enabled = false;
+#endif
+
+export struct alloc_snapshot_t {
+    uint64_t allocations {};
+    uint64_t allocated_bytes {};
+    uint64_t live_bytes {};
+};
+
+// Windows track the peak of live bytes while they are open, a few may be open at once.
+constexpr uint32_t MAX_WINDOWS = 16;
+
+std::atomic<uint64_t> g_allocations {};
+std::atomic<uint64_t> g_allocated_bytes {};
+std::atomic<uint64_t> g_live_bytes {};
+std::atomic<uint32_t> g_open_windows {};
+std::atomic<uint64_t> g_window_peaks[MAX_WINDOWS] {};
+
+static void raise_peak(std::atomic<uint64_t>& peak, uint64_t value)
+{
+    auto current = peak.load(std::memory_order_relaxed);
+    while (current < value && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+// Called by the allocation hooks, must not allocate.
+export void alloc_stats_on_allocate(uint64_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    g_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    auto live = g_live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+    for (auto open = g_open_windows.load(std::memory_order_relaxed); open; open &= open - 1) {
+        raise_peak(g_window_peaks[__builtin_ctz(open)], live);
+    }
+}
+
+export void alloc_stats_on_free(uint64_t size)
+{
+    g_live_bytes.fetch_sub(size, std::memory_order_relaxed);
+}
+
+export alloc_snapshot_t alloc_snapshot()
+{
+    return {
+        .allocations = g_allocations.load(std::memory_order_relaxed),
+        .allocated_bytes = g_allocated_bytes.load(std::memory_order_relaxed),
+        .live_bytes = g_live_bytes.load(std::memory_order_relaxed),
+    };
+}
+
+// High-water mark of the resident set of the process so far.
+export uint64_t peak_rss_bytes()
+{
+    auto usage = rusage {};
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t)usage.ru_maxrss * 1024;
+}
+
+// Measures the allocations and the peak of live bytes between its construction and stop().
+// Counts are process wide, so concurrent work inside the window is included.
+export class alloc_window_t {
+public:
+    alloc_window_t()
+        : m_start { alloc_snapshot() }
+    {
+        if constexpr (alloc_stats_enabled) {
+            auto open = g_open_windows.load(std::memory_order_relaxed);
+            int slot {};
+            do {
+                if (open == (1ull << MAX_WINDOWS) - 1) {
+                    // All slots taken, this window only reports its start and end.
+                    return;
+                }
+                slot = __builtin_ctz(~open);
+            } while (!g_open_windows.compare_exchange_weak(open, open | (1u << slot), std::memory_order_relaxed));
+            g_window_peaks[slot].store(m_start.live_bytes, std::memory_order_relaxed);
+            m_slot = slot;
+        }
+    }
+
+    alloc_window_t(const alloc_window_t&) = delete;
+
+    ~alloc_window_t()
+    {
+        release();
+    }
+
+    alloc_window_t& operator=(const alloc_window_t&) = delete;
+
+    struct result_t {
+        uint64_t allocations {};
+        uint64_t allocated_bytes {};
+        uint64_t peak_live_bytes {};
+    };
+
+    result_t stop()
+    {
+        auto end = alloc_snapshot();
+        auto peak = m_slot >= 0 ? g_window_peaks[m_slot].load(std::memory_order_relaxed) : m_start.live_bytes;
+        release();
+        return {
+            .allocations = end.allocations - m_start.allocations,
+            .allocated_bytes = end.allocated_bytes - m_start.allocated_bytes,
+            .peak_live_bytes = std::max(peak, end.live_bytes),
+        };
+    }
+
+private:
+    void release()
+    {
+        if (m_slot >= 0) {
+            g_open_windows.fetch_and(~(1u << m_slot), std::memory_order_relaxed);
+            m_slot = -1;
+        }
+    }
+
+    alloc_snapshot_t m_start {};
+    int m_slot { -1 };
+};
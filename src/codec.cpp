@@ -0,0 +1,191 @@
+module;
+
+#include <cstdint>
+#include <format>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+#include <zstd.h>
+
+export module codec;
+import lzma;
+
+// Compression of a file's payload in a package, tagged per file in the metadata.
+export enum class codec_t {
+    xz,
+    zstd,
+};
+
+export std::optional<codec_t> parse_codec(std::string_view name)
+{
+    if (name == "xz") {
+        return codec_t::xz;
+    } else if (name == "zstd") {
+        return codec_t::zstd;
+    }
+    return std::nullopt;
+}
+
+export std::string_view codec_name(codec_t codec)
+{
+    switch (codec) {
+    case codec_t::xz:
+        return "xz";
+    case codec_t::zstd:
+        return "zstd";
+    }
+    return "unknown";
+}
+
+using zstd_dctx_ptr = std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)>;
+
+// Accepts frames written with --long, whose window is larger than the default decoder limit.
+static zstd_dctx_ptr make_zstd_dctx()
+{
+    auto dctx = zstd_dctx_ptr { ZSTD_createDCtx(), &ZSTD_freeDCtx };
+    if (!dctx) {
+        throw std::runtime_error { "Init zstd decoder failed" };
+    }
+    auto window_log = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax).upperBound;
+    if (auto ret = ZSTD_DCtx_setParameter(dctx.get(), ZSTD_d_windowLogMax, window_log); ZSTD_isError(ret)) {
+        throw std::runtime_error { std::format("Init zstd decoder failed: {}", ZSTD_getErrorName(ret)) };
+    }
+    return dctx;
+}
+
+// Decodes one or more concatenated zstd frames.
+static std::vector<uint8_t> zstd_decompress(std::span<uint8_t> compressed_data)
+{
+    auto dctx = make_zstd_dctx();
+    std::vector<uint8_t> out;
+    if (auto size = ZSTD_getFrameContentSize(compressed_data.data(), compressed_data.size()); size != ZSTD_CONTENTSIZE_UNKNOWN && size != ZSTD_CONTENTSIZE_ERROR) {
+        out.reserve(size);
+    }
+
+    std::vector<uint8_t> buffer(ZSTD_DStreamOutSize());
+    auto in = ZSTD_inBuffer { compressed_data.data(), compressed_data.size(), 0 };
+    size_t ret {};
+    while (in.pos < in.size) {
+        auto output = ZSTD_outBuffer { buffer.data(), buffer.size(), 0 };
+        ret = ZSTD_decompressStream(dctx.get(), &output, &in);
+        if (ZSTD_isError(ret)) {
+            throw std::runtime_error { std::format("zstd decompress failed: {}", ZSTD_getErrorName(ret)) };
+        }
+        out.insert(out.end(), buffer.data(), buffer.data() + output.pos);
+    }
+
+    // Flush what the decoder still holds, a non-zero hint means the last frame is truncated.
+    while (ret) {
+        auto output = ZSTD_outBuffer { buffer.data(), buffer.size(), 0 };
+        ret = ZSTD_decompressStream(dctx.get(), &output, &in);
+        if (ZSTD_isError(ret)) {
+            throw std::runtime_error { std::format("zstd decompress failed: {}", ZSTD_getErrorName(ret)) };
+        }
+        if (!output.pos) {
+            throw std::runtime_error { "zstd decompress failed: truncated frame" };
+        }
+        out.insert(out.end(), buffer.data(), buffer.data() + output.pos);
+    }
+    return out;
+}
+
+// Decodes a whole payload, which may be several concatenated streams or frames.
+export std::vector<uint8_t> decompress(codec_t codec, std::span<uint8_t> compressed_data)
+{
+    switch (codec) {
+    case codec_t::xz:
+        return lzma_decompress(compressed_data);
+    case codec_t::zstd:
+        return zstd_decompress(compressed_data);
+    }
+    throw std::runtime_error { std::format("unknown codec: {}", (int)codec) };
+}
+
+// Decodes one block that must expand to exactly `out.size()` bytes.
+export void decompress_to(codec_t codec, std::span<uint8_t> compressed_data, std::span<uint8_t> out)
+{
+    switch (codec) {
+    case codec_t::xz:
+        lzma_decompress_to(compressed_data, out);
+        return;
+    case codec_t::zstd: {
+        auto dctx = make_zstd_dctx();
+        auto ret = ZSTD_decompressDCtx(dctx.get(), out.data(), out.size(), compressed_data.data(), compressed_data.size());
+        if (ZSTD_isError(ret) || ret != out.size()) {
+            throw std::runtime_error { std::format("zstd decompress failed: {}", ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "size mismatch") };
+        }
+        return;
+    }
+    }
+    throw std::runtime_error { std::format("unknown codec: {}", (int)codec) };
+}
+
+// Decodes a payload fed in pieces, for files too large to hold compressed and decoded at once.
+// The output goes to `sink` as it is produced.
+export class stream_decoder_t {
+public:
+    using sink_t = std::function<void(std::span<const uint8_t>)>;
+
+    explicit stream_decoder_t(codec_t codec)
+    {
+        if (codec == codec_t::xz) {
+            m_lzma.emplace();
+        } else {
+            m_zstd = make_zstd_dctx();
+            m_buffer.resize(ZSTD_DStreamOutSize());
+        }
+    }
+
+    void decode(std::span<const uint8_t> data, const sink_t& sink)
+    {
+        if (m_lzma) {
+            m_lzma->decode(data, sink);
+            return;
+        }
+        auto in = ZSTD_inBuffer { data.data(), data.size(), 0 };
+        while (in.pos < in.size) {
+            zstd_step(in, sink);
+        }
+    }
+
+    // After the last piece, a truncated payload fails here.
+    void finish(const sink_t& sink)
+    {
+        if (m_lzma) {
+            m_lzma->finish(sink);
+            return;
+        }
+
+        // Like zstd_decompress(), a non-zero hint that yields nothing is a truncated frame.
+        auto in = ZSTD_inBuffer { nullptr, 0, 0 };
+        while (m_zstd_hint) {
+            if (!zstd_step(in, sink)) {
+                throw std::runtime_error { "zstd decompress failed: truncated frame" };
+            }
+        }
+    }
+
+private:
+    // Returns the number of bytes produced.
+    size_t zstd_step(ZSTD_inBuffer& in, const sink_t& sink)
+    {
+        auto output = ZSTD_outBuffer { m_buffer.data(), m_buffer.size(), 0 };
+        m_zstd_hint = ZSTD_decompressStream(m_zstd.get(), &output, &in);
+        if (ZSTD_isError(m_zstd_hint)) {
+            throw std::runtime_error { std::format("zstd decompress failed: {}", ZSTD_getErrorName(m_zstd_hint)) };
+        }
+        if (output.pos) {
+            sink({ m_buffer.data(), output.pos });
+        }
+        return output.pos;
+    }
+
+    std::optional<lzma_decoder_t> m_lzma {};
+    zstd_dctx_ptr m_zstd { nullptr, &ZSTD_freeDCtx };
+    size_t m_zstd_hint {};
+    std::vector<uint8_t> m_buffer {};
+};
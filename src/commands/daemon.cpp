@@ -0,0 +1,394 @@
+module;
+
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <system_error>
+#include <tuple>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+export module daemon;
+import consts;
+import cppl;
+import daemon_link;
+import http_client;
+import log;
+import message_queue;
+import mirrors;
+import pull;
+import read_stream;
+import stats;
+
+using cppl::task_state_t;
+using cppl::task_t;
+using namespace std::chrono_literals;
+
+struct Options {
+    bool help {};
+};
+
+static Options parse_options(int& argc, const char**& argv)
+{
+    auto options = Options {};
+    while (argc && **argv == '-') {
+        if (!strcmp(*argv + 1, "h") || !strcmp(*argv + 1, "-help")) {
+            options.help = true;
+        } else {
+            fatal_error("unknown option: {}", *argv);
+        }
+        --argc;
+        ++argv;
+    }
+    return options;
+}
+
+static void print_help()
+{
+    fprintf(stdout, R"(Keep a resident process that runs app pull for the command line
+Usage: app daemon [OPTIONS]
+
+Options:
+    -h,--help                   Print this help message and exit
+
+While it runs, app pull hands its work to the daemon, which keeps connections to the mirrors,
+DNS answers and package metadata warm between invocations. The daemon and its clients meet on
+APP_DAEMON_SOCKET (default: ~/.staticlinux/daemon.sock).
+
+For more information, please visit %s/commands/daemon
+)",
+        DOC_BASE_LINK);
+}
+
+// Frames to one client, sent without blocking the message loop: what the socket doesn't take at
+// once waits in a backlog that run_async() sends as the socket drains. Frames may come from worker
+// threads. A client whose backlog grows past MAX_BACKLOG, or that takes nothing for WRITE_TIMEOUT,
+// is dropped and the command goes on without it.
+class frame_writer_t {
+public:
+    explicit frame_writer_t(int fd)
+        : m_fd { fd }
+    {
+        m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_event_fd < 0) {
+            throw std::system_error { errno, std::system_category(), "create eventfd failed" };
+        }
+        m_running.emplace(run_async());
+    }
+
+    frame_writer_t(const frame_writer_t&) = delete;
+
+    // close_async() must have completed.
+    ~frame_writer_t()
+    {
+        close(m_event_fd);
+    }
+
+    frame_writer_t& operator=(const frame_writer_t&) = delete;
+
+    // Queues a frame, safe from any thread. Never waits for the client.
+    void post(daemon_frame_t kind, std::string_view payload)
+    {
+        auto lock = std::lock_guard { m_mutex };
+        if (m_dropped) {
+            return;
+        }
+        auto idle = m_backlog.empty();
+        encode_frame(m_backlog, kind, payload);
+        if (m_backlog.size() > MAX_BACKLOG) {
+            drop("too much output is waiting");
+        } else if (idle) {
+            send_backlog();
+            if (!m_backlog.empty()) {
+                wake();
+            }
+        }
+    }
+
+    // Sends the rest of the backlog, or gives up on the client. Returns why it was dropped, empty
+    // if it wasn't.
+    task_t<std::string> close_async()
+    {
+        {
+            auto lock = std::lock_guard { m_mutex };
+            m_closing = true;
+        }
+        wake();
+        co_await *m_running;
+        co_return m_drop_reason;
+    }
+
+private:
+    static constexpr size_t MAX_BACKLOG = 4 << 20;
+    static constexpr auto WRITE_TIMEOUT = 10s;
+
+    void wake()
+    {
+        eventfd_write(m_event_fd, 1);
+    }
+
+    // Sends as much of the backlog as the socket takes, with m_mutex held.
+    void send_backlog()
+    {
+        size_t sent {};
+        while (sent < m_backlog.size()) {
+            auto num = send(m_fd, m_backlog.data() + sent, m_backlog.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (num < 0) {
+                if (errno == EINTR) {
+                    continue;
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    drop(strerror(errno));
+                    return;
+                }
+                break;
+            }
+            sent += num;
+        }
+        m_backlog.erase(0, sent);
+    }
+
+    // With m_mutex held. Nothing is logged here, the logger's forward may be the caller.
+    void drop(std::string_view reason)
+    {
+        m_dropped = true;
+        m_drop_reason = reason;
+        m_backlog = {};
+        shutdown(m_fd, SHUT_RDWR);
+    }
+
+    task_t<void> run_async()
+    {
+        auto& queue = message_queue_t::current();
+        while (true) {
+            co_await queue.await(m_event_fd, EPOLLIN);
+            eventfd_t count {};
+            eventfd_read(m_event_fd, &count);
+
+            while (true) {
+                {
+                    auto lock = std::lock_guard { m_mutex };
+                    if (!m_dropped) {
+                        send_backlog();
+                    }
+                    if (m_dropped || m_backlog.empty()) {
+                        break;
+                    }
+                }
+                auto stalled = false;
+                try {
+                    auto writable = queue.await(m_fd, EPOLLOUT);
+                    co_await with_deadline(std::move(writable), WRITE_TIMEOUT, m_fd);
+                } catch (const std::exception&) {
+                    stalled = true;
+                }
+                if (stalled) {
+                    auto lock = std::lock_guard { m_mutex };
+                    drop("the client stopped reading");
+                }
+            }
+
+            // Not returned with m_mutex held: close_async() resumes, and may destroy this,
+            // before this frame ends.
+            auto closing = false;
+            {
+                auto lock = std::lock_guard { m_mutex };
+                closing = m_closing;
+            }
+            if (closing) {
+                co_return;
+            }
+        }
+    }
+
+    int m_fd {};
+    int m_event_fd { -1 };
+    std::mutex m_mutex {};
+    std::string m_backlog {};
+    bool m_dropped {};
+    bool m_closing {};
+    std::string m_drop_reason {};
+    std::optional<task_t<void>> m_running {};
+};
+
+// Runs the commands of CLI clients connected over a Unix socket, in this process so connections,
+// DNS answers and package indexes carry over from one command to the next. Commands run one at a
+// time: they share the rate limits, the stats and the logger's forward.
+class daemon_server_t {
+public:
+    explicit daemon_server_t(const std::filesystem::path& path)
+        : m_path { path }
+    {
+        auto address = daemon_socket_address(path);
+        m_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_listen_fd < 0) {
+            throw std::system_error { errno, std::system_category(), "create socket failed" };
+        }
+
+        // A socket nobody answers on is left from a daemon that is gone.
+        if (connect(m_listen_fd, (const sockaddr*)&address, sizeof(address)) == 0) {
+            close(m_listen_fd);
+            throw std::runtime_error { std::format("A daemon is already running on {}", path.string()) };
+        }
+        close(m_listen_fd);
+        unlink(path.c_str());
+        std::filesystem::create_directories(path.parent_path());
+
+        m_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_listen_fd < 0) {
+            throw std::system_error { errno, std::system_category(), "create socket failed" };
+        }
+        if (bind(m_listen_fd, (const sockaddr*)&address, sizeof(address)) < 0) {
+            close(m_listen_fd);
+            throw std::system_error { errno, std::system_category(), std::format("bind to {} failed", path.string()) };
+        }
+        if (listen(m_listen_fd, SOMAXCONN) < 0) {
+            close(m_listen_fd);
+            throw std::system_error { errno, std::system_category(), "listen failed" };
+        }
+    }
+
+    daemon_server_t(const daemon_server_t&) = delete;
+
+    ~daemon_server_t()
+    {
+        close(m_listen_fd);
+        unlink(m_path.c_str());
+    }
+
+    daemon_server_t& operator=(const daemon_server_t&) = delete;
+
+    task_t<void> serve_async()
+    {
+        auto& queue = message_queue_t::current();
+        while (true) {
+            auto fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    co_await queue.await(m_listen_fd, EPOLLIN);
+                    continue;
+                } else if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                throw std::system_error { errno, std::system_category(), "accept failed" };
+            }
+
+            // Awaited, so the next client waits in the backlog until this one is done.
+            co_await serve_client_async(read_stream_t { fd });
+        }
+    }
+
+private:
+    // How long a client may take to send its request.
+    static constexpr auto REQUEST_TIMEOUT = 10s;
+
+    static task_t<void> serve_client_async(read_stream_t stream)
+    {
+        auto fd = stream.native_handle();
+        stream.set_idle_timeout(REQUEST_TIMEOUT);
+
+        auto command = std::string {};
+        auto fields = std::vector<std::string> {};
+        try {
+            auto header = co_await stream.read_async(DAEMON_FRAME_HEADER_LEN);
+            uint32_t size {};
+            memcpy(&size, header.data() + 1, sizeof(size));
+            if ((daemon_frame_t)header[0] != daemon_frame_t::request) {
+                throw std::runtime_error { std::format("unexpected frame: {}", (int)header[0]) };
+            }
+            auto payload = co_await stream.read_async(size);
+            std::tie(command, fields) = decode_request({ (const char*)payload.data(), payload.size() });
+        } catch (const std::exception& ex) {
+            trace("daemon: bad request: {}", ex.what());
+            co_return;
+        }
+
+        auto writer = frame_writer_t { fd };
+        auto& logger = logger_t::instance();
+
+        // The command would see another home or other mirrors than the client expects.
+        auto context = client_context_t::take_from_fields(fields);
+        if (!context.same_environment(client_context_t::current())) {
+            trace("daemon: declined {}, the client has another HOME or APP_MIRRORS", command);
+            writer.post(daemon_frame_t::declined, {});
+            co_await writer.close_async();
+            co_return;
+        }
+        auto saved_level = logger.level();
+        if (!context.log_level.empty() && !logger.set_level(context.log_level)) {
+            trace("daemon: unknown log level: {}", context.log_level);
+        }
+
+        // Output of the command, from this thread or from the workers, goes to the client. A
+        // client that went away doesn't stop the command.
+        logger.set_forward([&](log_level_t level, std::string_view line) {
+            writer.post(level == log_level_t::info ? daemon_frame_t::out : daemon_frame_t::err, line);
+        });
+        stats_t::current() = stats_t {};
+
+        auto error = std::string {};
+        try {
+            if (command == "pull") {
+                co_await run_pull_async(pull_request_t::from_fields(fields));
+            } else {
+                throw std::runtime_error { std::format("unknown daemon command: {}", command) };
+            }
+        } catch (const std::exception& ex) {
+            error = ex.what();
+            if (error.empty()) {
+                error = "unknown error";
+            }
+        }
+        logger.set_forward({});
+        logger.set_level(saved_level);
+        mirror_list_t::current().save();
+
+        if (error.empty()) {
+            writer.post(daemon_frame_t::done, {});
+        } else {
+            writer.post(daemon_frame_t::failed, error);
+        }
+        auto reason = co_await writer.close_async();
+        if (!reason.empty()) {
+            trace("daemon: dropped the client: {}", reason);
+        }
+        trace("daemon: {} done: {}", command, error.empty() ? "ok" : error);
+    }
+
+    std::filesystem::path m_path {};
+    int m_listen_fd {};
+};
+
+export task_t<void> daemon_async(int argc, const char* argv[])
+{
+    auto options = parse_options(argc, argv);
+    if (options.help) {
+        print_help();
+        co_return;
+    }
+    if (argc) {
+        fatal_error("unexpected argument: {}", *argv);
+    }
+
+    auto path = daemon_socket_path();
+    auto server = daemon_server_t { path };
+
+    // Connections to the mirrors stay open between commands, the one-shot CLI closes them.
+    http_connection_pool_t::current().enable(4s);
+    status("Listening on {}", path.string());
+    co_await server.serve_async();
+}
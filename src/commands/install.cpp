@@ -0,0 +1,499 @@
+module;
+
+#include <algorithm>
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <yaml-cpp/yaml.h>
+
+export module install;
+import codec;
+import consts;
+import cppl;
+import file_lock;
+import installed;
+import log;
+import metadata;
+import mirrors;
+import package;
+import stats;
+import worker_pool;
+
+using cppl::task_state_t;
+using cppl::task_t;
+
+struct Options {
+    bool help {};
+    std::string manifest {};
+    std::string lockfile {};
+    size_t jobs { 4 };
+};
+
+static Options parse_options(int& argc, const char**& argv)
+{
+    auto options = Options {};
+    auto value = [&]() -> const char* {
+        if (argc < 2) {
+            fatal_error("missing value for option: {}", *argv);
+        }
+        --argc;
+        return *++argv;
+    };
+    while (argc && **argv == '-') {
+        if (!strcmp(*argv + 1, "h") || !strcmp(*argv + 1, "-help")) {
+            options.help = true;
+        } else if (!strcmp(*argv + 1, "f") || !strcmp(*argv + 1, "-file")) {
+            options.manifest = value();
+        } else if (!strcmp(*argv + 1, "-lockfile")) {
+            options.lockfile = value();
+        } else if (!strcmp(*argv + 1, "j") || !strcmp(*argv + 1, "-jobs")) {
+            options.jobs = std::max(atoi(value()), 1);
+        } else {
+            fatal_error("unknown option: {}", *argv);
+        }
+        --argc;
+        ++argv;
+    }
+    return options;
+}
+
+static void print_help()
+{
+    fprintf(stdout, R"(Install the apps listed in a manifest
+Usage: app install [OPTIONS] -f FILE
+
+Options:
+    -h,--help                   Print this help message and exit
+    -f,--file FILE              Manifest listing the apps, see below
+    --lockfile FILE             Where the resolved versions are kept (default: FILE with .lock)
+    -j,--jobs N                 Downloads in flight at once (default: 4)
+
+Manifest:
+    apps:
+      - bash/bash:5.2.37
+      - name: coreutils
+        path: ls
+        version: 9.5
+
+For more information, please visit %s/commands/install
+)",
+        DOC_BASE_LINK);
+}
+
+// One app file, as listed in the manifest and, once resolved, in the lockfile.
+struct app_entry_t {
+    std::string name {};
+    std::string path {};
+    std::string version {};
+
+    // Resolved from the package metadata.
+    Metadata::File file {};
+    uint64_t offset {};
+    bool resolved {};
+
+    std::string key() const
+    {
+        return std::format("{}/{}:{}", name, path, version);
+    }
+};
+
+static app_entry_t parse_app_spec(std::string_view spec)
+{
+    auto path_it = spec.find('/');
+    auto version_it = spec.rfind(':');
+    if (path_it == std::string_view::npos || version_it == std::string_view::npos || version_it < path_it) {
+        throw std::runtime_error { std::format("bad app, expected NAME/PATH:VERSION: {}", spec) };
+    }
+    return {
+        .name = std::string { spec.substr(0, path_it) },
+        .path = std::string { spec.substr(path_it + 1, version_it - path_it - 1) },
+        .version = std::string { spec.substr(version_it + 1) },
+    };
+}
+
+static std::vector<app_entry_t> load_manifest(const std::string& path)
+{
+    auto doc = YAML::LoadFile(path);
+    const auto& apps = doc.IsSequence() ? doc : doc["apps"];
+    if (!apps.IsSequence()) {
+        throw std::runtime_error { std::format("{}: expected a list of apps", path) };
+    }
+
+    auto entries = std::vector<app_entry_t> {};
+    for (const auto& app : apps) {
+        auto entry = app.IsScalar()
+            ? parse_app_spec(app.as<std::string>())
+            : app_entry_t { .name = app["name"].as<std::string>(), .path = app["path"].as<std::string>(), .version = app["version"].as<std::string>() };
+        if (entry.name.empty() || entry.path.empty() || entry.version.empty()) {
+            throw std::runtime_error { std::format("{}: incomplete app: {}", path, entry.key()) };
+        }
+        // The name is a directory of its own and the path a file in it.
+        if (!is_contained_path(entry.name) || entry.name.find('/') != std::string::npos || !is_contained_path(entry.path)) {
+            throw std::runtime_error { std::format("{}: bad app path: {}", path, entry.key()) };
+        }
+        if (std::none_of(entries.begin(), entries.end(), [&](const auto& e) { return e.key() == entry.key(); })) {
+            entries.push_back(std::move(entry));
+        }
+    }
+    return entries;
+}
+
+// Entries of an earlier run by key. A missing or damaged lockfile only costs a metadata fetch.
+static std::unordered_map<std::string, app_entry_t> load_lockfile(const std::string& path)
+{
+    auto locked = std::unordered_map<std::string, app_entry_t> {};
+    if (!std::filesystem::exists(path)) {
+        return locked;
+    }
+    try {
+        auto doc = YAML::LoadFile(path);
+        for (const auto& app : doc["apps"]) {
+            auto codec = parse_codec(app["codec"] ? app["codec"].as<std::string>() : "xz");
+            if (!codec) {
+                throw std::runtime_error { std::format("unknown codec: {}", app["codec"].as<std::string>()) };
+            }
+            auto entry = app_entry_t {
+                .name = app["name"].as<std::string>(),
+                .path = app["path"].as<std::string>(),
+                .version = app["version"].as<std::string>(),
+                .file = {
+                    .md5 = app["md5"].as<std::string>(),
+                    .mode = (int)strtol(app["mode"].as<std::string>().c_str(), nullptr, 8),
+                    .size = app["size"].as<size_t>(),
+                    .filepath = app["path"].as<std::string>(),
+                    .codec = *codec,
+                },
+                .offset = app["offset"].as<uint64_t>(),
+                .resolved = true,
+            };
+            if (!is_md5(entry.file.md5)) {
+                throw std::runtime_error { std::format("bad md5 of {}", entry.key()) };
+            }
+            locked.emplace(entry.key(), std::move(entry));
+        }
+    } catch (const std::exception& ex) {
+        warning("Ignore lockfile {}: {}", path, ex.what());
+        locked.clear();
+    }
+    return locked;
+}
+
+static void save_lockfile(const std::string& path, const std::vector<app_entry_t>& entries)
+{
+    YAML::Node root;
+    for (const auto& entry : entries) {
+        YAML::Node node;
+        node["name"] = entry.name;
+        node["path"] = entry.path;
+        node["version"] = entry.version;
+        node["md5"] = entry.file.md5;
+        node["mode"] = std::format("{:04o}", entry.file.mode);
+        node["offset"] = entry.offset;
+        node["size"] = entry.file.size;
+        if (entry.file.codec != codec_t::xz) {
+            node["codec"] = std::string { codec_name(entry.file.codec) };
+        }
+        root["apps"].push_back(node);
+    }
+
+    auto tmp = path + ".tmp";
+    {
+        std::ofstream file { tmp };
+        file << "# Generated by app install, do not edit.\n"
+             << YAML::Dump(root) << "\n";
+        if (!file) {
+            throw std::runtime_error { std::format("Can't write lockfile {}", tmp) };
+        }
+    }
+    std::filesystem::rename(tmp, path);
+}
+
+// Limits how many coroutines are inside a stage at once, the others wait in order.
+class async_semaphore_t {
+public:
+    explicit async_semaphore_t(size_t count)
+        : m_count { count }
+    {
+    }
+
+    task_t<void> acquire_async()
+    {
+        if (m_count) {
+            --m_count;
+            co_return;
+        }
+        auto wake = std::make_shared<task_state_t<void>>();
+        m_waiters.push_back(wake);
+        // release() hands its slot over directly.
+        co_await task_t<void> { wake };
+    }
+
+    void release()
+    {
+        if (m_waiters.empty()) {
+            ++m_count;
+            return;
+        }
+        auto wake = std::move(m_waiters.front());
+        m_waiters.pop_front();
+        wake->set_value();
+    }
+
+private:
+    size_t m_count {};
+    std::deque<std::shared_ptr<task_state_t<void>>> m_waiters {};
+};
+
+// Files of one package fetched with a single range request.
+struct range_group_t {
+    uint64_t first {};
+    uint64_t end {};
+    std::vector<app_entry_t*> entries {};
+};
+
+// Neighbouring files are fetched together when the bytes in between cost less than another
+// request, up to a bound on the memory held by one response.
+static std::vector<range_group_t> group_ranges(std::vector<app_entry_t*> entries)
+{
+    constexpr size_t MAX_GAP = 256 << 10;
+    constexpr size_t MAX_GROUP = 64 << 20;
+
+    std::sort(entries.begin(), entries.end(), [](auto a, auto b) { return a->offset < b->offset; });
+    auto groups = std::vector<range_group_t> {};
+    for (auto entry : entries) {
+        auto end = entry->offset + entry->file.size;
+        if (!groups.empty() && entry->offset <= groups.back().end + MAX_GAP && end - groups.back().first <= MAX_GROUP) {
+            groups.back().end = std::max(groups.back().end, end);
+        } else {
+            groups.push_back({ .first = entry->offset, .end = end });
+        }
+        groups.back().entries.push_back(entry);
+    }
+    return groups;
+}
+
+static std::unordered_multimap<std::string, std::string> range_header(uint64_t first, uint64_t end)
+{
+    return { { "range", std::format("bytes={}-{}", first, end - 1) } };
+}
+
+// Downloads, decompresses, verifies and writes the apps in stages: metadata fetches, range
+// downloads and decoding each have their own bound, so a slow stage backs up the one before it
+// instead of holding every package in memory.
+class installer_t {
+public:
+    explicit installer_t(size_t jobs)
+        : m_resolve { 8 }
+        , m_download { jobs }
+        , m_decode { worker_pool_t::shared().size() * 2 }
+    {
+    }
+
+    // Resolves the entries of one package that aren't locked yet, then installs them all.
+    task_t<void> install_package_async(std::vector<app_entry_t*> entries)
+    {
+        const auto& first = *entries.front();
+        auto lock_key = package_lock_key(first.name);
+        auto lock = co_await file_lock_t::lock_async(lock_key);
+        if (std::any_of(entries.begin(), entries.end(), [](auto e) { return !e->resolved; })) {
+            co_await m_resolve.acquire_async();
+            auto index = package_index_t {};
+            try {
+                index = co_await fetch_package_index_async(first.name, first.version);
+            } catch (...) {
+                m_resolve.release();
+                throw;
+            }
+            m_resolve.release();
+
+            for (auto entry : entries) {
+                auto i = index.find(entry->path);
+                if (i < 0) {
+                    throw std::runtime_error { std::format("Can't find {} in package {}", entry->path, entry->name) };
+                }
+                entry->file = index.metadata.files[i];
+                entry->offset = index.offsets[i];
+                entry->resolved = true;
+            }
+        }
+
+        // Another process may have installed them while this one waited for the lock.
+        std::erase_if(entries, [](auto e) { return file_md5(installed_file_path(e->name, e->path)) == e->file.md5; });
+        if (entries.empty()) {
+            co_return;
+        }
+
+        auto path = package_download_path(first.name, first.version);
+        auto groups = group_ranges(entries);
+        auto tasks = std::vector<task_t<void>> {};
+        for (auto& group : groups) {
+            tasks.push_back(install_group_async(path, group));
+        }
+        co_await wait_all_async(tasks);
+
+        auto files = std::vector<Metadata::File> {};
+        for (auto entry : entries) {
+            files.push_back(entry->file);
+        }
+        co_await record_installed_async(first.name, first.version, std::move(files));
+    }
+
+private:
+    task_t<void> install_group_async(const std::string& path, const range_group_t& group)
+    {
+        co_await m_download.acquire_async();
+        auto data = std::vector<uint8_t> {};
+        try {
+            data = co_await hedged_get_async(path, range_header(group.first, group.end));
+        } catch (...) {
+            m_download.release();
+            throw;
+        }
+        m_download.release();
+        if (data.size() != group.end - group.first) {
+            throw std::runtime_error { std::format("{}: expected {} bytes, got {}", path, group.end - group.first, data.size()) };
+        }
+
+        auto shared_data = std::make_shared<const std::vector<uint8_t>>(std::move(data));
+        auto tasks = std::vector<task_t<void>> {};
+        for (auto entry : group.entries) {
+            tasks.push_back(decode_async(*entry, shared_data, entry->offset - group.first));
+        }
+        co_await wait_all_async(tasks);
+    }
+
+    task_t<void> decode_async(app_entry_t& entry, std::shared_ptr<const std::vector<uint8_t>> data, size_t offset)
+    {
+        co_await m_decode.acquire_async();
+        auto result = decoded_file_t {};
+        try {
+            auto job = [&entry, data, offset] {
+                auto compressed = std::vector<uint8_t> { data->begin() + offset, data->begin() + offset + entry.file.size };
+                return decode_and_install(entry.name, entry.file, compressed);
+            };
+            result = co_await worker_pool_t::shared().run_async(std::move(job));
+        } catch (...) {
+            m_decode.release();
+            throw;
+        }
+        m_decode.release();
+
+        record_decoded_file(result);
+        status("Installed {} ({} bytes){}", entry.key(), result.size, result.link.empty() ? "" : std::format(", linked ~/.staticlinux/bin/{}", result.link));
+    }
+
+    // Waits for every task even when one fails, then rethrows the first error.
+    static task_t<void> wait_all_async(std::vector<task_t<void>>& tasks)
+    {
+        auto error = std::exception_ptr {};
+        for (auto& task : tasks) {
+            try {
+                co_await task;
+            } catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    async_semaphore_t m_resolve;
+    async_semaphore_t m_download;
+    async_semaphore_t m_decode;
+};
+
+// True when the installed file still has the locked content.
+static bool is_installed(const app_entry_t& entry)
+{
+    auto md5 = file_md5(installed_file_path(entry.name, entry.path));
+    return md5 && *md5 == entry.file.md5;
+}
+
+export task_t<void> install_async(int argc, const char* argv[])
+{
+    auto options = parse_options(argc, argv);
+    if (options.help) {
+        print_help();
+        co_return;
+    }
+    if (options.manifest.empty()) {
+        fatal_error("-f FILE is required.");
+    }
+    if (argc) {
+        fatal_error("unexpected argument: {}", *argv);
+    }
+    if (options.lockfile.empty()) {
+        options.lockfile = std::filesystem::path { options.manifest }.replace_extension(".lock").string();
+    }
+
+    auto entries = load_manifest(options.manifest);
+    auto locked = load_lockfile(options.lockfile);
+    for (auto& entry : entries) {
+        if (auto it = locked.find(entry.key()); it != locked.end()) {
+            entry = it->second;
+        }
+    }
+
+    // Locked files that are installed already are checked in parallel and skipped. One job spreads
+    // the checks over the pool, however long the manifest.
+    auto installed = std::vector<char>(entries.size());
+    auto check = [&] {
+        worker_pool_t::shared().parallel_for(entries.size(), [&](size_t i) {
+            installed[i] = entries[i].resolved && is_installed(entries[i]);
+        });
+    };
+    co_await worker_pool_t::shared().run_async(std::move(check));
+
+    // Group the rest by package, each package is resolved once.
+    auto packages = std::map<std::pair<std::string, std::string>, std::vector<app_entry_t*>> {};
+    size_t up_to_date {};
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (installed[i]) {
+            ++up_to_date;
+            trace("{} is up to date", entries[i].key());
+        } else {
+            packages[{ entries[i].name, entries[i].version }].push_back(&entries[i]);
+        }
+    }
+
+    auto installer = installer_t { options.jobs };
+    auto tasks = std::vector<std::pair<std::string, task_t<void>>> {};
+    for (auto& [package, package_entries] : packages) {
+        tasks.emplace_back(std::format("{}:{}", package.first, package.second), installer.install_package_async(package_entries));
+    }
+
+    size_t failures {};
+    for (auto& [package, task] : tasks) {
+        try {
+            co_await task;
+        } catch (const std::exception& ex) {
+            warning("Install {} failed: {}", package, ex.what());
+            ++failures;
+        }
+    }
+    mirror_list_t::current().save();
+
+    if (failures) {
+        throw std::runtime_error { std::format("{} of {} packages failed, {} not updated", failures, packages.size(), options.lockfile) };
+    }
+    save_lockfile(options.lockfile, entries);
+    status("{} apps installed, {} up to date, locked in {}", entries.size() - up_to_date, up_to_date, options.lockfile);
+}
@@ -0,0 +1,102 @@
+module;
+
+#include <algorithm>
+#include <coroutine>
+#include <cstdio>
+#include <cstring>
+#include <format>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+export module list;
+import consts;
+import cppl;
+import installed;
+import log;
+
+using cppl::task_t;
+
+struct Options {
+    bool help {};
+    std::vector<std::string_view> names {};
+};
+
+static Options parse_options(int& argc, const char**& argv)
+{
+    auto options = Options {};
+    while (argc) {
+        if (**argv != '-') {
+            options.names.push_back(*argv);
+        } else if (!strcmp(*argv + 1, "h") || !strcmp(*argv + 1, "-help")) {
+            options.help = true;
+        } else {
+            fatal_error("unknown option: {}", *argv);
+        }
+        --argc;
+        ++argv;
+    }
+    return options;
+}
+
+static void print_help()
+{
+    fprintf(stdout, R"(List installed packages, or the files of the given ones
+Usage: app list [OPTIONS] [NAME...]
+
+Options:
+    -h,--help                   Print this help message and exit
+
+Parameters:
+    NAME                        Name of an installed package
+
+For more information, please visit %s/commands/list
+)",
+        DOC_BASE_LINK);
+}
+
+// Versions of the files, in order of appearance, e.g. "1.1, 1.0".
+static std::string versions_of(const std::vector<installed_file_t>& files)
+{
+    auto versions = std::vector<std::string_view> {};
+    for (const auto& file : files) {
+        if (std::find(versions.begin(), versions.end(), file.version) == versions.end()) {
+            versions.push_back(file.version);
+        }
+    }
+    auto str = std::string {};
+    for (auto version : versions) {
+        str += str.empty() ? "" : ", ";
+        str += version;
+    }
+    return str;
+}
+
+export task_t<void> list_async(int argc, const char* argv[])
+{
+    auto options = parse_options(argc, argv);
+    if (options.help) {
+        print_help();
+        co_return;
+    }
+
+    auto db = install_db_t::open();
+    if (options.names.empty()) {
+        for (size_t i = 0; i < db.package_count(); ++i) {
+            auto files = db.files(i);
+            fprintf(stdout, "%s %s (%zu files)\n", std::string { db.package_name(i) }.c_str(), versions_of(files).c_str(), files.size());
+        }
+        co_return;
+    }
+
+    for (auto name : options.names) {
+        auto package = db.find_package(name);
+        if (!package) {
+            throw std::runtime_error { std::format("{} isn't installed", name) };
+        }
+        for (const auto& file : db.files(*package)) {
+            fprintf(stdout, "%s/%s:%s %04o\n", std::string { name }.c_str(), file.path.c_str(), file.version.c_str(), file.mode);
+        }
+    }
+}
@@ -1,22 +1,44 @@
 module;
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
 #include <coroutine>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <exception>
+#include <fcntl.h>
 #include <filesystem>
 #include <format>
-#include <regex>
-#include <sys/stat.h>
-#include <yaml-cpp/yaml.h>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/file.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
 
 import consts;
 import cppl;
+import daemon_link;
+import file_lock;
 import http_client;
+import installed;
 import log;
-import lzma;
-import md5;
-import read_stream;
+import metadata;
+import mirrors;
+import package;
+import rate_limiter;
+import stats;
+import tree_hash;
+import worker_pool;
 
 using cppl::task_state_t;
 using cppl::task_t;
@@ -25,27 +47,76 @@ export module pull;
 
 struct Options {
     bool help {};
+    bool all {};
+    bool lazy {};
+    bool stats {};
+    bool stats_json {};
+    uint64_t limit_rate {};
+    uint64_t connection_limit_rate {};
+    bool no_daemon {};
+    std::vector<std::string_view> args {};
 };
 
-struct Metadata {
-    struct File {
-        std::string md5 {};
-        int mode {};
-        size_t size {};
-        std::string filepath {};
-    };
+// Accepts both "--name VALUE" and "--name=VALUE", a separate value is consumed.
+static bool rate_option(std::string_view name, int& argc, const char**& argv, uint64_t& rate)
+{
+    auto arg = std::string_view { *argv };
+    if (!arg.starts_with(name) || (arg.size() > name.size() && arg[name.size()] != '=')) {
+        return false;
+    }
 
-    std::vector<File> files {};
-};
+    auto value = std::string_view {};
+    if (arg.size() > name.size()) {
+        value = arg.substr(name.size() + 1);
+    } else if (argc > 1) {
+        --argc;
+        value = *++argv;
+    }
+    auto parsed = parse_rate(value);
+    if (!parsed) {
+        fatal_error("invalid rate for {}: {}", name, value);
+    }
+    rate = *parsed;
+    return true;
+}
 
 static Options parse_options(int& argc, const char**& argv)
 {
     auto options = Options {};
-    while (argc && **argv == '-') {
-        if (!strcmp(*argv + 1, "h") || !strcmp(*argv + 1, "-help")) {
+    while (argc) {
+        if (**argv != '-') {
+            options.args.push_back(*argv);
+            --argc;
+            ++argv;
+        } else if (!strcmp(*argv + 1, "h") || !strcmp(*argv + 1, "-help")) {
             options.help = true;
             --argc;
             ++argv;
+        } else if (!strcmp(*argv + 1, "-all")) {
+            options.all = true;
+            --argc;
+            ++argv;
+        } else if (!strcmp(*argv + 1, "-lazy")) {
+            options.lazy = true;
+            --argc;
+            ++argv;
+        } else if (!strcmp(*argv + 1, "-no-daemon")) {
+            options.no_daemon = true;
+            --argc;
+            ++argv;
+        } else if (!strcmp(*argv + 1, "-stats") || !strcmp(*argv + 1, "-stats=text")) {
+            options.stats = true;
+            --argc;
+            ++argv;
+        } else if (!strcmp(*argv + 1, "-stats=json")) {
+            options.stats = true;
+            options.stats_json = true;
+            --argc;
+            ++argv;
+        } else if (rate_option("--limit-rate", argc, argv, options.limit_rate)
+            || rate_option("--connection-limit-rate", argc, argv, options.connection_limit_rate)) {
+            --argc;
+            ++argv;
         } else {
             fatal_error("unknown option: {}", *argv);
         }
@@ -57,9 +128,18 @@ static void print_help()
 {
     fprintf(stdout, R"(Download app from staticlinux.org
 Usage: app pull [OPTIONS] NAME/PATH:VERSION
+       app pull [OPTIONS] NAME:VERSION --all
 
 Options:
     -h,--help                   Print this help message and exit
+    --all                       Install every file of the package in a single pass
+    --lazy                      Leave stubs in ~/.staticlinux/bin that pull the executables when
+                                they are first run
+    --stats[=text|json]         Print the time and bytes of each phase to stderr
+    --limit-rate RATE           Cap the total download rate, e.g. 500K or 20M bytes per second
+    --connection-limit-rate RATE
+                                Cap the download rate of each connection
+    --no-daemon                 Pull in this process even when app daemon is running
 
 Parameters:
     NAME                        Name of the package
@@ -71,65 +151,94 @@ For more information, please visit %s/commands/pull
         DOC_BASE_LINK);
 }
 
-static int parse_string_permission(std::string_view permission)
+// Reads `size` bytes of a response body in pieces, each decoded on the pool while the next one
+// downloads, so a large file is never held whole.
+static task_t<decoded_file_t> stream_file_async(read_stream_t& read_stream, std::shared_ptr<file_decoder_t> decoder, uint64_t size)
 {
-    if (permission.size() != 9) {
-        throw std::runtime_error { std::format("bad permission string: {}", permission) };
+    constexpr size_t PIECE = 1 << 20;
+
+    auto& pool = worker_pool_t::shared();
+    auto decoding = std::optional<task_t<void>> {};
+    auto transfer = std::chrono::steady_clock::duration {};
+    auto error = std::exception_ptr {};
+    try {
+        for (auto remain = size; remain;) {
+            auto start = std::chrono::steady_clock::now();
+            auto data = co_await read_stream.read_async((size_t)std::min<uint64_t>(PIECE, remain));
+            transfer += std::chrono::steady_clock::now() - start;
+            remain -= data.size();
+            if (decoding) {
+                // Taken out first, so a failed piece isn't awaited again below.
+                auto previous = std::move(*decoding);
+                decoding.reset();
+                co_await previous;
+            }
+            auto job = [decoder, data = std::move(data)] {
+                decoder->add(data);
+            };
+            decoding = pool.run_async(std::move(job));
+        }
+    } catch (...) {
+        error = std::current_exception();
     }
 
-    int mode {};
-    for (int i = 0; i < 3; ++i) {
-        mode <<= 1;
-        if (auto c = permission[i * 3]; c == 'r') {
-            mode |= 1;
-        } else if (c != '-') {
-            throw std::runtime_error { std::format("bad permission string: {}", permission) };
-        }
-        mode <<= 1;
-        if (auto c = permission[i * 3 + 1]; c == 'w') {
-            mode |= 1;
-        } else if (c != '-') {
-            throw std::runtime_error { std::format("bad permission string: {}", permission) };
-        }
-        mode <<= 1;
-        if (auto c = permission[i * 3 + 2]; c == 'x') {
-            mode |= 1;
-        } else if (c != '-') {
-            throw std::runtime_error { std::format("bad permission string: {}", permission) };
+    // A failed download still waits for the piece being decoded, the partial file is removed
+    // before the error goes up.
+    if (error) {
+        if (decoding) {
+            try {
+                co_await *decoding;
+            } catch (...) {
+            }
         }
+        std::rethrow_exception(error);
     }
-    return mode;
+    stats_t::current().add("body_transfer", transfer, size);
+    if (decoding) {
+        co_await *decoding;
+    }
+    auto finish = [decoder] {
+        return decoder->finish();
+    };
+    co_return co_await pool.run_async(std::move(finish));
 }
 
-static task_t<Metadata> pull_metadata_async(read_stream_t& read_stream, size_t metadata_file_len)
+// pull_async() of a file too large to hold whole, see is_streamed_file(): the range is decoded,
+// verified and written as it downloads. A corrupt block fails the pull, it can't be fetched again
+// on its own.
+static task_t<void> pull_streamed_async(std::string name, std::string version, package_index_t index, size_t file_index)
 {
-    trace("Download metadata ...");
-
-    // Read metadata
-    auto data = co_await read_stream.read_async(metadata_file_len);
-
-    trace("Depress metadata ...");
-    auto rawdata = lzma_decompress(data);
-
-    trace("Parse metadata ...");
-    Metadata metadata {};
-    auto doc = YAML::Load(std::string { rawdata.data(), rawdata.data() + rawdata.size() });
-    const auto& files = doc["files"];
-    auto file_regex = std::regex { R"(^([0-9a-f]+)\s+-(([rwx-]{3}){3})\s+(\d+)\s+([^\r\n]+)$)" };
-    for (const auto& file : files) {
-        auto line = file.as<std::string>();
-        auto res = std::smatch {};
-        if (!std::regex_match(line, res, file_regex)) {
-            throw std::runtime_error { std::format("Bad file item: {}", line) };
-        }
-        metadata.files.push_back({
-            .md5 = res[1].str(),
-            .mode = parse_string_permission(res[2].str()),
-            .size = (size_t)atoi(res[4].str().c_str()),
-            .filepath = std::move(res[5].str()),
-        });
-    }
-    co_return metadata;
+    const auto& file = index.metadata.files[file_index];
+    auto first = index.offsets[file_index];
+    auto ranges = std::vector<std::pair<uint64_t, uint64_t>> { { first, first + file.size } };
+    trace("Stream file content, bytes: {}-{}", first, first + file.size - 1);
+    auto response = co_await hedged_get_header_async(index.download_path, http_range_header(ranges));
+    if (auto length = http_content_length(response.headers); length != file.size) {
+        throw std::runtime_error { std::format("expected {} bytes of {}, got {}", file.size, file.filepath, length) };
+    }
+
+    auto decoder = std::make_shared<file_decoder_t>(name, file, installed_file_path(name, file.filepath));
+    auto start = std::chrono::steady_clock::now();
+    auto result = co_await stream_file_async(response.read_stream, std::move(decoder), file.size);
+    mirror_list_t::current().record_transfer(*response.mirror, file.size, std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start));
+    http_release_connection(response.mirror->base_url, std::move(response.read_stream), response.headers);
+    mirror_list_t::current().save();
+    record_decoded_file(result);
+    status("Pull completed");
+    status("Size: {}", result.size);
+    if (file.digest.chunk_size) {
+        status("BLAKE3: {}", to_hex(file.digest.root));
+    } else {
+        status("MD5: {}", file.md5);
+    }
+
+    auto link = link_app_file(name, file);
+    auto recorded = std::vector<Metadata::File> { file };
+    co_await record_installed_async(name, version, std::move(recorded));
+    status("Save to ~/.staticlinux/{}/{}", name, file.filepath);
+    if (!link.empty()) {
+        status("Add symbol link: ~/.staticlinux/bin/{}", link);
+    }
 }
 
 static task_t<void> pull_async(std::string name, std::string version, std::string filepath)
@@ -138,101 +247,340 @@ static task_t<void> pull_async(std::string name, std::string version, std::strin
     assert(!version.empty());
     assert(!filepath.empty());
 
-    auto arch = sizeof(void*) == 4 ? "x86" : "amd64";
-    auto downloadPath = std::format("{0}/{1}/{2}/{3}/{1}-{2}-{3}.slp", APP_DOWNLOAD_BASE_LINK, name, version, arch);
-    status("Pulling from {}", downloadPath);
+    // Processes installing the same package take turns, a later one finds the file in place.
+    auto lock_key = package_lock_key(name);
+    auto lock = co_await file_lock_t::lock_async(lock_key);
 
     // Download metadata.
-    auto [header, read_stream] = co_await http_get_header_async(downloadPath);
-
-    // Read package file header
-    const size_t PACKAGE_HEADER_LEN = 8;
-    auto package_file_header = co_await read_stream.read_async(PACKAGE_HEADER_LEN);
-
-    // Verify magic number
-    if (memcmp(package_file_header.data(), "\xF1SLP\x00", 5)) {
-        throw std::runtime_error { "Invalid package file" };
-    }
-
-    // Get metadata file length
-    auto metadata_file_len = *(uint32_t*)(package_file_header.data() + 4) & ~0xff;
-
-    // Read metadata
-    auto metadata = co_await pull_metadata_async(read_stream, metadata_file_len);
+    auto index = co_await fetch_package_index_async(name, version);
+    const auto& downloadPath = index.download_path;
+    status("Pulling from {}{}", index.mirror->base_url, downloadPath);
+    stats_t::current().label("package", std::format("{}:{}", name, version));
+    stats_t::current().label("mirror", index.mirror->base_url);
 
     // Find out the file item.
-    size_t firstByteOffset { PACKAGE_HEADER_LEN + metadata_file_len };
-    size_t lastByteOffset {};
-    const Metadata::File* pFile {};
-    for (const auto& file : metadata.files) {
-        if (file.filepath == filepath) {
-            pFile = &file;
-            lastByteOffset = firstByteOffset + file.size - 1;
-            break;
+    auto file_index = index.find(filepath);
+    if (file_index < 0) {
+        throw std::runtime_error { std::format("Can't find {} in package {}", filepath, name) };
+    }
+    const auto* pFile = &index.metadata.files[file_index];
+    if (file_md5(installed_file_path(name, filepath)) == pFile->md5) {
+        std::filesystem::permissions(installed_file_path(name, filepath), (std::filesystem::perms)pFile->mode);
+        auto link = link_app_file(name, *pFile);
+        auto recorded = std::vector<Metadata::File> { *pFile };
+        co_await record_installed_async(name, version, std::move(recorded));
+        status("Already installed: ~/.staticlinux/{}/{}", name, filepath);
+        if (!link.empty()) {
+            status("Add symbol link: ~/.staticlinux/bin/{}", link);
         }
-        firstByteOffset += file.size;
+        co_return;
     }
-    if (!lastByteOffset) {
-        throw std::runtime_error { std::format("Can't find {} in package {}", filepath, name) };
+    if (is_streamed_file(*pFile)) {
+        co_await pull_streamed_async(std::move(name), std::move(version), std::move(index), file_index);
+        co_return;
     }
+    uint64_t firstByteOffset = index.offsets[file_index];
+    uint64_t lastByteOffset = firstByteOffset + pFile->size - 1;
 
     // Download file.
     trace("Download file content, bytes: {}-{}", firstByteOffset, lastByteOffset);
-    auto data = co_await http_get_async(downloadPath, { { "range", std::format("bytes={}-{}", firstByteOffset, lastByteOffset) } });
+    auto data = co_await hedged_get_async(downloadPath, { { "range", std::format("bytes={}-{}", firstByteOffset, lastByteOffset) } });
+    mirror_list_t::current().save();
     status("Pull completed");
 
     trace("Decompress content");
-    auto rawdata = lzma_decompress(data);
-    status("Size: {}", rawdata.size());
+    auto rawdata = std::vector<uint8_t> {};
+    for (auto refetched = false;; refetched = true) {
+        auto decompress_timer = stage_timer_t { "decompress" };
+        auto bad_block = std::optional<size_t> {};
+        try {
+            rawdata = decompress_file(*pFile, data);
+        } catch (const corrupt_block_error& ex) {
+            if (refetched) {
+                throw;
+            }
+            warning("{}, fetching it again", ex.what());
+            bad_block = ex.block();
+        }
+        decompress_timer.add_bytes(rawdata.size());
+        decompress_timer.stop();
+        if (!bad_block) {
+            break;
+        }
 
-    // Caculate md5.
-    trace("Verify md5");
-    auto md5 = md5_string(rawdata);
-    status("MD5: {}", md5);
+        // Only the bad block is downloaded again.
+        const auto& block = pFile->blocks[*bad_block];
+        auto ranges = std::vector<std::pair<uint64_t, uint64_t>> { { firstByteOffset + block.offset, firstByteOffset + block.offset + block.compressed_size } };
+        auto fresh = co_await hedged_get_async(downloadPath, http_range_header(ranges));
+        if (fresh.size() != block.compressed_size) {
+            throw std::runtime_error { std::format("expected {} bytes of block {}, got {}", block.compressed_size, *bad_block, fresh.size()) };
+        }
+        std::copy(fresh.begin(), fresh.end(), data.begin() + block.offset);
+    }
+    status("Size: {}", rawdata.size());
 
-    // Make sure md5 is the same.
-    if (md5 != pFile->md5) {
-        throw std::runtime_error { "MD5 doesn't match please contact admin@staticlinux.org" };
+    trace("Verify content");
+    auto verify_start = std::chrono::steady_clock::now();
+    auto verify_stage = verify_content(name, *pFile, rawdata);
+    stats_t::current().add(verify_stage, std::chrono::steady_clock::now() - verify_start, rawdata.size());
+    if (pFile->digest.chunk_size) {
+        status("BLAKE3: {}", to_hex(pFile->digest.root));
+    } else {
+        status("MD5: {}", pFile->md5);
     }
 
     // save
-    auto home = getenv("HOME");
-    if (!home) {
-        throw std::runtime_error { "Can't get HOME environment variable" };
+    auto write_timer = stage_timer_t { "write" };
+    auto link = install_file(name, *pFile, rawdata);
+    write_timer.add_bytes(rawdata.size());
+    write_timer.stop();
+    auto recorded = std::vector<Metadata::File> { *pFile };
+    co_await record_installed_async(name, version, std::move(recorded));
+    status("Save to ~/.staticlinux/{}/{}", name, filepath);
+    if (!link.empty()) {
+        status("Add symbol link: ~/.staticlinux/bin/{}", link);
     }
+}
 
-    auto path = std::filesystem::path { home } / ".staticlinux" / name;
-    if (!std::filesystem::exists(path) && !std::filesystem::create_directories(path)) {
-        throw std::runtime_error { std::format("Can't create path: {}", path.string()) };
+// Streams the whole package over one connection. The files follow the metadata back to back, so
+// each one is cut from the body by its size and decoded on a worker while the next one downloads.
+static task_t<void> pull_all_async(std::string name, std::string version)
+{
+    assert(!name.empty());
+    assert(!version.empty());
+
+    auto lock_key = package_lock_key(name);
+    auto lock = co_await file_lock_t::lock_async(lock_key);
+    auto [index, read_stream] = co_await open_package_async(name, version);
+
+    // Installed whole by another process meanwhile, or before; the body isn't read then.
+    auto installed = std::vector<std::optional<std::string>>(index.metadata.files.size());
+    auto check = [&](size_t i) {
+        installed[i] = file_md5(installed_file_path(name, index.metadata.files[i].filepath));
+    };
+    worker_pool_t::shared().parallel_for(installed.size(), check);
+    auto all_installed = true;
+    for (size_t i = 0; i < installed.size(); ++i) {
+        all_installed = all_installed && installed[i] == index.metadata.files[i].md5;
     }
+    if (all_installed) {
+        for (const auto& file : index.metadata.files) {
+            std::filesystem::permissions(installed_file_path(name, file.filepath), (std::filesystem::perms)file.mode);
+            link_app_file(name, file);
+        }
+        co_await record_installed_async(name, version, index.metadata.files);
+        status("Already installed: {}:{}, {} files", name, version, index.metadata.files.size());
+        co_return;
+    }
+    status("Pulling from {}{}", index.mirror->base_url, index.download_path);
+    stats_t::current().label("package", std::format("{}:{}", name, version));
+    stats_t::current().label("mirror", index.mirror->base_url);
+
+    auto& pool = worker_pool_t::shared();
+    auto pending = std::deque<std::pair<const Metadata::File*, task_t<decoded_file_t>>> {};
+    auto report = [&](const Metadata::File& file, const decoded_file_t& result) {
+        record_decoded_file(result);
+        status("Save to ~/.staticlinux/{}/{} ({} bytes)", name, file.filepath, result.size);
+        if (!result.link.empty()) {
+            status("Add symbol link: ~/.staticlinux/bin/{}", result.link);
+        }
+    };
+    auto finish_oldest = [&]() -> task_t<void> {
+        auto oldest = std::move(pending.front());
+        pending.pop_front();
+        auto result = co_await oldest.second;
+        report(*oldest.first, result);
+    };
 
-    auto path_str = (path / filepath).string();
-    auto fp = std::unique_ptr<FILE, decltype(&fclose)> { fopen(path_str.c_str(), "wb"), &fclose };
-    if (!fp) {
-        throw std::runtime_error { std::format("Can't write file: {}", path_str) };
+    auto start = std::chrono::steady_clock::now();
+    uint64_t total {};
+    for (const auto& file : index.metadata.files) {
+        trace("Download {}, bytes: {}", file.filepath, file.size);
+        total += file.size;
+        if (is_streamed_file(file)) {
+            // Decoded piece by piece as it downloads, after the files before it to keep the order.
+            while (!pending.empty()) {
+                co_await finish_oldest();
+            }
+            auto decoder = std::make_shared<file_decoder_t>(name, file, installed_file_path(name, file.filepath));
+            auto result = co_await stream_file_async(read_stream, std::move(decoder), file.size);
+            result.link = link_app_file(name, file);
+            report(file, result);
+            continue;
+        }
+
+        auto timer = stage_timer_t { "body_transfer" };
+        auto data = co_await read_stream.read_async(file.size);
+        timer.add_bytes(data.size());
+        timer.stop();
+
+        // Bounds the bodies held in memory by what the workers can decode at once. The job owns
+        // copies, it may still run after a failure unwound this frame.
+        auto job = [name, file, data = std::move(data)]() mutable {
+            return decode_and_install(name, file, data);
+        };
+        pending.emplace_back(&file, pool.run_async(std::move(job)));
+        if (pending.size() > pool.size()) {
+            co_await finish_oldest();
+        }
     }
+    mirror_list_t::current().record_transfer(*index.mirror, total, std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start));
+    mirror_list_t::current().save();
 
-    if (fwrite(rawdata.data(), rawdata.size(), 1, fp.get()) < 1) {
-        throw std::runtime_error { std::format("Write file '{}' failed", path_str) };
+    while (!pending.empty()) {
+        co_await finish_oldest();
+    }
+    co_await record_installed_async(name, version, index.metadata.files);
+    status("Pull completed, {} files", index.metadata.files.size());
+}
+
+// Leaves stubs for the executables of a package, or for one of them, fetching only the metadata.
+static task_t<void> pull_lazy_async(std::string name, std::string version, std::string filepath)
+{
+    auto index = co_await fetch_package_index_async(name, version);
+    mirror_list_t::current().save();
+
+    auto files = std::vector<const Metadata::File*> {};
+    if (filepath.empty()) {
+        for (const auto& file : index.metadata.files) {
+            if (file.mode & 0111) {
+                files.push_back(&file);
+            }
+        }
+    } else {
+        auto file_index = index.find(filepath);
+        if (file_index < 0) {
+            throw std::runtime_error { std::format("Can't find {} in package {}", filepath, name) };
+        }
+        if (!(index.metadata.files[file_index].mode & 0111)) {
+            throw std::runtime_error { std::format("{} isn't executable, only executables are pulled lazily", filepath) };
+        }
+        files.push_back(&index.metadata.files[file_index]);
     }
-    status("Save to ~/.staticlinux/{}/{}", name, filepath);
 
-    // change mode
-    if (chmod(path_str.c_str(), pFile->mode) < 0) {
-        throw std::system_error { errno, std::system_category(), "chmod failed" };
+    // The stubs run this binary again on their first execution.
+    auto app = std::filesystem::read_symlink("/proc/self/exe");
+    size_t stubs {};
+    for (const auto* file : files) {
+        auto link = write_lazy_stub(app, name, version, *file);
+        if (link.empty()) {
+            status("Already installed: ~/.staticlinux/bin/{}", std::filesystem::path { file->filepath }.filename().string());
+            continue;
+        }
+        status("Add stub: ~/.staticlinux/bin/{}", link);
+        ++stubs;
+    }
+    status("Added {} stubs for {}:{}", stubs, name, version);
+}
+
+// A pull as resolved from the command line. The daemon receives it as KEY=VALUE fields.
+export struct pull_request_t {
+    std::string name {};
+    std::string version {};
+    // Empty with `all`.
+    std::string path {};
+    bool all {};
+    bool lazy {};
+    bool stats {};
+    bool stats_json {};
+    uint64_t limit_rate {};
+    uint64_t connection_limit_rate {};
+
+    std::vector<std::string> to_fields() const
+    {
+        return {
+            std::format("name={}", name),
+            std::format("version={}", version),
+            std::format("path={}", path),
+            std::format("all={}", (int)all),
+            std::format("lazy={}", (int)lazy),
+            std::format("stats={}", stats ? stats_json ? "json" : "text" : ""),
+            std::format("limit_rate={}", limit_rate),
+            std::format("connection_limit_rate={}", connection_limit_rate),
+        };
     }
 
-    // add symbol if this file is executable
-    if (pFile->mode & 0111) {
-        auto symbolLinkName = std::filesystem::path { filepath }.filename().string();
-        status("Add symbol link: ~/.staticlinux/bin/{}", symbolLinkName);
-        auto binpath = std::filesystem::path { home } / ".staticlinux" / "bin";
-        if (!std::filesystem::exists(binpath) && !std::filesystem::create_directories(binpath)) {
-            throw std::runtime_error { std::format("Can't create path: {}", binpath.string()) };
+    static pull_request_t from_fields(const std::vector<std::string>& fields)
+    {
+        auto request = pull_request_t {};
+        for (const auto& field : fields) {
+            auto eq = field.find('=');
+            auto key = std::string_view { field }.substr(0, eq);
+            auto value = eq == std::string::npos ? std::string {} : field.substr(eq + 1);
+            if (key == "name") {
+                request.name = value;
+            } else if (key == "version") {
+                request.version = value;
+            } else if (key == "path") {
+                request.path = value;
+            } else if (key == "all") {
+                request.all = value == "1";
+            } else if (key == "lazy") {
+                request.lazy = value == "1";
+            } else if (key == "stats") {
+                request.stats = !value.empty();
+                request.stats_json = value == "json";
+            } else if (key == "limit_rate") {
+                request.limit_rate = strtoull(value.c_str(), nullptr, 10);
+            } else if (key == "connection_limit_rate") {
+                request.connection_limit_rate = strtoull(value.c_str(), nullptr, 10);
+            } else {
+                throw std::runtime_error { std::format("unknown pull field: {}", field) };
+            }
         }
-        if (symlink(path_str.c_str(), (binpath / symbolLinkName).c_str()) < 0) {
-            throw std::system_error { errno, std::system_category(), "symlink failed" };
+        if (request.name.empty() || request.version.empty() || (!request.all && request.path.empty())) {
+            throw std::runtime_error { "incomplete pull request" };
         }
+        return request;
+    }
+};
+
+// Pulls in this process, for the command line or for a client of the daemon.
+export task_t<void> run_pull_async(pull_request_t request)
+{
+    // The daemon runs one pull after the other, nothing carries over from the previous one.
+    auto& limits = rate_limits_t::current();
+    limits.total.reset();
+    if (request.limit_rate) {
+        limits.total.emplace(request.limit_rate);
+        stats_t::current().label("limit_rate", std::format("{} B/s", request.limit_rate));
+    }
+    limits.per_connection = request.connection_limit_rate;
+    if (request.connection_limit_rate) {
+        stats_t::current().label("connection_limit_rate", std::format("{} B/s", request.connection_limit_rate));
+    }
+
+    auto run = [&]() -> task_t<void> {
+        if (request.lazy) {
+            return pull_lazy_async(request.name, request.version, request.path);
+        } else if (request.all) {
+            return pull_all_async(request.name, request.version);
+        }
+        return pull_async(request.name, request.version, request.path);
+    };
+
+    if (!request.stats) {
+        co_await run();
+        co_return;
+    }
+
+    // The counters are reported even when zero, so every report has the same keys. Without the
+    // daemon there is no connection pool and connections_reused stays zero.
+    for (auto counter : { "connections", "connections_reused", "requests", "hedges", "retries", "replays" }) {
+        stats_t::current().count(counter, 0);
+    }
+
+    // A failed pull is reported too, it tells which phase got stuck.
+    std::exception_ptr error {};
+    try {
+        co_await run();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    auto report = request.stats_json ? stats_t::current().to_json() : stats_t::current().to_text();
+    logger_t::instance().write(log_level_t::error, report);
+    if (error) {
+        std::rethrow_exception(error);
     }
 }
 
@@ -244,36 +592,116 @@ export task_t<void> pull_async(int argc, const char* argv[])
         co_return;
     }
 
-    if (argc-- == 0) {
+    if (options.args.empty()) {
         fatal_error("NAME parameter is required.");
     }
 
-    auto str = std::string { *argv++ };
+    auto str = std::string { options.args.front() };
+    auto request = pull_request_t {
+        .all = options.all,
+        .lazy = options.lazy,
+        .stats = options.stats,
+        .stats_json = options.stats_json,
+        .limit_rate = options.limit_rate,
+        .connection_limit_rate = options.connection_limit_rate,
+    };
+
+    if (options.all) {
+        auto versionIt = str.find(':');
+        if (versionIt == std::string::npos) {
+            fatal_error("VERSION parameter is required.");
+        }
+
+        request.name = str.substr(0, versionIt);
+        if (request.name.empty()) {
+            fatal_error("NAME parameter is required.");
+        }
+        if (request.name.find('/') != std::string::npos) {
+            fatal_error("--all installs the whole package, PATH isn't allowed.");
+        }
+
+        request.version = str.substr(versionIt + 1);
+        if (request.version.empty()) {
+            fatal_error("VERSION parameter is required.");
+        }
+    } else {
+        auto pathIt = str.find('/');
+        if (pathIt == std::string::npos) {
+            fatal_error("PATH parameter is required.");
+        }
+
+        auto versionIt = str.find(':', pathIt + 1);
+        if (versionIt == std::string::npos) {
+            fatal_error("VERSION parameter is required.");
+        }
+
+        request.name = str.substr(0, pathIt);
+        if (request.name.empty()) {
+            fatal_error("NAME parameter is required.");
+        }
+
+        request.path = str.substr(pathIt + 1, versionIt - pathIt - 1);
+        if (request.path.empty()) {
+            fatal_error("PATH parameter is required.");
+        }
 
-    auto pathIt = str.find('/');
-    if (pathIt == std::string::npos) {
-        fatal_error("PATH parameter is required.");
+        request.version = str.substr(versionIt + 1);
+        if (request.version.empty()) {
+            fatal_error("VERSION parameter is required.");
+        }
     }
 
-    auto versionIt = str.find(':', pathIt + 1);
-    if (versionIt == std::string::npos) {
-        fatal_error("VERSION parameter is required.");
+    // A running daemon has warm connections, DNS answers and metadata; ask it first.
+    if (!options.no_daemon && run_in_daemon("pull", request.to_fields(), client_context_t::current())) {
+        co_return;
     }
+    co_await run_pull_async(std::move(request));
+}
 
-    auto name = str.substr(0, pathIt);
-    if (name.empty()) {
-        fatal_error("NAME parameter is required.");
+// Runs a stub left by `pull --lazy`: pulls the real file, which replaces the stub's link, and
+// executes it with the stub's arguments. Only errors are printed, the output belongs to the app.
+export task_t<void> exec_stub_async(int argc, const char* argv[])
+{
+    if (argc < 1) {
+        fatal_error("STUB parameter is required.");
     }
+    auto args = std::vector<char*> {};
+    for (int i = 0; i < argc; ++i) {
+        args.push_back((char*)argv[i]);
+    }
+    args.push_back(nullptr);
 
-    auto path = str.substr(pathIt + 1, versionIt - pathIt - 1);
-    if (path.empty()) {
-        fatal_error("PATH parameter is required.");
+    // Stubs started at the same time take turns on a lock of the stub. The first one pulls and
+    // replaces the stub with the link, the others then find the link and run it.
+    auto fd = open(argv[0], O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || flock(fd, LOCK_EX) < 0) {
+        throw std::system_error { errno, std::system_category(), std::format("Can't lock {}", argv[0]) };
+    }
+    auto stub = read_lazy_stub(argv[0]);
+    if (!stub) {
+        close(fd);
+        if (!std::filesystem::is_symlink(argv[0])) {
+            fatal_error("{} isn't a stub of app pull --lazy", argv[0]);
+        }
+        execv(argv[0], args.data());
+        throw std::system_error { errno, std::system_category(), std::format("Can't execute {}", argv[0]) };
     }
 
-    auto version = str.substr(versionIt + 1);
-    if (version.empty()) {
-        fatal_error("VERSION parameter is required.");
+    auto path = installed_file_path(stub->name, stub->filepath);
+    if (file_md5(path) != stub->md5) {
+        auto& logger = logger_t::instance();
+        auto level = logger.level();
+        logger.set_level(std::max(level, log_level_t::warning));
+        auto request = pull_request_t { .name = stub->name, .version = stub->version, .path = stub->filepath };
+        co_await run_pull_async(std::move(request));
+        logger.set_level(level);
+        if (file_md5(path) != stub->md5) {
+            throw std::runtime_error { std::format("{}/{}:{} doesn't match the MD5 recorded in its stub", stub->name, stub->filepath, stub->version) };
+        }
     }
+    close(fd);
 
-    co_await pull_async(std::move(name), std::move(version), std::move(path));
-}
\ No newline at end of file
+    logger_t::instance().flush();
+    execv(path.c_str(), args.data());
+    throw std::system_error { errno, std::system_category(), std::format("Can't execute {}", path.string()) };
+}
@@ -0,0 +1,611 @@
+module;
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+export module serve;
+import consts;
+import cppl;
+import dns;
+import http_client;
+import log;
+import message_queue;
+import mirrors;
+import package;
+import read_stream;
+import string_utils;
+import worker_pool;
+
+using cppl::task_state_t;
+using cppl::task_t;
+using namespace std::chrono_literals;
+
+struct Options {
+    bool help {};
+    bool offline {};
+    std::string bind { "0.0.0.0" };
+    uint16_t port { 8089 };
+    std::string cache_dir {};
+};
+
+static Options parse_options(int& argc, const char**& argv)
+{
+    auto options = Options {};
+    auto value = [&]() -> const char* {
+        if (argc < 2) {
+            fatal_error("missing value for option: {}", *argv);
+        }
+        --argc;
+        return *++argv;
+    };
+    while (argc && **argv == '-') {
+        if (!strcmp(*argv + 1, "h") || !strcmp(*argv + 1, "-help")) {
+            options.help = true;
+        } else if (!strcmp(*argv + 1, "-offline")) {
+            options.offline = true;
+        } else if (!strcmp(*argv + 1, "-bind")) {
+            options.bind = value();
+        } else if (!strcmp(*argv + 1, "-port")) {
+            options.port = atoi(value());
+        } else if (!strcmp(*argv + 1, "-cache-dir")) {
+            options.cache_dir = value();
+        } else {
+            fatal_error("unknown option: {}", *argv);
+        }
+        --argc;
+        ++argv;
+    }
+    return options;
+}
+
+static void print_help()
+{
+    fprintf(stdout, R"(Serve cached packages to other hosts, as a mirror
+Usage: app serve [OPTIONS]
+
+Options:
+    -h,--help                   Print this help message and exit
+    --bind ADDRESS              IPv4 address to listen on (default: 0.0.0.0)
+    --port N                    Port to listen on (default: 8089)
+    --cache-dir DIR             Where packages are kept (default: ~/.staticlinux/cache)
+    --offline                   Serve only cached packages, never fetch from the mirrors
+
+Other hosts use it with APP_MIRRORS=http://HOST:PORT or a line in ~/.staticlinux/mirrors.
+
+For more information, please visit %s/commands/serve
+)",
+        DOC_BASE_LINK);
+}
+
+// Serves .slp packages from a cache directory, laid out like the mirror, over HTTP/1.1 with
+// keep-alive and Range support. Bodies are sent with sendfile(). A package that is not cached is
+// fetched from the mirrors into a partial file, which requests for it are answered from as it
+// grows; it goes into the cache once it downloaded completely and verified.
+class peer_cache_t {
+public:
+    explicit peer_cache_t(const Options& options)
+        : m_cache_dir { options.cache_dir }
+        , m_offline { options.offline }
+    {
+        m_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+        if (m_listen_fd < 0) {
+            throw std::system_error { errno, std::system_category(), "create socket failed" };
+        }
+
+        int yes = 1;
+        setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+        auto address = sockaddr_in { .sin_family = AF_INET, .sin_port = htons(options.port) };
+        if (inet_pton(AF_INET, options.bind.c_str(), &address.sin_addr) != 1) {
+            throw std::runtime_error { std::format("invalid bind address: {}", options.bind) };
+        }
+        if (bind(m_listen_fd, (const sockaddr*)&address, sizeof(address)) < 0) {
+            throw std::system_error { errno, std::system_category(), std::format("bind to {}:{} failed", options.bind, options.port) };
+        }
+        if (listen(m_listen_fd, SOMAXCONN) < 0) {
+            throw std::system_error { errno, std::system_category(), "listen failed" };
+        }
+    }
+
+    peer_cache_t(const peer_cache_t&) = delete;
+
+    ~peer_cache_t()
+    {
+        close(m_listen_fd);
+    }
+
+    peer_cache_t& operator=(const peer_cache_t&) = delete;
+
+    task_t<void> serve_async()
+    {
+        auto& queue = message_queue_t::current();
+        while (true) {
+            auto fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    co_await queue.await(m_listen_fd, EPOLLIN);
+                    continue;
+                } else if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                throw std::system_error { errno, std::system_category(), "accept failed" };
+            }
+
+            int yes = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+            serve_connection_async(read_stream_t { fd });
+        }
+    }
+
+private:
+    static constexpr auto KEEP_ALIVE_TIMEOUT = 30s;
+
+    struct request_t {
+        std::string method {};
+        std::string path {};
+        std::string range {};
+        bool keep_alive { true };
+    };
+
+    // Requests are answered one at a time, pipelined ones wait in the read stream's buffer.
+    task_t<void> serve_connection_async(read_stream_t stream)
+    {
+        stream.set_idle_timeout(KEEP_ALIVE_TIMEOUT);
+        try {
+            while (true) {
+                auto request = co_await read_request_async(stream);
+                if (!request) {
+                    break;
+                }
+                co_await respond_async(stream.native_handle(), *request);
+                if (!request->keep_alive) {
+                    break;
+                }
+            }
+        } catch (const std::exception& ex) {
+            // The client went away, idled out or sent garbage.
+            trace("serve: connection closed: {}", ex.what());
+        }
+    }
+
+    static task_t<std::optional<request_t>> read_request_async(read_stream_t& stream)
+    {
+        auto line = std::string {};
+        do {
+            line = co_await stream.read_line_async();
+        } while (line.empty());
+
+        auto method_end = line.find(' ');
+        auto path_end = line.find(' ', method_end + 1);
+        if (method_end == std::string::npos || path_end == std::string::npos) {
+            co_return std::nullopt;
+        }
+
+        auto request = request_t { .method = line.substr(0, method_end), .path = line.substr(method_end + 1, path_end - method_end - 1) };
+        request.keep_alive = line.substr(path_end + 1) != "HTTP/1.0";
+        while (true) {
+            auto header = co_await stream.read_line_async();
+            if (header.empty()) {
+                break;
+            }
+            auto colon = header.find(':');
+            if (colon == std::string::npos) {
+                continue;
+            }
+            auto name = tolower(trim(header.substr(0, colon)));
+            auto value = trim(header.substr(colon + 1));
+            if (name == "range") {
+                request.range = value;
+            } else if (name == "connection") {
+                request.keep_alive = tolower(value) != "close";
+            }
+        }
+        co_return request;
+    }
+
+    task_t<void> respond_async(int fd, const request_t& request)
+    {
+        auto connection = request.keep_alive ? "keep-alive" : "close";
+        if (request.method != "GET" && request.method != "HEAD") {
+            co_await write_async(fd, std::format("HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD\r\nContent-Length: 0\r\nConnection: {}\r\n\r\n", connection));
+            co_return;
+        }
+        if (!is_package_path(request.path)) {
+            co_await write_async(fd, std::format("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: {}\r\n\r\n", connection));
+            co_return;
+        }
+
+        auto file = co_await open_package_async(request.path);
+        if (file.fd < 0) {
+            co_await write_async(fd, std::format("HTTP/1.1 {}\r\nContent-Length: 0\r\nConnection: {}\r\n\r\n", file.error, connection));
+            co_return;
+        }
+
+        uint64_t first {};
+        uint64_t end = file.size;
+        auto status = "200 OK";
+        auto content_range = std::string {};
+        if (!request.range.empty()) {
+            auto range = parse_range_header(request.range, file.size);
+            if (!range) {
+                co_await write_async(fd, std::format("HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\nContent-Range: bytes */{}\r\nConnection: {}\r\n\r\n", file.size, connection));
+                co_return;
+            }
+            std::tie(first, end) = *range;
+            status = "206 Partial Content";
+            content_range = std::format("Content-Range: bytes {}-{}/{}\r\n", first, end - 1, file.size);
+        }
+
+        co_await write_async(fd, std::format("HTTP/1.1 {}\r\nContent-Type: application/octet-stream\r\nContent-Length: {}\r\n{}Accept-Ranges: bytes\r\nConnection: {}\r\n\r\n", status, end - first, content_range, connection));
+        if (request.method == "GET") {
+            co_await sendfile_async(fd, file.fd, first, end - first, file.fill);
+        }
+    }
+
+    // A package being downloaded into the cache.
+    struct fill_t {
+        std::filesystem::path tmp_path {};
+        int fd { -1 };
+        // Known once the mirror answered.
+        std::optional<uint64_t> size {};
+        // Bytes written to the partial file so far.
+        uint64_t filled {};
+        bool done {};
+        std::exception_ptr error {};
+        std::vector<std::shared_ptr<task_state_t<void>>> waiters {};
+
+        fill_t() = default;
+        fill_t(const fill_t&) = delete;
+
+        ~fill_t()
+        {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        fill_t& operator=(const fill_t&) = delete;
+
+        // Resumes when the download made progress, finished or failed.
+        task_t<void> wait_async()
+        {
+            auto wait = std::make_shared<task_state_t<void>>();
+            waiters.push_back(wait);
+            return task_t<void> { wait };
+        }
+
+        void notify()
+        {
+            for (auto& waiter : std::exchange(waiters, {})) {
+                waiter->set_value();
+            }
+        }
+    };
+
+    // Copies the file range to the socket in the kernel, without passing through user space. While
+    // `fill` is downloading the file, only the bytes written so far are sent, then it waits for
+    // more.
+    static task_t<void> sendfile_async(int fd, int file_fd, uint64_t offset, uint64_t size, std::shared_ptr<fill_t> fill)
+    {
+        auto off = (off_t)offset;
+        while (size) {
+            auto available = size;
+            if (fill && !fill->done) {
+                if (fill->error) {
+                    throw std::runtime_error { "package download failed" };
+                }
+                if (fill->filled <= (uint64_t)off) {
+                    co_await fill->wait_async();
+                    continue;
+                }
+                available = std::min(size, fill->filled - off);
+            }
+            auto num = sendfile(fd, file_fd, &off, available);
+            if (num > 0) {
+                size -= num;
+            } else if (num == 0) {
+                throw std::runtime_error { "package file was truncated" };
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                co_await with_deadline(message_queue_t::current().await(fd, EPOLLOUT), http_timeouts().body_idle, fd);
+            } else if (errno != EINTR) {
+                throw std::system_error { errno, std::system_category(), "sendfile failed" };
+            }
+        }
+    }
+
+    // Only /NAME/VERSION/ARCH/FILE.slp, anything that could leave the cache directory is refused.
+    static bool is_package_path(std::string_view path)
+    {
+        return path.starts_with('/') && path.ends_with(".slp") && std::count(path.begin(), path.end(), '/') == 4
+            && path.find("..") == std::string_view::npos && path.find("//") == std::string_view::npos;
+    }
+
+    struct open_file_t {
+        int fd { -1 };
+        uint64_t size {};
+        // Status line when fd is -1.
+        std::string error {};
+        // Set while the file is still downloading.
+        std::shared_ptr<fill_t> fill {};
+
+        open_file_t() = default;
+        open_file_t(const open_file_t&) = delete;
+
+        open_file_t(open_file_t&& f)
+            : fd { std::exchange(f.fd, -1) }
+            , size { f.size }
+            , error { std::move(f.error) }
+            , fill { std::move(f.fill) }
+        {
+        }
+
+        ~open_file_t()
+        {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    };
+
+    task_t<open_file_t> open_package_async(const std::string& path)
+    {
+        auto cache_path = m_cache_dir / path.substr(1);
+        auto file = open_file_t {};
+        file.fd = open(cache_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file.fd < 0 && errno == ENOENT && !m_offline) {
+            auto fill = start_fill(path, cache_path);
+            while (!fill->size && !fill->error) {
+                co_await fill->wait_async();
+            }
+            if (fill->error) {
+                file.error = "502 Bad Gateway";
+                co_return file;
+            }
+            // The partial file may be renamed or removed meanwhile, the descriptor stays valid.
+            file.fd = fcntl(fill->fd, F_DUPFD_CLOEXEC, 0);
+            file.size = *fill->size;
+            file.fill = std::move(fill);
+            co_return file;
+        }
+        if (file.fd < 0) {
+            file.error = "404 Not Found";
+            co_return file;
+        }
+
+        struct stat st {};
+        fstat(file.fd, &st);
+        file.size = st.st_size;
+        co_return file;
+    }
+
+    // Returns the download of `path` into the cache, starting it unless it is running already.
+    std::shared_ptr<fill_t> start_fill(const std::string& path, const std::filesystem::path& cache_path)
+    {
+        if (auto it = m_fills.find(path); it != m_fills.end()) {
+            return it->second;
+        }
+        auto fill = std::make_shared<fill_t>();
+        m_fills.emplace(path, fill);
+        fill_async(path, cache_path, fill);
+        return fill;
+    }
+
+    task_t<void> fill_async(std::string path, std::filesystem::path cache_path, std::shared_ptr<fill_t> fill)
+    {
+        auto error = std::exception_ptr {};
+        try {
+            co_await download_async(path, cache_path, fill);
+        } catch (const std::exception& ex) {
+            warning("serve: fetching {} failed: {}", path, ex.what());
+            error = std::current_exception();
+        }
+
+        m_fills.erase(path);
+        if (error) {
+            auto ec = std::error_code {};
+            std::filesystem::remove(fill->tmp_path, ec);
+            fill->error = error;
+        } else {
+            fill->done = true;
+        }
+        fill->notify();
+    }
+
+    // Downloads `path` from the mirrors into the partial file of `fill`. The disk writes run on the
+    // worker pool, each one while the next piece downloads. The package is verified before it is
+    // renamed into the cache, so the cache only ever holds complete and intact packages.
+    static task_t<void> download_async(std::string path, std::filesystem::path cache_path, std::shared_ptr<fill_t> fill)
+    {
+        constexpr uint64_t PIECE = 1 << 20;
+
+        status("serve: fetching {}", path);
+        std::filesystem::create_directories(cache_path.parent_path());
+        fill->tmp_path = cache_path;
+        fill->tmp_path += std::format(".part{}", getpid());
+
+        auto headers = std::unordered_multimap<std::string, std::string> {};
+        auto response = co_await hedged_get_header_async(path, std::move(headers));
+        fill->fd = open(fill->tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fill->fd < 0) {
+            throw std::system_error { errno, std::system_category(), std::format("create {} failed", fill->tmp_path.string()) };
+        }
+        auto total = http_content_length(response.headers);
+        fill->size = total;
+        fill->notify();
+
+        auto& pool = worker_pool_t::shared();
+        auto writing = std::optional<task_t<void>> {};
+        auto error = std::exception_ptr {};
+        auto start = std::chrono::steady_clock::now();
+        try {
+            for (uint64_t offset = 0; offset < total;) {
+                size_t piece = std::min(PIECE, total - offset);
+                auto data = co_await response.read_stream.read_async(piece);
+                if (writing) {
+                    // Taken out first, so a failed write isn't awaited again below.
+                    auto previous = std::move(*writing);
+                    writing.reset();
+                    co_await previous;
+                    fill->filled = offset;
+                    fill->notify();
+                }
+                auto at = offset;
+                offset += data.size();
+                auto job = [fill, data = std::move(data), offset = at] {
+                    for (size_t written = 0; written < data.size();) {
+                        auto num = pwrite(fill->fd, data.data() + written, data.size() - written, offset + written);
+                        if (num < 0 && errno != EINTR) {
+                            throw std::system_error { errno, std::system_category(), "write cache file failed" };
+                        }
+                        written += std::max<ssize_t>(num, 0);
+                    }
+                };
+                writing = pool.run_async(std::move(job));
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        // The piece being written is waited for either way, the partial file is removed after.
+        if (error) {
+            if (writing) {
+                try {
+                    co_await *writing;
+                } catch (...) {
+                }
+            }
+            std::rethrow_exception(error);
+        }
+        if (writing) {
+            co_await *writing;
+        }
+        fill->filled = total;
+        fill->notify();
+        mirror_list_t::current().record_transfer(*response.mirror, total, std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start));
+
+        auto verify = [fill, path] {
+            verify_package_file(fill->tmp_path, path);
+            if (fdatasync(fill->fd) < 0) {
+                throw std::system_error { errno, std::system_category(), "sync cache file failed" };
+            }
+        };
+        co_await pool.run_async(std::move(verify));
+        std::filesystem::rename(fill->tmp_path, cache_path);
+        status("serve: cached {}", path);
+    }
+
+    std::filesystem::path m_cache_dir {};
+    bool m_offline {};
+    int m_listen_fd { -1 };
+    std::unordered_map<std::string, std::shared_ptr<fill_t>> m_fills {};
+};
+
+// True when `address` belongs to this host, i.e. a socket can be bound to it.
+static bool is_local_address(const in_addr& address)
+{
+    auto sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (sd < 0) {
+        return false;
+    }
+    auto addr = sockaddr_in { .sin_family = AF_INET, .sin_port = 0, .sin_addr = address };
+    auto local = bind(sd, (const sockaddr*)&addr, sizeof(addr)) == 0;
+    close(sd);
+    return local;
+}
+
+// True when the mirror `url` is this server: same port, and its host is the bind address, or any
+// address of this host when listening on all of them.
+static task_t<bool> is_own_url_async(std::string url, const Options& options)
+{
+    auto uri = parse_uri(url);
+    if (uri.port != options.port) {
+        co_return false;
+    }
+    in_addr bind_address {};
+    inet_pton(AF_INET, options.bind.c_str(), &bind_address);
+    auto addresses = co_await dns_resolver_t::current().resolve_async(uri.host, uri.port);
+    for (const auto& address : addresses) {
+        if (address.family() != AF_INET) {
+            continue;
+        }
+        auto addr = ((const sockaddr_in*)address.data())->sin_addr;
+        if (bind_address.s_addr == INADDR_ANY ? is_local_address(addr) : addr.s_addr == bind_address.s_addr) {
+            co_return true;
+        }
+    }
+    co_return false;
+}
+
+// Drops this server from its own mirror list, a cache that fetched from itself would wait for
+// its own download.
+static task_t<void> exclude_own_mirrors_async(const Options& options)
+{
+    auto& mirrors = mirror_list_t::current();
+    auto urls = std::vector<std::string> {};
+    for (auto mirror : mirrors.ranked()) {
+        urls.push_back(mirror->base_url);
+    }
+    for (const auto& url : urls) {
+        auto own = false;
+        try {
+            own = co_await is_own_url_async(url, options);
+        } catch (const std::exception& ex) {
+            debug("serve: can't tell whether {} is this server: {}", url, ex.what());
+        }
+        if (own) {
+            warning("serve: not fetching from {}, it is this server", url);
+            mirrors.remove(url);
+        }
+    }
+}
+
+export task_t<void> serve_async(int argc, const char* argv[])
+{
+    auto options = parse_options(argc, argv);
+    if (options.help) {
+        print_help();
+        co_return;
+    }
+    if (argc) {
+        fatal_error("unexpected argument: {}", *argv);
+    }
+
+    if (options.cache_dir.empty()) {
+        auto home = getenv("HOME");
+        if (!home) {
+            throw std::runtime_error { "Can't get HOME environment variable" };
+        }
+        options.cache_dir = (std::filesystem::path { home } / ".staticlinux" / "cache").string();
+    }
+
+    auto server = peer_cache_t { options };
+    if (!options.offline) {
+        co_await exclude_own_mirrors_async(options);
+    }
+    status("Serving {} on http://{}:{}", options.cache_dir, options.bind, options.port);
+    co_await server.serve_async();
+}
@@ -0,0 +1,345 @@
+module;
+
+#include <algorithm>
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+export module upgrade;
+import consts;
+import cppl;
+import file_lock;
+import http_client;
+import installed;
+import log;
+import metadata;
+import mirrors;
+import package;
+import stats;
+import worker_pool;
+
+using cppl::task_t;
+
+struct Options {
+    bool help {};
+    bool all {};
+    std::vector<std::string_view> args {};
+};
+
+static Options parse_options(int& argc, const char**& argv)
+{
+    auto options = Options {};
+    while (argc) {
+        if (**argv != '-') {
+            options.args.push_back(*argv);
+        } else if (!strcmp(*argv + 1, "h") || !strcmp(*argv + 1, "-help")) {
+            options.help = true;
+        } else if (!strcmp(*argv + 1, "-all")) {
+            options.all = true;
+        } else {
+            fatal_error("unknown option: {}", *argv);
+        }
+        --argc;
+        ++argv;
+    }
+    return options;
+}
+
+static void print_help()
+{
+    fprintf(stdout, R"(Upgrade an installed package, downloading only the files that changed
+Usage: app upgrade [OPTIONS] NAME:OLD->NEW
+
+Options:
+    -h,--help                   Print this help message and exit
+    --all                       Also install the files of NEW that aren't installed
+
+Parameters:
+    NAME                        Name of the package
+    OLD                         Installed version
+    NEW                         Version to upgrade to, "→" may be used instead of "->"
+
+For more information, please visit %s/commands/upgrade
+)",
+        DOC_BASE_LINK);
+}
+
+// Most servers cap the ranges of one request, larger deltas take several requests.
+constexpr size_t MAX_RANGES = 32;
+
+// A file of the new version that ends up installed.
+struct upgrade_file_t {
+    const Metadata::File* file {};
+    uint64_t offset {};
+    bool changed {};
+};
+
+// Merges the changed files into [first, end) ranges, files next to each other share one.
+static std::vector<std::pair<uint64_t, uint64_t>> changed_ranges(const std::vector<const upgrade_file_t*>& files)
+{
+    auto ranges = std::vector<std::pair<uint64_t, uint64_t>> {};
+    for (const auto* file : files) {
+        if (!ranges.empty() && ranges.back().second == file->offset) {
+            ranges.back().second += file->file->size;
+        } else {
+            ranges.emplace_back(file->offset, file->offset + file->file->size);
+        }
+    }
+    return ranges;
+}
+
+// Removes the links in ~/.staticlinux/bin that pointed into `dir` at files that are gone.
+static void remove_stale_links(const std::filesystem::path& dir)
+{
+    auto ec = std::error_code {};
+    auto prefix = dir.string() + "/";
+    for (const auto& entry : std::filesystem::directory_iterator { staticlinux_home() / "bin", ec }) {
+        if (!entry.is_symlink(ec)) {
+            continue;
+        }
+        auto target = std::filesystem::read_symlink(entry.path(), ec);
+        if (!ec && target.string().starts_with(prefix) && !std::filesystem::exists(target, ec)) {
+            trace("Remove stale link {}", entry.path().string());
+            std::filesystem::remove(entry.path(), ec);
+        }
+    }
+}
+
+// Removes a staging tree that is no longer needed. What is left over only takes space, the next
+// upgrade to the same version removes it first.
+static void remove_staging(const std::filesystem::path& staging)
+{
+    auto ec = std::error_code {};
+    if (std::filesystem::remove_all(staging, ec); ec) {
+        warning("Can't remove {}: {}", staging.string(), ec.message());
+    }
+}
+
+// Builds NEW next to the installed tree: unchanged files are hard links to the installed ones,
+// changed files are range-fetched and decoded into it. Then both trees are swapped at once.
+static task_t<void> upgrade_async(std::string name, std::string old_version, std::string new_version, bool all)
+{
+    auto current = staticlinux_home() / name;
+    if (!std::filesystem::is_directory(current)) {
+        throw std::runtime_error { std::format("{} isn't installed", name) };
+    }
+
+    // The staging tree and the switch are per package, one process at a time.
+    auto lock_key = package_lock_key(name);
+    auto lock = co_await file_lock_t::lock_async(lock_key);
+
+    // Files recorded at another version than OLD mean the tree isn't what the user thinks it is.
+    // Trees installed before installed.db have no record, their md5s still tell what changed.
+    for (const auto& file : load_installed(name)) {
+        if (file.version != old_version) {
+            throw std::runtime_error { std::format("{} is installed at {}, not {}; run app pull --all {}:{} instead", name, file.version, old_version, name, new_version) };
+        }
+    }
+    auto index = co_await fetch_package_index_async(name, new_version);
+    status("Upgrading {} from {} to {}, using {}{}", name, old_version, new_version, index.mirror->base_url, index.download_path);
+    stats_t::current().label("package", std::format("{}:{}->{}", name, old_version, new_version));
+    stats_t::current().label("mirror", index.mirror->base_url);
+
+    // The installed files are hashed in parallel in one pool job, their md5s tell which files
+    // changed.
+    auto& pool = worker_pool_t::shared();
+    auto md5s = std::vector<std::optional<std::string>>(index.metadata.files.size());
+    auto hash = [&] {
+        pool.parallel_for(md5s.size(), [&](size_t i) { md5s[i] = file_md5(current / index.metadata.files[i].filepath); });
+    };
+    co_await pool.run_async(std::move(hash));
+    auto files = std::vector<upgrade_file_t> {};
+    for (size_t i = 0; i < md5s.size(); ++i) {
+        const auto& file = index.metadata.files[i];
+        const auto& md5 = md5s[i];
+        if (md5 || all) {
+            files.push_back({ &file, index.offsets[i], !md5 || *md5 != file.md5 });
+        }
+    }
+    if (files.empty()) {
+        throw std::runtime_error { std::format("None of the files of {}:{} is installed", name, new_version) };
+    }
+
+    // Left over by an upgrade that was killed; its files can't be trusted.
+    auto staging = staticlinux_home() / std::format(".{}-{}.upgrade", name, new_version);
+    auto ec = std::error_code {};
+    if (std::filesystem::remove_all(staging, ec); ec) {
+        throw std::runtime_error { std::format("Can't remove {}: {}", staging.string(), ec.message()) };
+    }
+
+    auto changed = std::vector<const upgrade_file_t*> {};
+    size_t unchanged {};
+    size_t downloaded {};
+    // At most two decodes per worker are in flight, a large delta doesn't queue a job, and an
+    // eventfd, per file.
+    auto decodes = std::deque<task_t<decoded_file_t>> {};
+    auto max_decodes = pool.size() * 2;
+    std::exception_ptr error {};
+    try {
+        for (const auto& file : files) {
+            if (file.changed) {
+                changed.push_back(&file);
+                continue;
+            }
+            auto from = current / file.file->filepath;
+            auto to = staging / file.file->filepath;
+            std::filesystem::create_directories(to.parent_path());
+            if (std::filesystem::create_hard_link(from, to, ec); ec) {
+                std::filesystem::copy_file(from, to);
+            }
+            ++unchanged;
+        }
+
+        // The files of each part are decoded on the pool while the next part downloads.
+        auto pending = changed;
+        while (!pending.empty()) {
+            auto ranges = changed_ranges(pending);
+            ranges.resize(std::min(ranges.size(), MAX_RANGES));
+            trace("Download {} ranges of {}", ranges.size(), index.download_path);
+            auto response = co_await hedged_get_header_async(index.download_path, http_range_header(ranges));
+            auto reader = http_byte_range_reader_t { response.read_stream, response.headers };
+            auto received = std::vector<bool>(pending.size());
+            while (true) {
+                auto timer = stage_timer_t { "body_transfer" };
+                auto part = co_await reader.next_async();
+                if (!part) {
+                    timer.discard();
+                    break;
+                }
+                timer.add_bytes(part->data.size());
+                timer.stop();
+                downloaded += part->data.size();
+
+                auto first = part->first;
+                auto body = std::make_shared<std::vector<uint8_t>>(std::move(part->data));
+                for (size_t i = 0; i < pending.size(); ++i) {
+                    const auto* file = pending[i];
+                    if (received[i] || file->offset < first || file->offset + file->file->size > first + body->size()) {
+                        continue;
+                    }
+                    received[i] = true;
+                    while (decodes.size() >= max_decodes) {
+                        // Taken out first, so a failed decode isn't awaited again below.
+                        auto oldest = std::move(decodes.front());
+                        decodes.pop_front();
+                        auto decoded = co_await oldest;
+                        record_decoded_file(decoded);
+                    }
+                    auto start = file->offset - first;
+                    auto job = [name, metadata = *file->file, body, start, path = staging / file->file->filepath] {
+                        auto compressed = std::vector<uint8_t> { body->begin() + start, body->begin() + start + metadata.size };
+                        return decode_and_write(name, metadata, compressed, path);
+                    };
+                    decodes.push_back(pool.run_async(std::move(job)));
+                }
+            }
+
+            // Servers may merge the ranges or send fewer, files that didn't come are asked again.
+            auto missing = std::vector<const upgrade_file_t*> {};
+            for (size_t i = 0; i < pending.size(); ++i) {
+                if (!received[i]) {
+                    missing.push_back(pending[i]);
+                }
+            }
+            if (missing.size() == pending.size()) {
+                throw std::runtime_error { std::format("{} answered none of the requested ranges", response.mirror->base_url) };
+            }
+            pending = std::move(missing);
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    // Every decode finishes before the staging tree is switched or removed.
+    for (auto& decode : decodes) {
+        try {
+            record_decoded_file(co_await decode);
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    mirror_list_t::current().save();
+    if (error) {
+        remove_staging(staging);
+        std::rethrow_exception(error);
+    }
+
+    // RENAME_EXCHANGE swaps both trees in one step, the old one is removed afterwards.
+    if (renameat2(AT_FDCWD, staging.c_str(), AT_FDCWD, current.c_str(), RENAME_EXCHANGE) < 0) {
+        auto error = errno;
+        remove_staging(staging);
+        throw std::system_error { error, std::system_category(), std::format("Can't switch {} to {}", current.string(), new_version) };
+    }
+    remove_staging(staging);
+
+    for (const auto& file : files) {
+        try {
+            if (auto link = link_app_file(name, *file.file); !link.empty()) {
+                trace("Linked ~/.staticlinux/bin/{}", link);
+            }
+        } catch (const std::exception& ex) {
+            warning("Can't link {}: {}", file.file->filepath, ex.what());
+        }
+    }
+    remove_stale_links(current);
+
+    auto installed = std::vector<Metadata::File> {};
+    for (const auto& file : files) {
+        installed.push_back(*file.file);
+    }
+    co_await record_installed_async(name, new_version, std::move(installed), /*replace=*/true);
+
+    status("Upgraded {} to {}: {} files downloaded ({} bytes), {} unchanged", name, new_version, changed.size(), downloaded, unchanged);
+}
+
+export task_t<void> upgrade_async(int argc, const char* argv[])
+{
+    auto options = parse_options(argc, argv);
+    if (options.help) {
+        print_help();
+        co_return;
+    }
+    if (options.args.size() != 1) {
+        fatal_error("NAME:OLD->NEW parameter is required.");
+    }
+
+    auto str = std::string_view { options.args.front() };
+    auto versionIt = str.find(':');
+    if (versionIt == std::string_view::npos || versionIt == 0) {
+        fatal_error("NAME:OLD->NEW parameter is required.");
+    }
+    auto name = std::string { str.substr(0, versionIt) };
+    auto versions = str.substr(versionIt + 1);
+
+    auto arrow = std::string_view { "->" };
+    auto arrowIt = versions.find(arrow);
+    if (arrowIt == std::string_view::npos) {
+        arrow = "→";
+        arrowIt = versions.find(arrow);
+    }
+    if (arrowIt == std::string_view::npos || arrowIt == 0 || arrowIt + arrow.size() == versions.size()) {
+        fatal_error("OLD and NEW versions are required, e.g. {}:1.0->1.1", name);
+    }
+    auto old_version = std::string { versions.substr(0, arrowIt) };
+    auto new_version = std::string { versions.substr(arrowIt + arrow.size()) };
+    if (old_version == new_version) {
+        fatal_error("{} is already at {}", name, new_version);
+    }
+
+    co_await upgrade_async(std::move(name), std::move(old_version), std::move(new_version), options.all);
+}
@@ -0,0 +1,247 @@
+module;
+
+#include <algorithm>
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <utility>
+#include <vector>
+
+export module verify;
+import consts;
+import cppl;
+import http_client;
+import installed;
+import log;
+import metadata;
+import mirrors;
+import package;
+import stats;
+import worker_pool;
+
+using cppl::task_t;
+
+struct Options {
+    bool help {};
+    bool repair {};
+    std::vector<std::string> names {};
+};
+
+static Options parse_options(int& argc, const char**& argv)
+{
+    auto options = Options {};
+    while (argc) {
+        if (**argv != '-') {
+            options.names.push_back(*argv);
+        } else if (!strcmp(*argv + 1, "h") || !strcmp(*argv + 1, "-help")) {
+            options.help = true;
+        } else if (!strcmp(*argv + 1, "-repair")) {
+            options.repair = true;
+        } else {
+            fatal_error("unknown option: {}", *argv);
+        }
+        --argc;
+        ++argv;
+    }
+    return options;
+}
+
+static void print_help()
+{
+    fprintf(stdout, R"(Check installed apps against the package metadata they were installed from
+Usage: app verify [OPTIONS] [NAME...]
+
+Options:
+    -h,--help                   Print this help message and exit
+    --repair                    Pull the files that don't match again and restore their modes
+
+Parameters:
+    NAME                        Name of an installed package (default: every installed package)
+
+For more information, please visit %s/commands/verify
+)",
+        DOC_BASE_LINK);
+}
+
+// Files smaller than this are hashed together in one job, so the pool isn't flooded with jobs
+// that are mostly scheduling overhead.
+constexpr size_t BATCH_BYTES = 1 << 20;
+
+struct checked_file_t {
+    std::string name {};
+    installed_file_t file {};
+    size_t size {};
+    bool missing {};
+    // Set when the mode or the content differs from the record.
+    std::optional<int> mode {};
+    bool modified {};
+};
+
+// Hashes a batch of files on a worker, each one mapped rather than read.
+static void hash_batch(const std::vector<checked_file_t*>& batch)
+{
+    for (auto* checked : batch) {
+        auto md5 = file_md5(installed_file_path(checked->name, checked->file.path));
+        checked->modified = !md5 || *md5 != checked->file.md5;
+    }
+}
+
+// A decode of a repaired file on the pool.
+struct repair_t {
+    std::string path {};
+    task_t<decoded_file_t> decode;
+};
+
+// Pulls the bad files of one package version again, one range request each, and decodes each one
+// on the pool while the next one downloads.
+static task_t<void> repair_async(std::string name, std::string version, std::vector<checked_file_t*> files)
+{
+    auto index = co_await fetch_package_index_async(name, version);
+    auto pending = std::optional<repair_t> {};
+    std::exception_ptr error {};
+    try {
+        for (const auto* checked : files) {
+            auto i = index.find(checked->file.path);
+            if (i < 0) {
+                throw std::runtime_error { std::format("Can't find {} in package {}:{}", checked->file.path, name, version) };
+            }
+            const auto& file = index.metadata.files[i];
+            auto ranges = std::vector<std::pair<uint64_t, uint64_t>> { { index.offsets[i], index.offsets[i] + file.size } };
+            auto data = co_await hedged_get_async(index.download_path, http_range_header(ranges));
+            if (pending) {
+                // Taken out first, so a failed decode isn't awaited again below.
+                auto previous = std::move(*pending);
+                pending.reset();
+                auto decoded = co_await previous.decode;
+                record_decoded_file(decoded);
+                status("Repaired {}/{}", name, previous.path);
+            }
+            auto job = [name, file, data = std::move(data)]() mutable {
+                return decode_and_install(name, file, data);
+            };
+            pending.emplace(file.filepath, worker_pool_t::shared().run_async(std::move(job)));
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    // The last decode finishes either way, it may still be writing the file.
+    if (pending) {
+        try {
+            auto decoded = co_await pending->decode;
+            record_decoded_file(decoded);
+            status("Repaired {}/{}", name, pending->path);
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+export task_t<void> verify_async(int argc, const char* argv[])
+{
+    auto options = parse_options(argc, argv);
+    if (options.help) {
+        print_help();
+        co_return;
+    }
+    if (options.names.empty()) {
+        options.names = installed_packages();
+    }
+
+    auto files = std::vector<checked_file_t> {};
+    for (const auto& name : options.names) {
+        auto installed = load_installed(name);
+        if (installed.empty()) {
+            throw std::runtime_error { std::format("Nothing of {} is recorded as installed", name) };
+        }
+        for (auto& file : installed) {
+            files.push_back({ .name = name, .file = std::move(file) });
+        }
+    }
+
+    // Modes and sizes come from one stat each, the content is hashed on the pool in batches.
+    auto& pool = worker_pool_t::shared();
+    auto batches = std::vector<std::vector<checked_file_t*>> { {} };
+    size_t batch_bytes {};
+    for (auto& checked : files) {
+        struct stat st {};
+        if (stat(installed_file_path(checked.name, checked.file.path).c_str(), &st) < 0) {
+            checked.missing = true;
+            continue;
+        }
+        checked.size = st.st_size;
+        if ((int)(st.st_mode & 0777) != checked.file.mode) {
+            checked.mode = st.st_mode & 0777;
+        }
+        if (batch_bytes + checked.size > BATCH_BYTES && !batches.back().empty()) {
+            batches.emplace_back();
+            batch_bytes = 0;
+        }
+        batches.back().push_back(&checked);
+        batch_bytes += checked.size;
+    }
+
+    // One job spreads the batches over the pool, however many files there are.
+    auto timer = stage_timer_t { "md5" };
+    auto hash = [&] {
+        pool.parallel_for(batches.size(), [&](size_t i) { hash_batch(batches[i]); });
+    };
+    co_await pool.run_async(std::move(hash));
+    for (const auto& checked : files) {
+        timer.add_bytes(checked.size);
+    }
+    timer.stop();
+
+    // Bad files are grouped by the package version they came from, for the repair.
+    auto drifted = std::map<std::pair<std::string, std::string>, std::vector<checked_file_t*>> {};
+    size_t drift {};
+    for (auto& checked : files) {
+        auto key = std::format("{}/{}:{}", checked.name, checked.file.path, checked.file.version);
+        if (checked.missing) {
+            status("MISSING {}", key);
+        } else if (checked.modified) {
+            status("MODIFIED {}", key);
+        } else if (checked.mode) {
+            status("MODE {}: {:04o}, expected {:04o}", key, *checked.mode, checked.file.mode);
+        } else {
+            continue;
+        }
+        ++drift;
+        if (checked.missing || checked.modified) {
+            drifted[{ checked.name, checked.file.version }].push_back(&checked);
+        }
+    }
+    status("{} files of {} packages checked, {} don't match", files.size(), options.names.size(), drift);
+    if (!drift) {
+        co_return;
+    }
+    if (!options.repair) {
+        throw std::runtime_error { std::format("{} files don't match, run app verify --repair to fix them", drift) };
+    }
+
+    for (auto& checked : files) {
+        if (checked.mode && !checked.missing && !checked.modified) {
+            std::filesystem::permissions(installed_file_path(checked.name, checked.file.path), (std::filesystem::perms)checked.file.mode);
+            status("Restored the mode of {}/{}", checked.name, checked.file.path);
+        }
+    }
+    for (const auto& [package, package_files] : drifted) {
+        co_await repair_async(package.first, package.second, package_files);
+    }
+    mirror_list_t::current().save();
+}
@@ -0,0 +1,101 @@
+module;
+
+#include <coroutine>
+#include <cstdio>
+#include <cstring>
+#include <format>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+export module which;
+import consts;
+import cppl;
+import installed;
+import log;
+import package;
+
+using cppl::task_t;
+
+struct Options {
+    bool help {};
+    std::vector<std::string_view> paths {};
+};
+
+static Options parse_options(int& argc, const char**& argv)
+{
+    auto options = Options {};
+    while (argc) {
+        if (**argv != '-') {
+            options.paths.push_back(*argv);
+        } else if (!strcmp(*argv + 1, "h") || !strcmp(*argv + 1, "-help")) {
+            options.help = true;
+        } else {
+            fatal_error("unknown option: {}", *argv);
+        }
+        --argc;
+        ++argv;
+    }
+    return options;
+}
+
+static void print_help()
+{
+    fprintf(stdout, R"(Show which installed package provides a file
+Usage: app which [OPTIONS] PATH...
+
+Options:
+    -h,--help                   Print this help message and exit
+
+Parameters:
+    PATH                        A command in ~/.staticlinux/bin, or a path under ~/.staticlinux
+
+For more information, please visit %s/commands/which
+)",
+        DOC_BASE_LINK);
+}
+
+// The key of `path` in the install database: a bare command name is a link in bin/, an absolute
+// path is made relative to ~/.staticlinux.
+static std::string path_key(std::string_view path)
+{
+    if (path.find('/') == std::string_view::npos) {
+        return std::format("bin/{}", path);
+    }
+    if (path.starts_with('/')) {
+        auto home = staticlinux_home().string() + "/";
+        if (path.starts_with(home)) {
+            path.remove_prefix(home.size());
+        }
+    }
+    return std::string { path };
+}
+
+export task_t<void> which_async(int argc, const char* argv[])
+{
+    auto options = parse_options(argc, argv);
+    if (options.help) {
+        print_help();
+        co_return;
+    }
+    if (options.paths.empty()) {
+        fatal_error("PATH parameter is required.");
+    }
+
+    auto db = install_db_t::open();
+    size_t missing {};
+    for (auto path : options.paths) {
+        auto hits = db.find_path(path_key(path));
+        if (hits.empty()) {
+            warning("{} isn't provided by any installed package", path);
+            ++missing;
+        }
+        for (const auto& hit : hits) {
+            fprintf(stdout, "%s: %s/%s:%s\n", std::string { path }.c_str(), hit.package.c_str(), hit.file.path.c_str(), hit.file.version.c_str());
+        }
+    }
+    if (missing) {
+        throw std::runtime_error { std::format("{} of {} paths not found", missing, options.paths.size()) };
+    }
+}
@@ -0,0 +1,252 @@
+module;
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <optional>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+export module daemon_link;
+import log;
+import package;
+
+// The wire format between `app daemon` and the commands it runs for clients. Both sides send
+// frames of one kind byte, a u32 little endian payload length and the payload. The client sends
+// one request frame, the command then NUL-separated KEY=VALUE fields; the daemon answers with
+// output frames and ends with done, or failed with the error message. A daemon that runs in
+// another environment than the client answers declined instead, the client then runs the command
+// itself.
+export enum class daemon_frame_t : uint8_t {
+    request = 'r',
+    out = 'o',
+    err = 'e',
+    done = 'd',
+    failed = 'f',
+    declined = 'n',
+};
+
+export constexpr size_t DAEMON_FRAME_HEADER_LEN = 5;
+
+// APP_DAEMON_SOCKET, ~/.staticlinux/daemon.sock by default.
+export std::filesystem::path daemon_socket_path()
+{
+    if (auto env = getenv("APP_DAEMON_SOCKET"); env && *env) {
+        return env;
+    }
+    return staticlinux_home() / "daemon.sock";
+}
+
+export sockaddr_un daemon_socket_address(const std::filesystem::path& path)
+{
+    auto address = sockaddr_un { .sun_family = AF_UNIX };
+    if (path.native().size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error { std::format("Socket path is too long: {}", path.string()) };
+    }
+    strcpy(address.sun_path, path.c_str());
+    return address;
+}
+
+// Appends a frame to `out`.
+export void encode_frame(std::string& out, daemon_frame_t kind, std::string_view payload)
+{
+    auto size = (uint32_t)payload.size();
+    out += (char)kind;
+    out.append((const char*)&size, sizeof(size));
+    out += payload;
+}
+
+// Writes a whole frame, waiting while the socket is full. For the client, which has nothing else
+// to do meanwhile; the daemon queues its frames, see frame_writer_t.
+export void write_frame(int fd, daemon_frame_t kind, std::string_view payload)
+{
+    auto frame = std::string {};
+    encode_frame(frame, kind, payload);
+
+    auto p = frame.data();
+    auto remain = frame.size();
+    while (remain) {
+        auto num = send(fd, p, remain, MSG_NOSIGNAL);
+        if (num < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                auto pfd = pollfd { .fd = fd, .events = POLLOUT };
+                poll(&pfd, 1, -1);
+                continue;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error { errno, std::system_category(), "daemon connection write failed" };
+        }
+        remain -= num;
+        p += num;
+    }
+}
+
+static bool read_exactly(int fd, void* data, size_t size)
+{
+    auto p = (uint8_t*)data;
+    while (size) {
+        auto num = read(fd, p, size);
+        if (num < 0 && errno == EINTR) {
+            continue;
+        } else if (num <= 0) {
+            return false;
+        }
+        size -= num;
+        p += num;
+    }
+    return true;
+}
+
+export std::string encode_request(std::string_view command, const std::vector<std::string>& fields)
+{
+    auto payload = std::string { command };
+    for (const auto& field : fields) {
+        payload += '\0';
+        payload += field;
+    }
+    return payload;
+}
+
+export std::pair<std::string, std::vector<std::string>> decode_request(std::string_view payload)
+{
+    auto parts = std::vector<std::string> {};
+    while (true) {
+        auto end = payload.find('\0');
+        parts.emplace_back(payload.substr(0, end));
+        if (end == std::string_view::npos) {
+            break;
+        }
+        payload.remove_prefix(end + 1);
+    }
+    auto command = std::move(parts.front());
+    parts.erase(parts.begin());
+    return { std::move(command), std::move(parts) };
+}
+
+// What a command depends on besides its own fields: the home directory, the mirrors set in the
+// environment and the log level. The client sends its own with the request; the daemon declines
+// a request whose home or mirrors differ from its own and runs the command at the client's log
+// level.
+export struct client_context_t {
+    std::string home {};
+    std::string mirrors {};
+    std::string log_level {};
+
+    static client_context_t current()
+    {
+        auto env = [](const char* name) {
+            auto value = getenv(name);
+            return std::string { value ? value : "" };
+        };
+        return { .home = env("HOME"), .mirrors = env("APP_MIRRORS"), .log_level = std::string { logger_t::instance().level_name() } };
+    }
+
+    // Same home and mirrors, the log level may differ.
+    bool same_environment(const client_context_t& other) const
+    {
+        return home == other.home && mirrors == other.mirrors;
+    }
+
+    std::vector<std::string> to_fields() const
+    {
+        return {
+            std::format("context.home={}", home),
+            std::format("context.mirrors={}", mirrors),
+            std::format("context.log_level={}", log_level),
+        };
+    }
+
+    // Takes the context fields out of `fields`, the command's own fields are left.
+    static client_context_t take_from_fields(std::vector<std::string>& fields)
+    {
+        auto context = client_context_t {};
+        std::erase_if(fields, [&](const std::string& field) {
+            auto eq = field.find('=');
+            auto key = std::string_view { field }.substr(0, eq);
+            auto value = eq == std::string::npos ? std::string {} : field.substr(eq + 1);
+            if (key == "context.home") {
+                context.home = std::move(value);
+            } else if (key == "context.mirrors") {
+                context.mirrors = std::move(value);
+            } else if (key == "context.log_level") {
+                context.log_level = std::move(value);
+            } else {
+                return false;
+            }
+            return true;
+        });
+        return context;
+    }
+};
+
+// Runs `command` in the daemon when one is listening, copying its output to stdout and stderr.
+// Returns false when there is no daemon or it declined, the caller runs the command itself then.
+// A failure of the command is thrown with the daemon's message. `context` goes with the request.
+export bool run_in_daemon(std::string_view command, std::vector<std::string> fields, const client_context_t& context)
+{
+    auto fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    auto address = daemon_socket_address(daemon_socket_path());
+    if (connect(fd, (const sockaddr*)&address, sizeof(address)) < 0) {
+        // No daemon, or a socket left behind by one that is gone.
+        close(fd);
+        return false;
+    }
+
+    try {
+        auto context_fields = context.to_fields();
+        fields.insert(fields.end(), context_fields.begin(), context_fields.end());
+        write_frame(fd, daemon_frame_t::request, encode_request(command, fields));
+        while (true) {
+            uint8_t header[DAEMON_FRAME_HEADER_LEN];
+            if (!read_exactly(fd, header, sizeof(header))) {
+                throw std::runtime_error { "the daemon closed the connection" };
+            }
+            uint32_t size {};
+            memcpy(&size, header + 1, sizeof(size));
+            auto payload = std::string(size, '\0');
+            if (!read_exactly(fd, payload.data(), size)) {
+                throw std::runtime_error { "the daemon closed the connection" };
+            }
+
+            switch ((daemon_frame_t)header[0]) {
+            case daemon_frame_t::out:
+                fwrite(payload.data(), 1, payload.size(), stdout);
+                fflush(stdout);
+                break;
+            case daemon_frame_t::err:
+                fwrite(payload.data(), 1, payload.size(), stderr);
+                break;
+            case daemon_frame_t::done:
+                close(fd);
+                return true;
+            case daemon_frame_t::declined:
+                // Nothing ran yet.
+                close(fd);
+                return false;
+            case daemon_frame_t::failed:
+                throw std::runtime_error { payload };
+            default:
+                throw std::runtime_error { std::format("unexpected frame from the daemon: {}", (int)header[0]) };
+            }
+        }
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+}
@@ -0,0 +1,622 @@
+module;
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <errno.h>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <netinet/in.h>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <system_error>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+export module dns;
+import cppl;
+import log;
+import message_queue;
+import string_utils;
+
+using cppl::task_state_t;
+using cppl::task_t;
+
+export struct socket_address_t {
+    sockaddr_storage storage {};
+    socklen_t length {};
+
+    int family() const
+    {
+        return storage.ss_family;
+    }
+
+    const sockaddr* data() const
+    {
+        return (const sockaddr*)&storage;
+    }
+
+    std::string to_string() const
+    {
+        char buf[INET6_ADDRSTRLEN] {};
+        if (family() == AF_INET6) {
+            inet_ntop(AF_INET6, &((const sockaddr_in6*)&storage)->sin6_addr, buf, sizeof(buf));
+            return std::format("[{}]:{}", buf, ntohs(((const sockaddr_in6*)&storage)->sin6_port));
+        }
+        inet_ntop(AF_INET, &((const sockaddr_in*)&storage)->sin_addr, buf, sizeof(buf));
+        return std::format("{}:{}", buf, ntohs(((const sockaddr_in*)&storage)->sin_port));
+    }
+};
+
+static socket_address_t make_address(const in_addr& addr, uint16_t port)
+{
+    socket_address_t address {};
+    auto sin = (sockaddr_in*)&address.storage;
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    sin->sin_addr = addr;
+    address.length = sizeof(sockaddr_in);
+    return address;
+}
+
+static socket_address_t make_address(const in6_addr& addr, uint16_t port)
+{
+    socket_address_t address {};
+    auto sin6 = (sockaddr_in6*)&address.storage;
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    sin6->sin6_addr = addr;
+    address.length = sizeof(sockaddr_in6);
+    return address;
+}
+
+// Parses a numeric IPv4/IPv6 address.
+static bool parse_numeric_address(const std::string& host, uint16_t port, socket_address_t& address)
+{
+    in_addr addr4 {};
+    if (inet_pton(AF_INET, host.c_str(), &addr4) == 1) {
+        address = make_address(addr4, port);
+        return true;
+    }
+
+    // Accept both "::1" and the bracketed uri form "[::1]".
+    auto unbracketed = host.size() > 2 && host.front() == '[' && host.back() == ']' ? host.substr(1, host.size() - 2) : host;
+    in6_addr addr6 {};
+    if (inet_pton(AF_INET6, unbracketed.c_str(), &addr6) == 1) {
+        address = make_address(addr6, port);
+        return true;
+    }
+    return false;
+}
+
+export struct resolv_conf_t {
+    std::vector<socket_address_t> nameservers {};
+    std::chrono::milliseconds timeout { 5000 };
+    int attempts { 2 };
+    // Domains tried for names with fewer than `ndots` dots, see candidate_names().
+    std::vector<std::string> search {};
+    int ndots { 1 };
+};
+
+// Parses resolv.conf(5) text. "search" and "domain" replace each other, the last one wins.
+export resolv_conf_t parse_resolv_conf(std::string_view text)
+{
+    resolv_conf_t conf {};
+    std::istringstream file { std::string { text } };
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream words { line };
+        std::string keyword;
+        if (!(words >> keyword) || keyword[0] == '#' || keyword[0] == ';') {
+            continue;
+        }
+
+        if (keyword == "nameserver") {
+            std::string host;
+            socket_address_t address {};
+            if (words >> host && parse_numeric_address(host, 53, address)) {
+                conf.nameservers.push_back(address);
+            }
+        } else if (keyword == "search" || keyword == "domain") {
+            conf.search.clear();
+            std::string domain;
+            while (words >> domain) {
+                if (domain.ends_with('.')) {
+                    domain.pop_back();
+                }
+                if (!domain.empty()) {
+                    conf.search.push_back(tolower(domain));
+                }
+            }
+        } else if (keyword == "options") {
+            std::string option;
+            while (words >> option) {
+                if (option.starts_with("timeout:")) {
+                    conf.timeout = std::chrono::seconds { std::clamp(atoi(option.c_str() + 8), 1, 30) };
+                } else if (option.starts_with("attempts:")) {
+                    conf.attempts = std::clamp(atoi(option.c_str() + 9), 1, 5);
+                } else if (option.starts_with("ndots:")) {
+                    conf.ndots = std::clamp(atoi(option.c_str() + 6), 0, 15);
+                }
+            }
+        }
+    }
+
+    // Same default as glibc when no nameserver is configured.
+    if (conf.nameservers.empty()) {
+        in_addr loopback { htonl(INADDR_LOOPBACK) };
+        conf.nameservers.push_back(make_address(loopback, 53));
+    }
+    return conf;
+}
+
+static resolv_conf_t load_resolv_conf()
+{
+    std::ifstream file { "/etc/resolv.conf" };
+    std::stringstream text;
+    text << file.rdbuf();
+    return parse_resolv_conf(text.str());
+}
+
+// The names looked up for `host`, in order, as resolv.conf(5) says: a name with at least `ndots`
+// dots is tried as given before the search domains, a shorter one after them. A trailing dot
+// makes the name absolute.
+export std::vector<std::string> candidate_names(const std::string& host, const resolv_conf_t& conf)
+{
+    if (host.ends_with('.')) {
+        return { host.substr(0, host.size() - 1) };
+    }
+    auto names = std::vector<std::string> {};
+    auto dots = (int)std::count(host.begin(), host.end(), '.');
+    if (dots >= conf.ndots) {
+        names.push_back(host);
+    }
+    for (const auto& domain : conf.search) {
+        names.push_back(std::format("{}.{}", host, domain));
+    }
+    if (dots < conf.ndots) {
+        names.push_back(host);
+    }
+    return names;
+}
+
+static std::unordered_multimap<std::string, socket_address_t> load_hosts()
+{
+    std::unordered_multimap<std::string, socket_address_t> hosts;
+    std::ifstream file { "/etc/hosts" };
+    std::string line;
+    while (std::getline(file, line)) {
+        if (auto comment = line.find('#'); comment != std::string::npos) {
+            line.resize(comment);
+        }
+
+        std::istringstream words { line };
+        std::string ip;
+        socket_address_t address {};
+        if (!(words >> ip) || !parse_numeric_address(ip, /*port=*/0, address)) {
+            continue;
+        }
+
+        std::string name;
+        while (words >> name) {
+            hosts.emplace(tolower(name), address);
+        }
+    }
+    return hosts;
+}
+
+static std::vector<uint8_t> build_query(uint16_t id, const std::string& host, uint16_t qtype)
+{
+    std::vector<uint8_t> query {
+        (uint8_t)(id >> 8), (uint8_t)id,
+        0x01, 0x00, // flags: recursion desired.
+        0x00, 0x01, // qdcount
+        0x00, 0x00, // ancount
+        0x00, 0x00, // nscount
+        0x00, 0x00, // arcount
+    };
+
+    size_t start = 0;
+    while (start < host.size()) {
+        auto end = host.find('.', start);
+        if (end == std::string::npos) {
+            end = host.size();
+        }
+        auto len = end - start;
+        if (len == 0 || len > 63) {
+            throw std::runtime_error { std::format("invalid host name: {}", host) };
+        }
+        query.push_back((uint8_t)len);
+        query.insert(query.end(), host.begin() + start, host.begin() + end);
+        start = end + 1;
+    }
+    query.push_back(0);
+
+    query.push_back((uint8_t)(qtype >> 8));
+    query.push_back((uint8_t)qtype);
+    query.push_back(0x00);
+    query.push_back(0x01); // class IN
+    return query;
+}
+
+// Reads a possibly compressed domain name, lowercase and dot separated, and returns the offset
+// after it. Compression pointers must point backwards and a name may follow only a few, so a
+// malformed or hostile message can't loop or read out of bounds.
+static size_t read_name(const uint8_t* data, size_t size, size_t offset, std::string& name)
+{
+    constexpr int MAX_POINTERS = 16;
+    constexpr size_t MAX_NAME_LEN = 255;
+
+    name.clear();
+    auto end = size_t {};
+    auto pointers = 0;
+    for (auto pos = offset;;) {
+        if (pos >= size) {
+            throw std::runtime_error { "truncated dns response" };
+        }
+        auto len = data[pos];
+        if (len == 0) {
+            return pointers ? end : pos + 1;
+        } else if ((len & 0xc0) == 0xc0) {
+            if (pos + 1 >= size) {
+                throw std::runtime_error { "truncated dns response" };
+            }
+            auto target = (size_t)((len & 0x3f) << 8 | data[pos + 1]);
+            if (target >= pos || ++pointers > MAX_POINTERS) {
+                throw std::runtime_error { "invalid dns name pointer" };
+            }
+            if (pointers == 1) {
+                end = pos + 2;
+            }
+            pos = target;
+            continue;
+        } else if (len & 0xc0) {
+            throw std::runtime_error { "invalid dns label" };
+        }
+
+        if (pos + 1 + len > size) {
+            throw std::runtime_error { "truncated dns response" };
+        }
+        if (!name.empty()) {
+            name += '.';
+        }
+        name += tolower(std::string_view { (const char*)data + pos + 1, len });
+        if (name.size() > MAX_NAME_LEN) {
+            throw std::runtime_error { "dns name is too long" };
+        }
+        pos += 1 + len;
+    }
+}
+
+static uint16_t read_u16(const uint8_t* p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t read_u32(const uint8_t* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+struct dns_answer_t {
+    uint16_t id {};
+    int rcode {};
+    // The question the response answers.
+    std::string name {};
+    uint16_t qtype {};
+    std::vector<socket_address_t> addresses {};
+    uint32_t ttl { UINT32_MAX };
+};
+
+static dns_answer_t parse_response(const uint8_t* data, size_t size)
+{
+    const size_t HEADER_LEN = 12;
+    if (size < HEADER_LEN || !(data[2] & 0x80)) {
+        throw std::runtime_error { "invalid dns response" };
+    }
+
+    dns_answer_t answer {
+        .id = read_u16(data),
+        .rcode = data[3] & 0x0f,
+    };
+    auto qdcount = read_u16(data + 4);
+    auto ancount = read_u16(data + 6);
+    if (qdcount != 1) {
+        throw std::runtime_error { "invalid dns response" };
+    }
+
+    size_t offset = read_name(data, size, HEADER_LEN, answer.name);
+    if (offset + 4 > size) {
+        throw std::runtime_error { "truncated dns response" };
+    }
+    answer.qtype = read_u16(data + offset);
+    offset += 4;
+
+    std::string owner;
+    for (int i = 0; i < ancount; ++i) {
+        offset = read_name(data, size, offset, owner);
+        if (offset + 10 > size) {
+            throw std::runtime_error { "truncated dns response" };
+        }
+        auto type = read_u16(data + offset);
+        auto ttl = read_u32(data + offset + 4);
+        auto rdlength = read_u16(data + offset + 8);
+        offset += 10;
+        if (offset + rdlength > size) {
+            throw std::runtime_error { "truncated dns response" };
+        }
+
+        // CNAME records are followed by the records of their target, so only addresses matter.
+        if (type == 1 && rdlength == 4) {
+            in_addr addr {};
+            memcpy(&addr, data + offset, 4);
+            answer.addresses.push_back(make_address(addr, /*port=*/0));
+            answer.ttl = std::min(answer.ttl, ttl);
+        } else if (type == 28 && rdlength == 16) {
+            in6_addr addr {};
+            memcpy(&addr, data + offset, 16);
+            answer.addresses.push_back(make_address(addr, /*port=*/0));
+            answer.ttl = std::min(answer.ttl, ttl);
+        }
+        offset += rdlength;
+    }
+    return answer;
+}
+
+static void set_port(socket_address_t& address, uint16_t port)
+{
+    if (address.family() == AF_INET6) {
+        ((sockaddr_in6*)&address.storage)->sin6_port = htons(port);
+    } else {
+        ((sockaddr_in*)&address.storage)->sin_port = htons(port);
+    }
+}
+
+// Resolves host names without blocking the message queue: /etc/hosts first, then A and AAAA
+// queries over UDP to the resolv.conf nameservers. Answers are cached in-process by their TTL
+// and concurrent lookups of the same name share one query.
+export class dns_resolver_t {
+public:
+    static dns_resolver_t& current()
+    {
+        static thread_local dns_resolver_t s_current {};
+        return s_current;
+    }
+
+    // Returns the addresses of `host` with `port` filled in. Numeric addresses are returned as is.
+    task_t<std::vector<socket_address_t>> resolve_async(std::string host, uint16_t port)
+    {
+        socket_address_t numeric {};
+        if (parse_numeric_address(host, port, numeric)) {
+            co_return std::vector<socket_address_t> { numeric };
+        }
+
+        host = tolower(host);
+        auto addresses = co_await lookup_async(host);
+        for (auto& address : addresses) {
+            set_port(address, port);
+        }
+        co_return addresses;
+    }
+
+    // Replaces /etc/resolv.conf and /etc/hosts, and forgets the cached answers.
+    void configure(resolv_conf_t conf, std::unordered_multimap<std::string, socket_address_t> hosts = {})
+    {
+        m_conf = std::move(conf);
+        m_hosts = std::move(hosts);
+        m_cache.clear();
+        m_loaded = true;
+    }
+
+private:
+    using clock_t = std::chrono::steady_clock;
+
+    struct cache_entry_t {
+        std::vector<socket_address_t> addresses {};
+        clock_t::time_point expires {};
+    };
+
+    task_t<std::vector<socket_address_t>> lookup_async(std::string host)
+    {
+        if (!m_loaded) {
+            m_hosts = load_hosts();
+            m_conf = load_resolv_conf();
+            m_loaded = true;
+        }
+
+        if (auto [begin, end] = m_hosts.equal_range(host); begin != end) {
+            std::vector<socket_address_t> addresses;
+            for (auto it = begin; it != end; ++it) {
+                addresses.push_back(it->second);
+            }
+            co_return addresses;
+        }
+
+        if (auto it = m_cache.find(host); it != m_cache.end()) {
+            if (clock_t::now() < it->second.expires) {
+                co_return it->second.addresses;
+            }
+            m_cache.erase(it);
+        }
+
+        // Join a query that is already in flight.
+        if (auto it = m_pending.find(host); it != m_pending.end()) {
+            auto task_state = std::make_shared<task_state_t<std::vector<socket_address_t>>>();
+            it->second.push_back(task_state);
+            co_return co_await task_t<std::vector<socket_address_t>> { task_state };
+        }
+
+        m_pending[host];
+        std::vector<socket_address_t> addresses;
+        std::exception_ptr error {};
+        try {
+            addresses = co_await query_async(host);
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        auto waiters = std::move(m_pending[host]);
+        m_pending.erase(host);
+        for (auto& waiter : waiters) {
+            if (error) {
+                waiter->set_exception(error);
+            } else {
+                waiter->set_value(addresses);
+            }
+        }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        co_return addresses;
+    }
+
+    task_t<std::vector<socket_address_t>> query_async(std::string host)
+    {
+        std::string last_error { "no nameserver" };
+        auto all_not_found = true;
+        for (const auto& name : candidate_names(host, m_conf)) {
+            // A name that doesn't exist moves on to the next candidate, anything else to the
+            // next nameserver.
+            auto not_found = false;
+            for (int attempt = 0; attempt < m_conf.attempts && !not_found; ++attempt) {
+                for (const auto& nameserver : m_conf.nameservers) {
+                    auto sd = socket(nameserver.family(), SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+                    if (sd < 0) {
+                        throw std::system_error { errno, std::system_category(), "create socket failed" };
+                    }
+
+                    std::optional<dns_answer_t> answer {};
+                    try {
+                        answer = co_await exchange_async(sd, nameserver, name);
+                    } catch (const std::exception& ex) {
+                        last_error = ex.what();
+                    }
+                    close(sd);
+
+                    if (!answer) {
+                        all_not_found = false;
+                        continue;
+                    }
+                    if (answer->rcode == 3) {
+                        not_found = true;
+                        break;
+                    }
+                    all_not_found = false;
+                    if (answer->rcode != 0 || answer->addresses.empty()) {
+                        last_error = std::format("no address for {} (rcode {})", name, answer->rcode);
+                        continue;
+                    }
+
+                    m_cache[host] = cache_entry_t {
+                        .addresses = answer->addresses,
+                        .expires = clock_t::now() + std::chrono::seconds { answer->ttl },
+                    };
+                    co_return std::move(answer->addresses);
+                }
+            }
+        }
+        if (all_not_found) {
+            throw std::runtime_error { std::format("host not found: {}", host) };
+        }
+        throw std::runtime_error { std::format("resolve {} failed: {}", host, last_error) };
+    }
+
+    // Sends the A and AAAA queries to one nameserver and merges both answers. Returns nothing if
+    // the nameserver does not answer in time.
+    task_t<std::optional<dns_answer_t>> exchange_async(int sd, const socket_address_t& nameserver, const std::string& host)
+    {
+        if (connect(sd, nameserver.data(), nameserver.length) < 0) {
+            throw std::system_error { errno, std::system_category(), "connect to nameserver failed" };
+        }
+
+        const uint16_t QTYPES[] = { 1, 28 };
+        uint16_t ids[2] {};
+        for (int i = 0; i < 2; ++i) {
+            ids[i] = (uint16_t)m_random();
+            auto query = build_query(ids[i], host, QTYPES[i]);
+            if (send(sd, query.data(), query.size(), MSG_NOSIGNAL) < 0) {
+                throw std::system_error { errno, std::system_category(), "send dns query failed" };
+            }
+        }
+
+        dns_answer_t merged {};
+        bool answered[2] {};
+        auto deadline = clock_t::now() + m_conf.timeout;
+        while (!answered[0] || !answered[1]) {
+            auto remain = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock_t::now());
+            auto timed_out = remain.count() <= 0;
+            if (!timed_out) {
+                try {
+                    co_await with_deadline(message_queue_t::current().await(sd, EPOLLIN), remain, sd);
+                } catch (const timeout_error&) {
+                    timed_out = true;
+                }
+            }
+            if (timed_out) {
+                // Take whatever family did answer.
+                if (answered[0] || answered[1]) {
+                    break;
+                }
+                co_return std::nullopt;
+            }
+
+            uint8_t buffer[1500];
+            while (true) {
+                auto num = recv(sd, buffer, sizeof(buffer), /*flags=*/0);
+                if (num < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        break;
+                    } else if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::system_error { errno, std::system_category(), "recv dns response failed" };
+                }
+
+                // A malformed or unrelated datagram is dropped, the real answer may still come.
+                auto answer = dns_answer_t {};
+                try {
+                    answer = parse_response(buffer, num);
+                } catch (const std::exception& ex) {
+                    debug("dns: dropped a response for {}: {}", host, ex.what());
+                    continue;
+                }
+                for (int i = 0; i < 2; ++i) {
+                    if (answered[i] || answer.id != ids[i] || answer.qtype != QTYPES[i] || answer.name != host) {
+                        continue;
+                    }
+                    answered[i] = true;
+                    if (answer.rcode != 0) {
+                        merged.rcode = answer.rcode;
+                    }
+                    // AAAA answers go first, the connect logic interleaves the families anyway.
+                    merged.addresses.insert(QTYPES[i] == 28 ? merged.addresses.begin() : merged.addresses.end(),
+                        answer.addresses.begin(), answer.addresses.end());
+                    merged.ttl = std::min(merged.ttl, answer.ttl);
+                }
+            }
+        }
+
+        // A name may exist with only one family, that's not an error.
+        if (!merged.addresses.empty()) {
+            merged.rcode = 0;
+        }
+        co_return merged;
+    }
+
+    bool m_loaded {};
+    resolv_conf_t m_conf {};
+    std::unordered_multimap<std::string, socket_address_t> m_hosts {};
+    std::unordered_map<std::string, cache_entry_t> m_cache {};
+    std::unordered_map<std::string, std::vector<std::shared_ptr<task_state_t<std::vector<socket_address_t>>>>> m_pending {};
+    std::mt19937 m_random { std::random_device {}() };
+};
@@ -0,0 +1,138 @@
+module;
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <string>
+#include <string_view>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+
+export module file_lock;
+import cppl;
+import log;
+import message_queue;
+import package;
+
+using cppl::task_t;
+using namespace std::chrono_literals;
+
+// The lock keys, prefixed by what they guard so that a package name never names another lock.
+export std::string package_lock_key(std::string_view name)
+{
+    return std::format("pkg-{}", name);
+}
+
+export constexpr std::string_view INSTALLED_DB_LOCK_KEY = "db-installed";
+
+// An exclusive lock shared by every app process of a user: an flock on
+// ~/.staticlinux/locks/KEY.lock. The kernel drops it when its holder exits or crashes, so no
+// lock outlives its process, and the holder removes the file when it is done.
+export class file_lock_t {
+public:
+    // Waits for the lock, blocking the thread.
+    static file_lock_t lock(std::string_view key)
+    {
+        auto path = lock_path(key);
+        return file_lock_t { path, try_lock(path, /*wait=*/true) };
+    }
+
+    // Waits for the lock while the message loop goes on with other work.
+    static task_t<file_lock_t> lock_async(std::string key)
+    {
+        auto path = lock_path(key);
+        auto delay = std::chrono::milliseconds { 5ms };
+        for (auto waited = false;; waited = true) {
+            if (auto fd = try_lock(path, /*wait=*/false); fd >= 0) {
+                co_return file_lock_t { path, fd };
+            }
+            if (!waited) {
+                status("Waiting for another app process on {}", key);
+            }
+            co_await sleep_for(delay);
+            delay = std::min<std::chrono::milliseconds>(delay * 2, 200ms);
+        }
+    }
+
+    file_lock_t(const file_lock_t&) = delete;
+
+    file_lock_t(file_lock_t&& r)
+        : m_path { std::move(r.m_path) }
+        , m_fd { std::exchange(r.m_fd, -1) }
+    {
+    }
+
+    ~file_lock_t()
+    {
+        unlock();
+    }
+
+    file_lock_t& operator=(const file_lock_t&) = delete;
+
+    void unlock()
+    {
+        if (m_fd < 0) {
+            return;
+        }
+        // Removed while still held: a process waiting on this file finds it gone and starts over.
+        unlink(m_path.c_str());
+        close(m_fd);
+        m_fd = -1;
+    }
+
+private:
+    file_lock_t(std::filesystem::path path, int fd)
+        : m_path { std::move(path) }
+        , m_fd { fd }
+    {
+    }
+
+    static std::filesystem::path lock_path(std::string_view key)
+    {
+        auto dir = staticlinux_home() / "locks";
+        std::filesystem::create_directories(dir);
+        auto name = std::string { key };
+        std::replace(name.begin(), name.end(), '/', '%');
+        return dir / (name + ".lock");
+    }
+
+    // Returns the locked descriptor, -1 when another process holds the lock and `wait` is off.
+    static int try_lock(const std::filesystem::path& path, bool wait)
+    {
+        while (true) {
+            auto fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                throw std::system_error { errno, std::system_category(), std::format("Can't open {}", path.string()) };
+            }
+            if (flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB)) < 0) {
+                auto error = errno;
+                close(fd);
+                if (error == EWOULDBLOCK && !wait) {
+                    return -1;
+                } else if (error == EINTR) {
+                    continue;
+                }
+                throw std::system_error { error, std::system_category(), std::format("Can't lock {}", path.string()) };
+            }
+
+            // The previous holder may have removed the file after it was opened here, then the
+            // lock is on a file nobody else will see.
+            struct stat locked {};
+            struct stat current {};
+            if (fstat(fd, &locked) == 0 && stat(path.c_str(), &current) == 0 && locked.st_dev == current.st_dev && locked.st_ino == current.st_ino) {
+                return fd;
+            }
+            close(fd);
+        }
+    }
+
+    std::filesystem::path m_path {};
+    int m_fd { -1 };
+};
@@ -1,29 +1,89 @@
 module;
 
 #include <algorithm>
+#include <charconv>
+#include <chrono>
 #include <coroutine>
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <format>
 #include <future>
-#include <netdb.h>
+#include <iterator>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <optional>
+#include <span>
 #include <string_view>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <system_error>
+#include <tuple>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 export module http_client;
 import cppl;
+import dns;
 import message_queue;
 import read_stream;
+import stats;
 import string_utils;
 
 using cppl::task_state_t;
 using cppl::task_t;
+using namespace std::chrono_literals;
+
+// Bounds how long a transfer may stall at each stage.
+export struct http_timeouts_t {
+    // Per connection attempt.
+    std::chrono::milliseconds connect { 10s };
+    // From sending the request to receiving the complete response header.
+    std::chrono::milliseconds header { 30s };
+    // Longest time without any progress while reading or writing.
+    std::chrono::milliseconds body_idle { 30s };
+};
+
+export http_timeouts_t& http_timeouts()
+{
+    static http_timeouts_t s_timeouts {};
+    return s_timeouts;
+}
 
-struct uri_view_t {
+// Options applied to every outgoing TCP connection.
+export struct socket_profile_t {
+    // Send small writes (the request) immediately instead of waiting for Nagle's algorithm.
+    bool no_delay { true };
+    // SO_RCVBUF in bytes; 0 keeps the kernel's autotuning. Raising it only helps links whose
+    // bandwidth-delay product exceeds the autotuning limit (net.ipv4.tcp_rmem).
+    int receive_buffer { 0 };
+    // Acknowledge the response immediately instead of delaying the ACK.
+    bool quick_ack { true };
+    // Carry the request in the SYN when the server supports TCP Fast Open. Only for hosts with a
+    // single address, see tcp_connect_async().
+    bool fast_open { false };
+};
+
+// Defaults may be overridden with APP_TCP_RCVBUF=<bytes> and APP_TCP_FASTOPEN=1.
+export socket_profile_t& socket_profile()
+{
+    static socket_profile_t s_profile = [] {
+        socket_profile_t profile {};
+        if (auto env = getenv("APP_TCP_RCVBUF"); env && *env) {
+            profile.receive_buffer = atoi(env);
+        }
+        if (auto env = getenv("APP_TCP_FASTOPEN"); env && *env) {
+            profile.fast_open = strcmp(env, "0") != 0;
+        }
+        return profile;
+    }();
+    return s_profile;
+}
+
+export struct uri_view_t {
     std::string schema;
     std::string host;
     uint16_t port;
@@ -38,7 +98,7 @@ uint16_t get_schema_default_port(std::string_view schema)
     throw new std::runtime_error { std::format("unknown default port for schema: {}", schema) };
 }
 
-uri_view_t parse_uri(std::string_view str)
+export uri_view_t parse_uri(std::string_view str)
 {
     uri_view_t uri {};
 
@@ -60,7 +120,8 @@ uri_view_t parse_uri(std::string_view str)
         uri.path = str.substr(pathStart);
     }
 
-    auto portStart = hostAndPort.find(':');
+    // Skip the colons of a bracketed IPv6 literal.
+    auto portStart = hostAndPort.find(':', hostAndPort.starts_with('[') ? hostAndPort.find(']') : 0);
     if (portStart == std::string::npos) {
         uri.host = hostAndPort;
         uri.port = get_schema_default_port(uri.schema);
@@ -75,19 +136,51 @@ uri_view_t parse_uri(std::string_view str)
     return uri;
 }
 
-task_t<void> write_async(int fd, std::string_view data)
+// Formats a GET request into `out`, replacing its contents but keeping its capacity, so the
+// whole request goes out in a single send.
+void format_get_request(std::string& out, const uri_view_t& uri, const std::unordered_multimap<std::string, std::string>& headers, bool keep_alive)
+{
+    out.clear();
+    auto it = std::back_inserter(out);
+    std::format_to(it,
+        "GET {} HTTP/1.1\r\n"
+        "Host: {}\r\n"
+        "User-Agent: staticlinux.org/app\r\n"
+        "Accept: */*\r\n",
+        uri.path, uri.host);
+    if (keep_alive) {
+        out += "Connection: keep-alive\r\n";
+    }
+    for (const auto& header : headers) {
+        std::format_to(it, "{}: {}\r\n", header.first, header.second);
+    }
+    out += "\r\n";
+}
+
+void set_quick_ack(int sd)
+{
+    // The kernel leaves quick ACK mode on its own, so this is re-armed before each response.
+    if (socket_profile().quick_ack) {
+        int yes = 1;
+        setsockopt(sd, IPPROTO_TCP, TCP_QUICKACK, &yes, sizeof(yes));
+    }
+}
+
+export task_t<void> write_async(int fd, std::string_view data)
 {
     auto reamin = data.size();
     auto p = data.data();
     while (reamin) {
-        auto num = write(fd, p, reamin);
+        // MSG_NOSIGNAL: a peer that has already closed must surface as EPIPE, not SIGPIPE.
+        auto num = send(fd, p, reamin, MSG_NOSIGNAL);
         if (num == 0) {
             // socket has been closed.
             throw std::runtime_error { "connection has been closed by remote" };
         } else if (num < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // can't write more data, wait.
-                co_await message_queue_t::current().await(fd, EPOLLOUT);
+                co_await with_deadline(message_queue_t::current().await(fd, EPOLLOUT), http_timeouts().body_idle, fd);
+                continue;
             } else if (errno == EINTR) {
                 // interrupted by signal, retry.
                 continue;
@@ -96,6 +189,7 @@ task_t<void> write_async(int fd, std::string_view data)
             }
         }
         reamin -= num;
+        p += num;
     }
 }
 
@@ -136,13 +230,303 @@ task_t<std::unordered_multimap<std::string, std::string>> http_read_headers_asyn
     co_return header;
 }
 
-read_stream_t http_open(const std::string& host, uint16_t port)
+task_t<std::pair<int, std::unordered_multimap<std::string, std::string>>> http_read_status_and_headers_async(read_stream_t& stream)
+{
+    auto status = co_await http_read_status_line_async(stream);
+    auto headers = co_await http_read_headers_async(stream);
+    co_return std::make_pair(status, std::move(headers));
+}
+
+// Reads the status line and the headers, bounded by the header timeout.
+export task_t<std::pair<int, std::unordered_multimap<std::string, std::string>>> http_read_response_head_async(read_stream_t& stream)
+{
+    try {
+        co_return co_await with_deadline(http_read_status_and_headers_async(stream), http_timeouts().header, stream.native_handle());
+    } catch (const timeout_error&) {
+        throw timeout_error { "timed out waiting for the response header" };
+    }
+}
+
+export uint64_t http_content_length(const std::unordered_multimap<std::string, std::string>& headers)
+{
+    auto it = headers.find("content-length");
+    if (it == headers.end()) {
+        throw std::runtime_error { std::format("no content-length header") };
+    }
+    auto content_length = parse_u64(trim(it->second));
+    if (!content_length) {
+        throw std::runtime_error { std::format("invalid content-length: {}", it->second) };
+    }
+    return *content_length;
+}
+
+// Reads a chunked body (RFC 9112 §7.1), trailer fields are dropped.
+static task_t<std::vector<uint8_t>> http_read_chunked_body_async(read_stream_t& stream)
+{
+    auto body = std::vector<uint8_t> {};
+    while (true) {
+        auto line = co_await stream.read_line_async();
+        auto size_str = trim(std::string_view { line }.substr(0, line.find(';')));
+        uint64_t size {};
+        auto [end, error] = std::from_chars(size_str.data(), size_str.data() + size_str.size(), size, 16);
+        if (size_str.empty() || error != std::errc {} || end != size_str.data() + size_str.size()) {
+            throw std::runtime_error { std::format("invalid chunk size: {}", line) };
+        }
+        if (!size) {
+            break;
+        }
+        auto chunk = co_await stream.read_async(size);
+        body.insert(body.end(), chunk.begin(), chunk.end());
+        auto chunk_end = co_await stream.read_line_async();
+        if (!chunk_end.empty()) {
+            throw std::runtime_error { "invalid chunk" };
+        }
+    }
+    while (true) {
+        auto trailer = co_await stream.read_line_async();
+        if (trailer.empty()) {
+            co_return body;
+        }
+    }
+}
+
+// Reads the body of a response to a GET as RFC 9112 §6.3 delimits it: none for 1xx, 204 and 304,
+// chunked, by Content-Length, or else up to the close of the connection. `reusable` is cleared
+// when the connection can't carry another response after this one.
+export task_t<std::vector<uint8_t>> http_read_body_async(read_stream_t& stream, int status, const std::unordered_multimap<std::string, std::string>& headers, bool& reusable)
+{
+    auto connection = headers.find("connection");
+    reusable = connection == headers.end() || tolower(connection->second) != "close";
+    if ((status >= 100 && status < 200) || status == 204 || status == 304) {
+        co_return std::vector<uint8_t> {};
+    }
+    if (auto coding = headers.find("transfer-encoding"); coding != headers.end()) {
+        if (tolower(coding->second).ends_with("chunked")) {
+            co_return co_await http_read_chunked_body_async(stream);
+        }
+        reusable = false;
+        co_return co_await stream.read_to_end_async();
+    }
+    if (headers.contains("content-length")) {
+        co_return co_await stream.read_async(http_content_length(headers));
+    }
+    reusable = false;
+    co_return co_await stream.read_to_end_async();
+}
+
+// A "range" header for the [first, end) byte ranges, several ranges ask for a multipart response.
+export std::unordered_multimap<std::string, std::string> http_range_header(const std::vector<std::pair<uint64_t, uint64_t>>& ranges)
+{
+    auto value = std::string { "bytes=" };
+    for (const auto& [first, end] : ranges) {
+        std::format_to(std::back_inserter(value), "{}{}-{}", value.size() > 6 ? "," : "", first, end - 1);
+    }
+    return { { "range", std::move(value) } };
+}
+
+// For servers: [first, end) of a "bytes=a-b", "bytes=a-" or "bytes=-n" range header on a
+// resource of `size` bytes, nothing when it is malformed or not satisfiable.
+export std::optional<std::pair<uint64_t, uint64_t>> parse_range_header(std::string_view range, uint64_t size)
+{
+    if (!range.starts_with("bytes=")) {
+        return std::nullopt;
+    }
+    range.remove_prefix(6);
+    auto dash = range.find('-');
+    if (dash == std::string_view::npos) {
+        return std::nullopt;
+    }
+
+    auto first_str = range.substr(0, dash);
+    auto last_str = range.substr(dash + 1);
+    auto last = parse_u64(last_str);
+    uint64_t first {};
+    uint64_t end = size;
+    if (first_str.empty()) {
+        if (!last) {
+            return std::nullopt;
+        }
+        first = size - std::min<uint64_t>(*last, size);
+    } else {
+        auto parsed = parse_u64(first_str);
+        if (!parsed || (!last_str.empty() && !last)) {
+            return std::nullopt;
+        }
+        first = *parsed;
+        if (last) {
+            end = *last < size ? *last + 1 : size;
+        }
+    }
+    if (first >= end) {
+        return std::nullopt;
+    }
+    return std::make_pair(first, end);
+}
+
+// Bytes of a resource starting at `first`.
+export struct http_byte_range_t {
+    uint64_t first {};
+    std::span<const uint8_t> data {};
+};
+
+// Returns the first and the last byte of a "bytes FIRST-LAST/SIZE" content range.
+static std::pair<uint64_t, uint64_t> parse_content_range(std::string_view value)
+{
+    auto dash = value.find('-');
+    auto slash = value.find('/', dash);
+    auto first = value.starts_with("bytes ") && dash != std::string_view::npos ? parse_u64(value.substr(6, dash - 6)) : std::nullopt;
+    auto last = first ? parse_u64(value.substr(dash + 1, slash - dash - 1)) : std::nullopt;
+    if (!first || !last || *last < *first) {
+        throw std::runtime_error { std::format("invalid content-range: {}", value) };
+    }
+    return { *first, *last };
+}
+
+// "--BOUNDARY" of a multipart/byteranges response, empty for any other body.
+static std::string multipart_delimiter(const std::unordered_multimap<std::string, std::string>& headers)
+{
+    auto type = headers.find("content-type");
+    auto boundary_at = type == headers.end() ? std::string::npos : type->second.find("boundary=");
+    if (type == headers.end() || !tolower(type->second).starts_with("multipart/byteranges") || boundary_at == std::string::npos) {
+        return {};
+    }
+
+    auto boundary = std::string_view { type->second }.substr(boundary_at + 9);
+    boundary = boundary.substr(0, boundary.find(';'));
+    if (boundary.size() >= 2 && boundary.front() == '"' && boundary.back() == '"') {
+        boundary = boundary.substr(1, boundary.size() - 2);
+    }
+    return std::format("--{}", boundary);
+}
+
+// Splits the body of a response to a range request into the ranges it holds. Servers may answer
+// a multi-range request with a multipart/byteranges body, with a single range covering several
+// of them, or with the whole resource, which is one range at 0.
+export std::vector<http_byte_range_t> http_byte_ranges(const std::unordered_multimap<std::string, std::string>& headers, std::span<const uint8_t> body)
+{
+    auto delimiter = multipart_delimiter(headers);
+    if (delimiter.empty()) {
+        auto range = headers.find("content-range");
+        return { { range == headers.end() ? 0 : parse_content_range(range->second).first, body } };
+    }
+
+    // --BOUNDARY CRLF headers CRLF CRLF data CRLF ... --BOUNDARY--
+    auto ranges = std::vector<http_byte_range_t> {};
+    auto text = std::string_view { (const char*)body.data(), body.size() };
+    auto pos = text.find(delimiter);
+    while (pos != std::string_view::npos) {
+        pos += delimiter.size();
+        if (text.substr(pos, 2) == "--") {
+            return ranges;
+        }
+        auto headers_end = text.find("\r\n\r\n", pos);
+        if (headers_end == std::string_view::npos) {
+            break;
+        }
+
+        auto first = std::optional<uint64_t> {};
+        auto last = uint64_t {};
+        for (auto line_start = text.find("\r\n", pos) + 2; line_start < headers_end;) {
+            auto line_end = text.find("\r\n", line_start);
+            auto line = text.substr(line_start, line_end - line_start);
+            if (auto colon = line.find(':'); colon != std::string_view::npos && tolower(trim(line.substr(0, colon))) == "content-range") {
+                std::tie(first, last) = parse_content_range(trim(line.substr(colon + 1)));
+            }
+            line_start = line_end + 2;
+        }
+        if (!first || last < *first) {
+            throw std::runtime_error { "multipart range without content-range" };
+        }
+
+        auto data_start = headers_end + 4;
+        auto size = last - *first + 1;
+        if (data_start + size > body.size()) {
+            break;
+        }
+        ranges.push_back({ *first, body.subspan(data_start, size) });
+        pos = text.find(delimiter, data_start + size);
+    }
+    throw std::runtime_error { "truncated multipart body" };
+}
+
+// A range read off the connection by http_byte_range_reader_t.
+export struct http_byte_part_t {
+    uint64_t first {};
+    std::vector<uint8_t> data {};
+};
+
+// Reads the ranges of a response to a range request from the connection one at a time, so each
+// can be used while the next one arrives. The body takes the same forms as in
+// http_byte_ranges(). The connection isn't reusable afterwards, the epilogue after the last part
+// is left unread.
+export class http_byte_range_reader_t {
+public:
+    http_byte_range_reader_t(read_stream_t& stream, const std::unordered_multimap<std::string, std::string>& headers)
+        : m_stream { stream }
+        , m_headers { headers }
+        , m_delimiter { multipart_delimiter(headers) }
+    {
+    }
+
+    // The next range, nothing after the last one.
+    task_t<std::optional<http_byte_part_t>> next_async()
+    {
+        if (m_done) {
+            co_return std::nullopt;
+        }
+        if (m_delimiter.empty()) {
+            m_done = true;
+            auto range = m_headers.find("content-range");
+            auto part = http_byte_part_t { .first = range == m_headers.end() ? 0 : parse_content_range(range->second).first };
+            auto size = http_content_length(m_headers);
+            part.data = co_await m_stream.read_async(size);
+            co_return std::move(part);
+        }
+
+        // --BOUNDARY CRLF headers CRLF CRLF data CRLF ... --BOUNDARY--
+        while (true) {
+            auto line = co_await m_stream.read_line_async();
+            if (line == m_delimiter) {
+                break;
+            }
+            if (line == m_delimiter + "--") {
+                m_done = true;
+                co_return std::nullopt;
+            }
+        }
+        auto headers = co_await http_read_headers_async(m_stream);
+        auto range = headers.find("content-range");
+        if (range == headers.end()) {
+            throw std::runtime_error { "multipart range without content-range" };
+        }
+        auto content_range = parse_content_range(range->second);
+        auto size = content_range.second - content_range.first + 1;
+        auto part = http_byte_part_t { .first = content_range.first };
+        part.data = co_await m_stream.read_async(size);
+        co_return std::move(part);
+    }
+
+private:
+    read_stream_t& m_stream;
+    const std::unordered_multimap<std::string, std::string>& m_headers;
+    std::string m_delimiter {};
+    bool m_done {};
+};
+
+// One TCP connection attempt; the connection is established once the socket becomes writable
+// with no pending SO_ERROR. The socket is stored in `attempt_fd`, if given, while it connects so
+// the attempt can be cancelled. An attempt that races others doesn't use TCP Fast Open: its
+// connect() completes before the handshake, so it would win without reaching the server.
+task_t<read_stream_t> tcp_connect_async(socket_address_t address, int* attempt_fd = nullptr, bool racing = false)
 {
     // create socket.
-    auto sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    auto sd = socket(address.family(), SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
     if (sd < 0) {
         throw std::system_error { errno, std::system_category(), "create socket failed" };
     }
+    if (attempt_fd) {
+        *attempt_fd = sd;
+    }
 
     auto read_stream = read_stream_t { sd };
 
@@ -152,95 +536,479 @@ read_stream_t http_open(const std::string& host, uint16_t port)
         throw std::system_error { errno, std::system_category(), "reuse addr failed" };
     }
 
+    // The remaining options are optimizations; a kernel that rejects them is not an error.
+    const auto& profile = socket_profile();
+    if (profile.no_delay) {
+        setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+    if (profile.receive_buffer > 0) {
+        // Must be set before connect so the window scale is negotiated for it.
+        setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &profile.receive_buffer, sizeof(profile.receive_buffer));
+    }
+    if (profile.fast_open && !racing) {
+        // connect() then returns immediately and the request is sent in the SYN by the first send.
+        setsockopt(sd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &yes, sizeof(yes));
+    }
+
     // set non-blocking
     int on = 1;
     if (int ret = ioctl(sd, FIONBIO, (char*)&on); ret < 0) {
         throw std::system_error { errno, std::system_category(), "ioctl() set to non-blocking failed." };
     }
 
-    // Fill remote address.
-    sockaddr_in addr {
-        .sin_family = AF_INET,
-        .sin_port = htons(port),
-    };
-    if (auto hent = gethostbyname(host.c_str()); !hent) {
-        throw std::system_error { h_errno, std::system_category(), "gethostbyname failed" };
-    } else if (auto pAddrList = (in_addr**)hent->h_addr_list; *pAddrList) {
-        addr.sin_addr = **pAddrList;
-    } else {
-        throw std::runtime_error { "gethostbyname return empty" };
+    // Connect.
+    if (connect(sd, address.data(), address.length) < 0) {
+        if (errno != EINPROGRESS) {
+            throw std::system_error { errno, std::system_category(), std::format("connect to {} failed", address.to_string()) };
+        }
+
+        try {
+            co_await with_deadline(message_queue_t::current().await(sd, EPOLLOUT), http_timeouts().connect, sd);
+        } catch (const timeout_error&) {
+            throw timeout_error { std::format("connect to {} timed out", address.to_string()) };
+        }
+
+        int error {};
+        socklen_t len = sizeof(error);
+        if (getsockopt(sd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+            throw std::system_error { errno, std::system_category(), "getsockopt(SO_ERROR) failed" };
+        }
+        if (error) {
+            throw std::system_error { error, std::system_category(), std::format("connect to {} failed", address.to_string()) };
+        }
     }
 
-    // Connect.
-    auto ret = connect(sd, (const sockaddr*)&addr, sizeof(addr));
-    if (ret < 0 && errno != EINPROGRESS) {
-        throw std::system_error { errno, std::system_category(), "connect to failed" };
+    co_return read_stream;
+}
+
+// Orders addresses as RFC 8305 section 4 asks: alternate the address families, starting with
+// the family of the first (preferred) address.
+std::vector<socket_address_t> interleave_address_families(const std::vector<socket_address_t>& addresses)
+{
+    if (addresses.empty()) {
+        return {};
+    }
+
+    std::vector<socket_address_t> first, second;
+    for (const auto& address : addresses) {
+        (address.family() == addresses.front().family() ? first : second).push_back(address);
     }
 
-    return read_stream;
+    std::vector<socket_address_t> ordered;
+    for (size_t i = 0; i < std::max(first.size(), second.size()); ++i) {
+        if (i < first.size()) {
+            ordered.push_back(first[i]);
+        }
+        if (i < second.size()) {
+            ordered.push_back(second[i]);
+        }
+    }
+    return ordered;
 }
 
-export task_t<std::pair<std::unordered_multimap<std::string, std::string>, read_stream_t>> http_get_header_async(std::string_view url, const std::unordered_multimap<std::string, std::string>& headers)
+// Shared between happy_eyeballs_connect_async() and its connection attempts.
+struct connect_race_t {
+    std::optional<read_stream_t> winner {};
+    // The socket of each attempt while it connects, -1 otherwise.
+    std::vector<int> fds {};
+    std::exception_ptr last_error {};
+    size_t pending {};
+    size_t settled {};
+    std::shared_ptr<task_state_t<void>> wake {};
+
+    void notify()
+    {
+        if (auto w = std::move(wake)) {
+            w->set_value();
+        }
+    }
+};
+
+// Races connection attempts RFC 8305 style: a new attempt starts whenever the previous one fails
+// or has not succeeded within the connection attempt delay, and the first established connection
+// wins. The attempts still connecting then are cancelled and close their sockets.
+task_t<read_stream_t> happy_eyeballs_connect_async(std::vector<socket_address_t> addresses)
 {
-    auto uri = parse_uri(url);
-    if (uri.schema != "http") {
-        throw std::runtime_error { "only support http" };
+    const auto CONNECTION_ATTEMPT_DELAY = 250ms;
+    auto race = std::make_shared<connect_race_t>();
+
+    auto ordered = interleave_address_families(addresses);
+    race->fds.resize(ordered.size(), -1);
+    for (size_t i = 0; i < ordered.size() && !race->winner; ++i) {
+        auto settled = race->settled;
+        ++race->pending;
+        [](size_t index, socket_address_t address, std::shared_ptr<connect_race_t> race) -> task_t<void> {
+            try {
+                auto read_stream = co_await tcp_connect_async(address, &race->fds[index], /*racing=*/race->fds.size() > 1);
+                race->fds[index] = -1;
+                if (!race->winner) {
+                    race->winner.emplace(std::move(read_stream));
+                    for (size_t i = 0; i < race->fds.size(); ++i) {
+                        if (auto fd = std::exchange(race->fds[i], -1); fd >= 0) {
+                            message_queue_t::current().cancel(fd, std::make_exception_ptr(std::runtime_error { "lost the connect race" }));
+                        }
+                    }
+                }
+            } catch (...) {
+                race->fds[index] = -1;
+                race->last_error = std::current_exception();
+            }
+            --race->pending;
+            ++race->settled;
+            race->notify();
+        }(i, ordered[i], race);
+
+        // Give the attempt a head start unless something has settled already.
+        if (i + 1 < ordered.size() && !race->winner && race->settled == settled) {
+            auto wake = race->wake = std::make_shared<task_state_t<void>>();
+            [](std::shared_ptr<connect_race_t> race, std::shared_ptr<task_state_t<void>> wake, std::chrono::milliseconds delay) -> task_t<void> {
+                co_await sleep_for(delay);
+                if (race->wake == wake) {
+                    race->notify();
+                }
+            }(race, wake, CONNECTION_ATTEMPT_DELAY);
+            co_await task_t<void> { wake };
+        }
     }
 
-    auto read_stream = http_open(uri.host, uri.port);
+    // All attempts are started, wait for the first success or the last failure.
+    while (!race->winner && race->pending) {
+        auto wake = race->wake = std::make_shared<task_state_t<void>>();
+        co_await task_t<void> { wake };
+    }
 
-    std::string request_headers = std::format("GET {} HTTP/1.1\r\n"
-                                              "Host: {}\r\n"
-                                              "User-Agent: staticlinux.org/app\r\n"
-                                              "Accept: */*\r\n",
-        uri.path, uri.host);
+    if (race->winner) {
+        co_return std::move(*race->winner);
+    } else if (race->last_error) {
+        std::rethrow_exception(race->last_error);
+    }
+    throw std::runtime_error { "no address to connect" };
+}
 
-    // Write customer headers.
-    for (const auto& header : headers) {
-        request_headers += std::format("{}: {}\r\n", header.first, header.second);
+task_t<read_stream_t> http_open_async(std::string host, uint16_t port)
+{
+    auto dns_timer = stage_timer_t { "dns" };
+    auto addresses = co_await dns_resolver_t::current().resolve_async(host, port);
+    dns_timer.stop();
+
+    auto connect_timer = stage_timer_t { "connect" };
+    auto read_stream = co_await happy_eyeballs_connect_async(std::move(addresses));
+    connect_timer.stop();
+    stats_t::current().count("connections");
+    co_return read_stream;
+}
+
+// Idle keep-alive connections by host, which http_connect_async() reuses. Off unless enabled: a
+// single command rarely asks a host twice, the daemon does all the time.
+export class http_connection_pool_t {
+    static constexpr size_t MAX_IDLE_PER_HOST = 4;
+
+public:
+    static http_connection_pool_t& current()
+    {
+        static thread_local http_connection_pool_t s_current {};
+        return s_current;
     }
-    request_headers += "\r\n";
 
-    // Write.
-    co_await write_async(read_stream.native_handle(), request_headers);
+    // Connections idle for longer are closed rather than reused; servers close theirs after a
+    // few seconds and a request on a connection being closed fails.
+    void enable(std::chrono::milliseconds idle_timeout)
+    {
+        m_idle_timeout = idle_timeout;
+    }
+
+    bool enabled() const
+    {
+        return m_idle_timeout.count() > 0;
+    }
+
+    // An idle connection to host:port the server hasn't closed yet.
+    std::optional<read_stream_t> take(const std::string& host, uint16_t port)
+    {
+        auto it = m_idle.find(std::format("{}:{}", host, port));
+        if (it == m_idle.end()) {
+            return std::nullopt;
+        }
+        auto now = std::chrono::steady_clock::now();
+        while (!it->second.empty()) {
+            auto idle = std::move(it->second.back());
+            it->second.pop_back();
+
+            // A closed connection reads as EOF, anything readable at all means it's unusable.
+            uint8_t byte {};
+            if (now - idle.since < m_idle_timeout && recv(idle.stream.native_handle(), &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return std::move(idle.stream);
+            }
+        }
+        return std::nullopt;
+    }
+
+    void put(const std::string& host, uint16_t port, read_stream_t stream)
+    {
+        auto& idle = m_idle[std::format("{}:{}", host, port)];
+        if (idle.size() < MAX_IDLE_PER_HOST) {
+            stream.reset_limiter();
+            idle.push_back({ std::move(stream), std::chrono::steady_clock::now() });
+        }
+    }
 
-    // Header end.
-    co_await write_async(read_stream.native_handle(), "\r\n");
+private:
+    struct idle_t {
+        read_stream_t stream;
+        std::chrono::steady_clock::time_point since {};
+    };
+
+    std::unordered_map<std::string, std::vector<idle_t>> m_idle {};
+    std::chrono::milliseconds m_idle_timeout {};
+};
 
-    // Read status code.
-    auto status = co_await http_read_status_line_async(read_stream);
+export task_t<read_stream_t> http_connect_async(std::string_view url)
+{
+    auto uri = parse_uri(url);
+    if (uri.schema != "http") {
+        throw std::runtime_error { "only support http" };
+    }
+
+    if (auto pooled = http_connection_pool_t::current().take(uri.host, uri.port)) {
+        stats_t::current().count("connections_reused");
+        pooled->set_idle_timeout(http_timeouts().body_idle);
+        co_return std::move(*pooled);
+    }
+    auto read_stream = co_await http_open_async(uri.host, uri.port);
+    read_stream.set_idle_timeout(http_timeouts().body_idle);
+    co_return read_stream;
+}
+
+// Sends a GET request over a connected stream and reads the response header.
+export task_t<std::pair<std::unordered_multimap<std::string, std::string>, read_stream_t>> http_get_header_async(read_stream_t read_stream, std::string_view url, std::unordered_multimap<std::string, std::string> headers)
+{
+    auto uri = parse_uri(url);
+
+    auto timer = stage_timer_t { "ttfb" };
+    stats_t::current().count("requests");
+    auto& request = read_stream.request_buffer();
+    format_get_request(request, uri, headers, /*keep_alive=*/http_connection_pool_t::current().enabled());
+
+    // Read status code and headers. Only answered requests count towards the time to first byte,
+    // not the ones that failed or were cancelled by a faster hedge.
+    int status {};
+    std::unordered_multimap<std::string, std::string> response_headers {};
+    try {
+        co_await write_async(read_stream.native_handle(), request);
+        set_quick_ack(read_stream.native_handle());
+        std::tie(status, response_headers) = co_await http_read_response_head_async(read_stream);
+    } catch (...) {
+        timer.discard();
+        throw;
+    }
     if (status < 200 || status > 299) {
         throw std::runtime_error { std::format("server return error: {}", status) };
     }
+    timer.stop();
 
-    // Read headers.
-    auto response_headers = co_await http_read_headers_async(read_stream);
     co_return std::make_pair(std::move(response_headers), std::move(read_stream));
 }
 
+// Hands a connection whose response body was read completely back to the pool, when the pool
+// is enabled and the server keeps it open.
+export void http_release_connection(std::string_view url, read_stream_t read_stream, const std::unordered_multimap<std::string, std::string>& response_headers)
+{
+    auto& pool = http_connection_pool_t::current();
+    if (!pool.enabled()) {
+        return;
+    }
+    if (auto it = response_headers.find("connection"); it != response_headers.end() && tolower(it->second) == "close") {
+        return;
+    }
+    auto uri = parse_uri(url);
+    pool.put(uri.host, uri.port, std::move(read_stream));
+}
+
+export task_t<std::pair<std::unordered_multimap<std::string, std::string>, read_stream_t>> http_get_header_async(std::string_view url, std::unordered_multimap<std::string, std::string> headers)
+{
+    auto read_stream = co_await http_connect_async(url);
+    co_return co_await http_get_header_async(std::move(read_stream), url, std::move(headers));
+}
+
 export task_t<std::pair<std::unordered_multimap<std::string, std::string>, read_stream_t>> http_get_header_async(std::string_view url)
 {
     return http_get_header_async(url, /*headers=*/ {});
 }
 
-export task_t<std::vector<uint8_t>> http_get_async(std::string_view url, const std::unordered_multimap<std::string, std::string>& headers)
+export task_t<std::vector<uint8_t>> http_get_async(std::string_view url, std::unordered_multimap<std::string, std::string> headers)
 {
     auto [response_headers, read_stream] = co_await http_get_header_async(url, headers);
 
-    // Get content-length.
-    auto it = response_headers.find("content-length");
-    if (it == response_headers.end()) {
-        throw std::runtime_error { std::format("no content-length header") };
-    }
-    auto content_length = atoi(it->second.c_str());
-    if (content_length <= 0 && it->second != "0") {
-        throw std::runtime_error { std::format("invalid content-length.") };
-    }
-
-    co_return co_await read_stream.read_async(content_length);
+    co_return co_await read_stream.read_async(http_content_length(response_headers));
 }
 
 export task_t<std::vector<uint8_t>> http_get_async(std::string_view url)
 {
     return http_get_async(url, {});
-}
\ No newline at end of file
+}
+
+// A complete response, whatever its status.
+export struct http_response_t {
+    int status {};
+    std::unordered_multimap<std::string, std::string> headers {};
+    std::vector<uint8_t> body {};
+};
+
+// Sends GET requests for one host over a single keep-alive connection without waiting for the
+// previous response: requests are written back-to-back (at most `depth` unanswered at a time)
+// and responses are matched to them in FIFO order as their bodies are consumed. Error statuses
+// are responses like any other, the caller checks them. If the server closes the connection
+// early, the unanswered requests are replayed on a new connection.
+//
+// The pipeline must outlive every task returned by get_async().
+export class http_pipeline_t {
+    static constexpr int MAX_REPLAYS = 3;
+
+public:
+    explicit http_pipeline_t(std::string_view base_url, size_t depth = 16)
+        : m_depth { std::max<size_t>(depth, 1) }
+    {
+        auto uri = parse_uri(base_url);
+        if (uri.schema != "http") {
+            throw std::runtime_error { "only support http" };
+        }
+        m_host = std::move(uri.host);
+        m_port = uri.port;
+    }
+
+    http_pipeline_t(const http_pipeline_t&) = delete;
+
+    ~http_pipeline_t()
+    {
+        *m_alive = false;
+    }
+
+    http_pipeline_t& operator=(const http_pipeline_t&) = delete;
+
+    task_t<http_response_t> get_async(std::string_view url, const std::unordered_multimap<std::string, std::string>& headers)
+    {
+        auto uri = parse_uri(url);
+        if (uri.host != m_host || uri.port != m_port) {
+            throw std::runtime_error { std::format("url is not on pipelined host {}:{}: {}", m_host, m_port, url) };
+        }
+
+        std::string request {};
+        format_get_request(request, uri, headers, /*keep_alive=*/true);
+
+        auto task_state = std::make_shared<task_state_t<http_response_t>>();
+        m_queued.push_back({ std::move(request), task_state });
+        if (!m_running) {
+            run_async();
+        }
+        return task_state;
+    }
+
+    task_t<http_response_t> get_async(std::string_view url)
+    {
+        return get_async(url, {});
+    }
+
+private:
+    struct request_t {
+        std::string data {};
+        std::shared_ptr<task_state_t<http_response_t>> task_state {};
+    };
+
+    // Drives the connection until every queued request has been answered. Connection failures
+    // trigger a replay of everything still unanswered.
+    task_t<void> run_async()
+    {
+        // Completing a request resumes its awaiter inline, which may destroy the pipeline.
+        auto alive = m_alive;
+        m_running = true;
+        auto replays = 0;
+        while (!m_queued.empty() || !m_unanswered.empty()) {
+            std::exception_ptr connection_error {};
+            try {
+                if (!m_stream) {
+                    // Whatever was sent on the previous connection goes out again first.
+                    stats_t::current().count("replays", m_unanswered.size());
+                    while (!m_unanswered.empty()) {
+                        m_queued.push_front(std::move(m_unanswered.back()));
+                        m_unanswered.pop_back();
+                    }
+                    m_stream.emplace(co_await http_open_async(m_host, m_port));
+                    m_stream->set_idle_timeout(http_timeouts().body_idle);
+                    m_stream_requests = 0;
+                }
+
+                // Write as many requests as the depth allows in one go.
+                m_batch.clear();
+                while (!m_queued.empty() && m_unanswered.size() < m_depth) {
+                    stats_t::current().count("requests");
+                    if (m_stream_requests++) {
+                        stats_t::current().count("connections_reused");
+                    }
+                    m_batch += m_queued.front().data;
+                    m_unanswered.push_back(std::move(m_queued.front()));
+                    m_queued.pop_front();
+                }
+                if (!m_batch.empty()) {
+                    co_await write_async(m_stream->native_handle(), m_batch);
+                }
+                set_quick_ack(m_stream->native_handle());
+
+                // Read the response of the oldest request, interim 1xx responses come before it.
+                auto response = http_response_t {};
+                auto reusable = true;
+                do {
+                    std::tie(response.status, response.headers) = co_await http_read_response_head_async(*m_stream);
+                    response.body = co_await http_read_body_async(*m_stream, response.status, response.headers, reusable);
+                } while (response.status >= 100 && response.status < 200);
+                replays = 0;
+
+                auto request = std::move(m_unanswered.front());
+                m_unanswered.pop_front();
+                if (!reusable) {
+                    m_stream.reset();
+                }
+                request.task_state->set_value(std::move(response));
+                if (!*alive) {
+                    co_return;
+                }
+            } catch (...) {
+                connection_error = std::current_exception();
+            }
+
+            if (connection_error) {
+                m_stream.reset();
+                if (++replays > MAX_REPLAYS) {
+                    fail_all(connection_error);
+                    if (!*alive) {
+                        co_return;
+                    }
+                }
+            }
+        }
+        m_running = false;
+    }
+
+    void fail_all(std::exception_ptr error)
+    {
+        auto requests = std::move(m_unanswered);
+        requests.insert(requests.end(), std::make_move_iterator(m_queued.begin()), std::make_move_iterator(m_queued.end()));
+        m_unanswered.clear();
+        m_queued.clear();
+        for (auto& request : requests) {
+            request.task_state->set_exception(error);
+        }
+    }
+
+    std::string m_host {};
+    uint16_t m_port {};
+    size_t m_depth {};
+    std::optional<read_stream_t> m_stream {};
+    // Requests sent on m_stream so far.
+    size_t m_stream_requests {};
+    std::deque<request_t> m_queued {};
+    std::deque<request_t> m_unanswered {};
+    // Send buffer, reused across batches.
+    std::string m_batch {};
+    bool m_running {};
+    std::shared_ptr<bool> m_alive { std::make_shared<bool>(true) };
+};
\ No newline at end of file
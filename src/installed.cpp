@@ -0,0 +1,443 @@
+module;
+
+#include <algorithm>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+export module installed;
+import cppl;
+import file_lock;
+import metadata;
+import package;
+import worker_pool;
+
+using cppl::task_t;
+
+// An installed app file as recorded when it was written, what `app verify` checks it against.
+export struct installed_file_t {
+    std::string path {};
+    std::string version {};
+    std::string md5 {};
+    int mode {};
+};
+
+// A file found by its installed path.
+export struct installed_hit_t {
+    std::string package {};
+    installed_file_t file {};
+};
+
+// ~/.staticlinux/installed.db records every installed file, written whole on each install and
+// mapped to answer queries without parsing. All integers are little endian, strings are offsets
+// into a pool of NUL-terminated strings.
+//     header    32 bytes: "\xF1SLDB\x01\0\0", u32 packages, u32 files, u32 paths, u32 pool size,
+//               u64 reserved
+//     packages  12 bytes each, sorted by name: u32 name, u32 first file, u32 file count
+//     files     32 bytes each, sorted by package then path: u32 path, u32 version, u32 mode,
+//               u32 package, 16 bytes md5
+//     paths     8 bytes each, sorted by key: u32 key, u32 file. Keys are NAME/PATH for every
+//               file and bin/LINK for the linked executables
+//     pool
+constexpr uint8_t DB_MAGIC[] = { 0xF1, 'S', 'L', 'D', 'B', 0x01, 0, 0 };
+constexpr size_t DB_HEADER_LEN = 32;
+constexpr size_t DB_PACKAGE_LEN = 12;
+constexpr size_t DB_FILE_LEN = 32;
+constexpr size_t DB_PATH_LEN = 8;
+
+static std::filesystem::path db_path()
+{
+    return staticlinux_home() / "installed.db";
+}
+
+static uint32_t load_u32(const uint8_t* p)
+{
+    uint32_t value {};
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static void store_u32(std::vector<uint8_t>& out, uint32_t value)
+{
+    auto p = (const uint8_t*)&value;
+    out.insert(out.end(), p, p + sizeof(value));
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// The name of the link into ~/.staticlinux/bin, as link_app_file() makes it.
+static std::string link_name(const installed_file_t& file)
+{
+    return file.mode & 0111 ? std::filesystem::path { file.path }.filename().string() : std::string {};
+}
+
+// A read-only view of the mapped database. A missing database reads as empty.
+export class install_db_t {
+public:
+    install_db_t() = default;
+
+    install_db_t(install_db_t&& other)
+        : m_data { std::exchange(other.m_data, nullptr) }
+        , m_size { std::exchange(other.m_size, 0) }
+        , m_packages { other.m_packages }
+        , m_files { other.m_files }
+        , m_paths { other.m_paths }
+        , m_pool_size { other.m_pool_size }
+    {
+    }
+
+    install_db_t(const install_db_t&) = delete;
+
+    ~install_db_t()
+    {
+        if (m_data) {
+            munmap((void*)m_data, m_size);
+        }
+    }
+
+    install_db_t& operator=(const install_db_t&) = delete;
+
+    static install_db_t open()
+    {
+        auto db = install_db_t {};
+        auto path = db_path();
+        auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            if (errno == ENOENT) {
+                return db;
+            }
+            throw std::system_error { errno, std::system_category(), std::format("Can't open {}", path.string()) };
+        }
+        struct stat st {};
+        if (fstat(fd, &st) < 0 || (size_t)st.st_size < DB_HEADER_LEN) {
+            close(fd);
+            throw std::runtime_error { std::format("{} is damaged", path.string()) };
+        }
+        auto addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            throw std::system_error { errno, std::system_category(), std::format("Can't map {}", path.string()) };
+        }
+        db.m_data = (const uint8_t*)addr;
+        db.m_size = st.st_size;
+
+        db.m_packages = load_u32(db.m_data + 8);
+        db.m_files = load_u32(db.m_data + 12);
+        db.m_paths = load_u32(db.m_data + 16);
+        db.m_pool_size = load_u32(db.m_data + 20);
+        auto expected = DB_HEADER_LEN + (uint64_t)db.m_packages * DB_PACKAGE_LEN + (uint64_t)db.m_files * DB_FILE_LEN + (uint64_t)db.m_paths * DB_PATH_LEN + db.m_pool_size;
+        // The pool ends with a NUL, so every string in it is terminated.
+        if (memcmp(db.m_data, DB_MAGIC, sizeof(DB_MAGIC)) || expected != db.m_size || (db.m_pool_size && db.m_data[db.m_size - 1])) {
+            throw std::runtime_error { std::format("{} is damaged", path.string()) };
+        }
+        return db;
+    }
+
+    size_t package_count() const
+    {
+        return m_packages;
+    }
+
+    std::string_view package_name(size_t package) const
+    {
+        return string(load_u32(package_entry(package)));
+    }
+
+    std::optional<size_t> find_package(std::string_view name) const
+    {
+        size_t first {};
+        size_t count = m_packages;
+        while (count) {
+            auto half = count / 2;
+            if (package_name(first + half) < name) {
+                first += half + 1;
+                count -= half + 1;
+            } else {
+                count = half;
+            }
+        }
+        if (first < m_packages && package_name(first) == name) {
+            return first;
+        }
+        return std::nullopt;
+    }
+
+    std::vector<installed_file_t> files(size_t package) const
+    {
+        auto entry = package_entry(package);
+        auto first = load_u32(entry + 4);
+        auto count = load_u32(entry + 8);
+        if ((uint64_t)first + count > m_files) {
+            throw std::runtime_error { std::format("{} is damaged", db_path().string()) };
+        }
+        auto files = std::vector<installed_file_t> {};
+        for (uint32_t i = first; i < first + count; ++i) {
+            files.push_back(file(i));
+        }
+        return files;
+    }
+
+    // Files installed at `path`, relative to ~/.staticlinux: NAME/PATH, or bin/LINK for an
+    // executable. More than one when packages disagree on a link.
+    std::vector<installed_hit_t> find_path(std::string_view path) const
+    {
+        size_t first {};
+        size_t count = m_paths;
+        while (count) {
+            auto half = count / 2;
+            if (path_key(first + half) < path) {
+                first += half + 1;
+                count -= half + 1;
+            } else {
+                count = half;
+            }
+        }
+        auto hits = std::vector<installed_hit_t> {};
+        for (; first < m_paths && path_key(first) == path; ++first) {
+            auto index = load_u32(path_entry(first) + 4);
+            auto hit = file(index);
+            auto package = load_u32(file_entry(index) + 12);
+            hits.push_back({ .package = std::string { package_name(package) }, .file = std::move(hit) });
+        }
+        return hits;
+    }
+
+private:
+    const uint8_t* package_entry(size_t package) const
+    {
+        check(package < m_packages);
+        return m_data + DB_HEADER_LEN + package * DB_PACKAGE_LEN;
+    }
+
+    const uint8_t* file_entry(size_t file) const
+    {
+        check(file < m_files);
+        return m_data + DB_HEADER_LEN + m_packages * DB_PACKAGE_LEN + file * DB_FILE_LEN;
+    }
+
+    const uint8_t* path_entry(size_t path) const
+    {
+        check(path < m_paths);
+        return m_data + DB_HEADER_LEN + m_packages * DB_PACKAGE_LEN + m_files * DB_FILE_LEN + path * DB_PATH_LEN;
+    }
+
+    std::string_view string(uint32_t offset) const
+    {
+        check(offset < m_pool_size);
+        return (const char*)m_data + m_size - m_pool_size + offset;
+    }
+
+    std::string_view path_key(size_t path) const
+    {
+        return string(load_u32(path_entry(path)));
+    }
+
+    installed_file_t file(size_t index) const
+    {
+        auto entry = file_entry(index);
+        auto md5 = std::string {};
+        for (size_t i = 0; i < 16; ++i) {
+            std::format_to(std::back_inserter(md5), "{:02x}", entry[16 + i]);
+        }
+        return {
+            .path = std::string { string(load_u32(entry)) },
+            .version = std::string { string(load_u32(entry + 4)) },
+            .md5 = std::move(md5),
+            .mode = (int)load_u32(entry + 8),
+        };
+    }
+
+    void check(bool valid) const
+    {
+        if (!valid) {
+            throw std::runtime_error { std::format("{} is damaged", db_path().string()) };
+        }
+    }
+
+    const uint8_t* m_data {};
+    size_t m_size {};
+    size_t m_packages {};
+    size_t m_files {};
+    size_t m_paths {};
+    size_t m_pool_size {};
+};
+
+using installed_map_t = std::map<std::string, std::vector<installed_file_t>, std::less<>>;
+
+static std::vector<uint8_t> serialize(const installed_map_t& installed)
+{
+    auto pool = std::vector<uint8_t> {};
+    auto add_string = [&](std::string_view str) {
+        auto offset = (uint32_t)pool.size();
+        pool.insert(pool.end(), str.begin(), str.end());
+        pool.push_back(0);
+        return offset;
+    };
+
+    auto packages = std::vector<uint8_t> {};
+    auto files = std::vector<uint8_t> {};
+    auto paths = std::vector<std::pair<std::string, uint32_t>> {};
+    uint32_t package_index {};
+    uint32_t file_index {};
+    for (const auto& [name, package_files] : installed) {
+        store_u32(packages, add_string(name));
+        store_u32(packages, file_index);
+        store_u32(packages, package_files.size());
+        for (const auto& file : package_files) {
+            if (!is_md5(file.md5)) {
+                throw std::runtime_error { std::format("Bad md5 of {}/{}: {}", name, file.path, file.md5) };
+            }
+            store_u32(files, add_string(file.path));
+            store_u32(files, add_string(file.version));
+            store_u32(files, file.mode);
+            store_u32(files, package_index);
+            for (size_t i = 0; i < 32; i += 2) {
+                files.push_back(hex_value(file.md5[i]) << 4 | hex_value(file.md5[i + 1]));
+            }
+
+            paths.emplace_back(std::format("{}/{}", name, file.path), file_index);
+            if (auto link = link_name(file); !link.empty()) {
+                paths.emplace_back(std::format("bin/{}", link), file_index);
+            }
+            ++file_index;
+        }
+        ++package_index;
+    }
+
+    std::sort(paths.begin(), paths.end());
+    auto path_entries = std::vector<uint8_t> {};
+    for (const auto& [key, file] : paths) {
+        store_u32(path_entries, add_string(key));
+        store_u32(path_entries, file);
+    }
+
+    auto db = std::vector<uint8_t> { std::begin(DB_MAGIC), std::end(DB_MAGIC) };
+    store_u32(db, package_index);
+    store_u32(db, file_index);
+    store_u32(db, paths.size());
+    store_u32(db, pool.size());
+    db.resize(DB_HEADER_LEN);
+    db.insert(db.end(), packages.begin(), packages.end());
+    db.insert(db.end(), files.begin(), files.end());
+    db.insert(db.end(), path_entries.begin(), path_entries.end());
+    db.insert(db.end(), pool.begin(), pool.end());
+    return db;
+}
+
+// Replaces the database in one rename, readers see either the old or the new one whole.
+static void write_db(const installed_map_t& installed)
+{
+    auto data = serialize(installed);
+    auto path = db_path();
+    auto tmp = path;
+    tmp += std::format(".{}.tmp", getpid());
+    std::filesystem::create_directories(path.parent_path());
+    auto fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::system_error { errno, std::system_category(), std::format("Can't write {}", tmp.string()) };
+    }
+    size_t written {};
+    while (written < data.size()) {
+        auto n = write(fd, data.data() + written, data.size() - written);
+        if (n < 0) {
+            auto error = errno;
+            close(fd);
+            std::filesystem::remove(tmp);
+            throw std::system_error { error, std::system_category(), std::format("Can't write {}", tmp.string()) };
+        }
+        written += n;
+    }
+    if (fsync(fd) < 0) {
+        auto error = errno;
+        close(fd);
+        std::filesystem::remove(tmp);
+        throw std::system_error { error, std::system_category(), std::format("Can't write {}", tmp.string()) };
+    }
+    close(fd);
+    std::filesystem::rename(tmp, path);
+}
+
+// Files recorded for package `name`, empty when nothing was recorded.
+export std::vector<installed_file_t> load_installed(std::string_view name)
+{
+    auto db = install_db_t::open();
+    auto package = db.find_package(name);
+    return package ? db.files(*package) : std::vector<installed_file_t> {};
+}
+
+// Names of the packages with a record, sorted.
+export std::vector<std::string> installed_packages()
+{
+    auto db = install_db_t::open();
+    auto names = std::vector<std::string> {};
+    for (size_t i = 0; i < db.package_count(); ++i) {
+        names.emplace_back(db.package_name(i));
+    }
+    return names;
+}
+
+// Records `files` of package `name` at `version` as installed. Other recorded files are kept,
+// unless `replace` is set because the whole tree was replaced.
+static void record_installed(std::string_view name, std::string_view version, std::span<const Metadata::File> files, bool replace)
+{
+    // Read, changed and written back by one process at a time, or an update would be lost.
+    auto lock = file_lock_t::lock(INSTALLED_DB_LOCK_KEY);
+    auto installed = installed_map_t {};
+    {
+        auto db = install_db_t::open();
+        for (size_t i = 0; i < db.package_count(); ++i) {
+            installed.emplace(db.package_name(i), db.files(i));
+        }
+    }
+
+    auto& package_files = installed[std::string { name }];
+    if (replace) {
+        package_files.clear();
+    }
+    for (const auto& file : files) {
+        auto entry = installed_file_t { .path = file.filepath, .version = std::string { version }, .md5 = file.md5, .mode = file.mode };
+        auto it = std::lower_bound(package_files.begin(), package_files.end(), file.filepath, [](const auto& e, const auto& path) { return e.path < path; });
+        if (it != package_files.end() && it->path == file.filepath) {
+            *it = std::move(entry);
+        } else {
+            package_files.insert(it, std::move(entry));
+        }
+    }
+    write_db(installed);
+}
+
+// record_installed() on a worker, the message loop goes on while another process holds the
+// database lock or the new database is synced to disk.
+export task_t<void> record_installed_async(std::string name, std::string version, std::vector<Metadata::File> files, bool replace = false)
+{
+    auto job = [name = std::move(name), version = std::move(version), files = std::move(files), replace] {
+        record_installed(name, version, files, replace);
+    };
+    co_await worker_pool_t::shared().run_async(std::move(job));
+}
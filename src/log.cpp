@@ -1,24 +1,285 @@
 module;
 
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <format>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+// Lowest level compiled in, calls below it are removed entirely: 0 trace, 1 debug, 2 info.
+#ifndef APP_LOG_FLOOR
+#define APP_LOG_FLOOR 0
+#endif
 
 export module log;
 
+export enum class log_level_t {
+    trace,
+    debug,
+    info,
+    warning,
+    error,
+};
+
+constexpr auto LOG_FLOOR = (log_level_t)APP_LOG_FLOOR;
+
+// Hands formatted lines to a background thread, so a slow terminal or pipe doesn't stall the
+// message loop. When too much is pending the caller waits for the thread to catch up, so lines
+// are neither dropped nor reordered.
+class async_sink_t {
+    static constexpr size_t MAX_PENDING_BYTES = 4 << 20;
+
+public:
+    ~async_sink_t()
+    {
+        {
+            auto lock = std::lock_guard { m_mutex };
+            m_stopping = true;
+        }
+        m_cv.notify_one();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+    void write(FILE* fp, std::string_view line)
+    {
+        auto lock = std::unique_lock { m_mutex };
+        if (!m_thread.joinable()) {
+            m_thread = std::thread { [this] { run(); } };
+        }
+        // A line longer than the limit goes in alone.
+        m_room.wait(lock, [&] { return m_pending_bytes == 0 || m_pending_bytes + line.size() <= MAX_PENDING_BYTES; });
+        m_pending_bytes += line.size();
+        m_lines.push_back({ fp, std::string { line } });
+        m_cv.notify_one();
+    }
+
+private:
+    struct line_t {
+        FILE* fp {};
+        std::string text {};
+    };
+
+    void run()
+    {
+        auto lock = std::unique_lock { m_mutex };
+        while (true) {
+            m_cv.wait(lock, [this] { return m_stopping || !m_lines.empty(); });
+            if (m_lines.empty()) {
+                return;
+            }
+
+            auto lines = std::move(m_lines);
+            m_lines.clear();
+            lock.unlock();
+            size_t written {};
+            for (const auto& line : lines) {
+                fwrite(line.text.data(), 1, line.text.size(), line.fp);
+                fflush(line.fp);
+                written += line.text.size();
+            }
+            lock.lock();
+            m_pending_bytes -= written;
+            m_room.notify_all();
+        }
+    }
+
+    std::mutex m_mutex {};
+    std::condition_variable m_cv {};
+    // Signalled when written lines free up room.
+    std::condition_variable m_room {};
+    std::deque<line_t> m_lines {};
+    size_t m_pending_bytes {};
+    bool m_stopping {};
+    std::thread m_thread {};
+};
+
+// Where and what to log. Defaults come from APP_LOG_LEVEL, APP_LOG_FILE and APP_LOG_ASYNC, the
+// command line options override them.
+export class logger_t {
+public:
+    static logger_t& instance()
+    {
+        static logger_t s_instance {};
+        return s_instance;
+    }
+
+    logger_t()
+    {
+        if (auto env = getenv("APP_LOG_LEVEL"); env && *env) {
+            if (!set_level(env)) {
+                fprintf(stderr, "warning: unknown APP_LOG_LEVEL: %s\n", env);
+            }
+        }
+        if (auto env = getenv("APP_LOG_FILE"); env && *env) {
+            set_file(env);
+        }
+        if (auto env = getenv("APP_LOG_ASYNC"); env && *env && strcmp(env, "0")) {
+            m_async = true;
+        }
+    }
+
+    ~logger_t()
+    {
+        // Flush the async sink before the file it writes to is closed.
+        m_sink.reset();
+        if (m_file) {
+            fclose(m_file);
+        }
+    }
+
+    bool enabled(log_level_t level) const
+    {
+        return level >= m_level;
+    }
+
+    log_level_t level() const
+    {
+        return m_level;
+    }
+
+    void set_level(log_level_t level)
+    {
+        m_level = level;
+    }
+
+    // Accepts trace, debug, info, warning and error.
+    bool set_level(std::string_view name)
+    {
+        for (size_t i = 0; i < std::size(LEVEL_NAMES); ++i) {
+            if (name == LEVEL_NAMES[i]) {
+                m_level = (log_level_t)i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The name set_level() takes for the current level.
+    std::string_view level_name() const
+    {
+        return LEVEL_NAMES[(size_t)m_level];
+    }
+
+    // Trace and debug messages go to `path` instead of stderr.
+    void set_file(const char* path)
+    {
+        auto fp = fopen(path, "ae");
+        if (!fp) {
+            fprintf(stderr, "warning: can't open log file: %s\n", path);
+            return;
+        }
+        if (m_file) {
+            fclose(m_file);
+        }
+        m_file = fp;
+    }
+
+    void set_async(bool async)
+    {
+        m_async = async;
+    }
+
+    // Hands the lines that would go to stdout or stderr to `forward` instead, e.g. to the client
+    // of the daemon. An empty function restores the default.
+    void set_forward(std::function<void(log_level_t, std::string_view)> forward)
+    {
+        m_sink.reset();
+        m_forward = std::move(forward);
+    }
+
+    void write(log_level_t level, std::string_view line)
+    {
+        if (m_forward && (level >= log_level_t::info || !m_file)) {
+            m_forward(level, line);
+            return;
+        }
+        auto fp = level == log_level_t::info ? stdout : level < log_level_t::info && m_file ? m_file : stderr;
+        if (m_async) {
+            if (!m_sink) {
+                m_sink = std::make_unique<async_sink_t>();
+            }
+            m_sink->write(fp, line);
+        } else {
+            fwrite(line.data(), 1, line.size(), fp);
+        }
+    }
+
+    // Writes pending asynchronous output, e.g. before the process exits.
+    void flush()
+    {
+        m_sink.reset();
+        fflush(stdout);
+        fflush(stderr);
+    }
+
+private:
+    static constexpr const char* LEVEL_NAMES[] = { "trace", "debug", "info", "warning", "error" };
+
+    log_level_t m_level { log_level_t::info };
+    FILE* m_file {};
+    bool m_async {};
+    std::unique_ptr<async_sink_t> m_sink {};
+    std::function<void(log_level_t, std::string_view)> m_forward {};
+};
+
+template <log_level_t LEVEL, typename... Args>
+void write_log(std::string_view prefix, std::format_string<Args...> fmt, Args&&... args)
+{
+    if constexpr (LEVEL >= LOG_FLOOR) {
+        auto& logger = logger_t::instance();
+        if (!logger.enabled(LEVEL)) {
+            return;
+        }
+
+        // Reused by every message of this thread, formatting allocates only to grow it.
+        static thread_local std::string t_buffer {};
+        t_buffer.assign(prefix);
+        std::vformat_to(std::back_inserter(t_buffer), fmt.get(), std::make_format_args(args...));
+        t_buffer += '\n';
+        logger.write(LEVEL, t_buffer);
+    }
+}
+
+// Details of what the program is doing, off unless --log-level=trace.
+export template <typename... Args>
+void trace(std::format_string<Args...> fmt, Args&&... args)
+{
+    write_log<log_level_t::trace>("", fmt, std::forward<Args>(args)...);
+}
+
+export template <typename... Args>
+void debug(std::format_string<Args...> fmt, Args&&... args)
+{
+    write_log<log_level_t::debug>("", fmt, std::forward<Args>(args)...);
+}
+
+// Progress and results for the user, on stdout.
 export template <typename... Args>
 void status(std::format_string<Args...> fmt, Args&&... args)
 {
-    fprintf(stdout, "%s\n", std::vformat(fmt.get(), std::make_format_args(args...)).c_str());
+    write_log<log_level_t::info>("", fmt, std::forward<Args>(args)...);
 }
 
 export template <typename... Args>
-void trace(std::format_string<Args...> fmt, Args&&... args)
+void warning(std::format_string<Args...> fmt, Args&&... args)
 {
-    fprintf(stdout, "%s\n", std::vformat(fmt.get(), std::make_format_args(args...)).c_str());
+    write_log<log_level_t::warning>("warning: ", fmt, std::forward<Args>(args)...);
 }
 
 export template <typename... Args>
 void fatal_error(std::format_string<Args...> fmt, Args&&... args)
 {
+    logger_t::instance().flush();
     fprintf(stderr, "error: %s\n", std::vformat(fmt.get(), std::make_format_args(args...)).c_str());
     exit(1);
-}
\ No newline at end of file
+}
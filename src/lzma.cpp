@@ -1,6 +1,8 @@
 module;
 
+#include <cstdint>
 #include <format>
+#include <functional>
 #include <lzma.h>
 #include <span>
 #include <stdexcept>
@@ -8,11 +10,12 @@ module;
 
 export module lzma;
 
+// Decodes one or more concatenated xz streams.
 export std::vector<uint8_t> lzma_decompress(std::span<uint8_t> compressed_data)
 {
     // init decoder.
     lzma_stream stream = LZMA_STREAM_INIT;
-    if (auto ret = lzma_stream_decoder(&stream, /*memlimit=*/UINT64_MAX, /*flags=*/0); ret != LZMA_OK) {
+    if (auto ret = lzma_stream_decoder(&stream, /*memlimit=*/UINT64_MAX, LZMA_CONCATENATED); ret != LZMA_OK) {
         lzma_end(&stream);
         throw std::runtime_error { std::format("Init lzma decoder failed: {}", (int)ret) };
     }
@@ -26,7 +29,8 @@ export std::vector<uint8_t> lzma_decompress(std::span<uint8_t> compressed_data)
     stream.avail_out = buffer.size();
 
     while (true) {
-        auto ret = lzma_code(&stream, LZMA_RUN);
+        // The input is complete, finishing lets the decoder tell the last stream from padding.
+        auto ret = lzma_code(&stream, LZMA_FINISH);
         if (!stream.avail_out || ret == LZMA_STREAM_END) {
             out.insert(out.end(), buffer.data(), buffer.data() + (buffer.size() - stream.avail_out));
             if (ret == LZMA_STREAM_END) {
@@ -42,4 +46,84 @@ export std::vector<uint8_t> lzma_decompress(std::span<uint8_t> compressed_data)
             throw std::runtime_error { std::format("lzma decompress failed: {}", (int)ret) };
         }
     }
-}
\ No newline at end of file
+}
+
+// Decodes one xz stream that must expand to exactly `out.size()` bytes.
+export void lzma_decompress_to(std::span<uint8_t> compressed_data, std::span<uint8_t> out)
+{
+    uint64_t memlimit = UINT64_MAX;
+    size_t in_pos {};
+    size_t out_pos {};
+    auto ret = lzma_stream_buffer_decode(&memlimit, /*flags=*/0, nullptr, compressed_data.data(), &in_pos, compressed_data.size(), out.data(), &out_pos, out.size());
+    if (ret != LZMA_OK || in_pos != compressed_data.size() || out_pos != out.size()) {
+        throw std::runtime_error { std::format("lzma decompress failed: {}", (int)ret) };
+    }
+}
+
+// Decodes concatenated xz streams fed in pieces, for payloads that aren't held whole. The output
+// goes to `sink` as it is produced.
+export class lzma_decoder_t {
+public:
+    using sink_t = std::function<void(std::span<const uint8_t>)>;
+
+    lzma_decoder_t()
+        : m_buffer(1 << 16)
+    {
+        if (auto ret = lzma_stream_decoder(&m_stream, /*memlimit=*/UINT64_MAX, LZMA_CONCATENATED); ret != LZMA_OK) {
+            lzma_end(&m_stream);
+            throw std::runtime_error { std::format("Init lzma decoder failed: {}", (int)ret) };
+        }
+    }
+
+    lzma_decoder_t(const lzma_decoder_t&) = delete;
+
+    ~lzma_decoder_t()
+    {
+        lzma_end(&m_stream);
+    }
+
+    lzma_decoder_t& operator=(const lzma_decoder_t&) = delete;
+
+    void decode(std::span<const uint8_t> data, const sink_t& sink)
+    {
+        code(data, LZMA_RUN, sink);
+    }
+
+    // After the last piece, a truncated stream fails here.
+    void finish(const sink_t& sink)
+    {
+        code({}, LZMA_FINISH, sink);
+    }
+
+private:
+    void code(std::span<const uint8_t> data, lzma_action action, const sink_t& sink)
+    {
+        m_stream.next_in = data.data();
+        m_stream.avail_in = data.size();
+        while (true) {
+            m_stream.next_out = m_buffer.data();
+            m_stream.avail_out = m_buffer.size();
+            auto ret = lzma_code(&m_stream, action);
+            if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+                throw std::runtime_error { std::format("lzma decompress failed: {}", (int)ret) };
+            }
+            auto produced = m_buffer.size() - m_stream.avail_out;
+            if (produced) {
+                sink({ m_buffer.data(), produced });
+            }
+
+            // A full buffer may leave output behind, otherwise running out of input is done.
+            if (ret == LZMA_STREAM_END || (action == LZMA_RUN && !m_stream.avail_in && m_stream.avail_out)) {
+                return;
+            }
+        }
+    }
+
+    lzma_stream m_stream = LZMA_STREAM_INIT;
+    std::vector<uint8_t> m_buffer {};
+};
+
+export uint32_t crc32(std::span<const uint8_t> data)
+{
+    return lzma_crc32(data.data(), data.size(), 0);
+}
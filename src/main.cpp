@@ -1,8 +1,15 @@
 import consts;
 import cppl;
+import daemon;
+import install;
+import list;
 import log;
 import message_queue;
 import pull;
+import serve;
+import upgrade;
+import verify;
+import which;
 
 #include <coroutine>
 #include <cstdio>
@@ -26,6 +33,24 @@ static Options parse_options(int& argc, const char**& argv)
             options.help = true;
             --argc;
             ++argv;
+        } else if (!strcmp(*argv + 1, "v") || !strcmp(*argv + 1, "-verbose")) {
+            logger_t::instance().set_level(log_level_t::trace);
+            --argc;
+            ++argv;
+        } else if (!strncmp(*argv + 1, "-log-level=", 11)) {
+            if (!logger_t::instance().set_level(*argv + 12)) {
+                fatal_error("unknown log level: {}", *argv + 12);
+            }
+            --argc;
+            ++argv;
+        } else if (!strncmp(*argv + 1, "-log-file=", 10)) {
+            logger_t::instance().set_file(*argv + 11);
+            --argc;
+            ++argv;
+        } else if (!strcmp(*argv + 1, "-log-async")) {
+            logger_t::instance().set_async(true);
+            --argc;
+            ++argv;
         } else {
             fatal_error("unknown option: {}", *argv);
         }
@@ -40,9 +65,20 @@ Usage: app [OPTIONS] <command>
 
 Options:
     -h,--help                   Print this help message and exit
+    -v,--verbose                Same as --log-level=trace
+    --log-level=LEVEL           trace, debug, info (default), warning or error
+    --log-file=PATH             Append trace and debug messages to PATH instead of stderr
+    --log-async                 Write log messages from a background thread
 
 Subcommands:
+    daemon                      Keep a resident process that runs app pull
+    install                     Install the apps listed in a manifest
+    list                        List installed packages and their files
     pull                        Download app from internet
+    serve                       Serve cached packages to other hosts
+    upgrade                     Upgrade a package, downloading only the changed files
+    verify                      Check installed apps against their package metadata
+    which                       Show which installed package provides a file
 
 For more information, please visit %s
 )",
@@ -64,8 +100,25 @@ task_t<int> main_async(int argc, const char* argv[])
         fatal_error("command is required");
     }
 
-    if (!strcmp(*argv, "pull")) {
+    if (!strcmp(*argv, "daemon")) {
+        co_await daemon_async(--argc, ++argv);
+    } else if (!strcmp(*argv, "exec-stub")) {
+        // Run by the stubs of pull --lazy, not by hand.
+        co_await exec_stub_async(--argc, ++argv);
+    } else if (!strcmp(*argv, "install")) {
+        co_await install_async(--argc, ++argv);
+    } else if (!strcmp(*argv, "list")) {
+        co_await list_async(--argc, ++argv);
+    } else if (!strcmp(*argv, "pull")) {
         co_await pull_async(--argc, ++argv);
+    } else if (!strcmp(*argv, "serve")) {
+        co_await serve_async(--argc, ++argv);
+    } else if (!strcmp(*argv, "upgrade")) {
+        co_await upgrade_async(--argc, ++argv);
+    } else if (!strcmp(*argv, "verify")) {
+        co_await verify_async(--argc, ++argv);
+    } else if (!strcmp(*argv, "which")) {
+        co_await which_async(--argc, ++argv);
     } else {
         fatal_error("unknown command: {}", *argv);
     }
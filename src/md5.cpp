@@ -242,16 +242,37 @@ void md5File(FILE* file, uint8_t* result)
     memcpy(result, ctx.digest, 16);
 }
 
-std::string md5_string(std::span<uint8_t> data)
-{
-    MD5Context ctx {};
-    md5Init(&ctx);
-    md5Update(&ctx, data.data(), data.size());
-    md5Finalize(&ctx);
+// MD5 of content that arrives in pieces.
+export class md5_hasher_t {
+public:
+    md5_hasher_t()
+    {
+        md5Init(&m_ctx);
+    }
+
+    void update(std::span<const uint8_t> data)
+    {
+        md5Update(&m_ctx, (uint8_t*)data.data(), data.size());
+    }
 
-    std::string res {};
-    for (int i = 0; i < 16; ++i) {
-        res += std::format("{:02x}", ctx.digest[i]);
+    // Lowercase hex, the hasher is done then.
+    std::string finish()
+    {
+        md5Finalize(&m_ctx);
+        std::string res {};
+        for (int i = 0; i < 16; ++i) {
+            res += std::format("{:02x}", m_ctx.digest[i]);
+        }
+        return res;
     }
-    return res;
-}
\ No newline at end of file
+
+private:
+    MD5Context m_ctx {};
+};
+
+std::string md5_string(std::span<uint8_t> data)
+{
+    auto hasher = md5_hasher_t {};
+    hasher.update(data);
+    return hasher.finish();
+}
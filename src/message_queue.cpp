@@ -2,13 +2,19 @@ module;
 
 #include <array>
 #include <atomic>
+#include <chrono>
 #include <errno.h>
 #include <functional>
 #include <future>
 #include <memory>
+#include <optional>
+#include <stdexcept>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
+#include <unordered_map>
+#include <vector>
 
 export module message_queue;
 import cppl;
@@ -17,7 +23,132 @@ import log;
 using cppl::task_state_t;
 using cppl::task_t;
 
+// Thrown into an operation whose deadline has passed.
+export class timeout_error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Hierarchical timing wheel with millisecond ticks: 4 levels of 64 slots cover ~4.6 hours, later
+// timers are parked in the top level and re-placed as they cascade down. Adding and cancelling
+// are O(1), advancing is O(1) per tick plus the cascaded timers.
+class timer_wheel_t {
+    static constexpr int SLOT_BITS = 6;
+    static constexpr uint64_t SLOTS = 1 << SLOT_BITS;
+    static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+    static constexpr int LEVELS = 4;
+    static constexpr uint64_t MAX_DELTA = (uint64_t)1 << (SLOT_BITS * LEVELS);
+
+public:
+    bool empty() const
+    {
+        return m_timers.empty();
+    }
+
+    uint64_t add(uint64_t expires, std::function<void()> callback)
+    {
+        auto id = ++m_last_id;
+        expires = std::max(expires, m_now + 1);
+        m_timers.emplace(id, timer_t { expires, std::move(callback) });
+        place(id, expires);
+        return id;
+    }
+
+    void cancel(uint64_t id)
+    {
+        // The slot keeps the id until it's reached, it's skipped there.
+        m_timers.erase(id);
+    }
+
+    // Advances the wheel to `tick`, returns the callbacks of the expired timers in expiry order.
+    std::vector<std::function<void()>> advance(uint64_t tick)
+    {
+        std::vector<std::function<void()>> expired;
+        if (m_timers.empty()) {
+            m_now = std::max(m_now, tick);
+            return expired;
+        }
+
+        while (m_now < tick) {
+            ++m_now;
+
+            // Entering a new rotation of a level pulls the matching slot of the level above down.
+            for (int level = 1; level < LEVELS && !(m_now & ((1ull << (SLOT_BITS * level)) - 1)); ++level) {
+                auto& slot = m_slots[level][(m_now >> (SLOT_BITS * level)) & SLOT_MASK];
+                auto ids = std::move(slot);
+                slot.clear();
+                for (auto id : ids) {
+                    if (auto it = m_timers.find(id); it != m_timers.end()) {
+                        place(id, it->second.expires);
+                    }
+                }
+            }
+
+            auto& slot = m_slots[0][m_now & SLOT_MASK];
+            auto ids = std::move(slot);
+            slot.clear();
+            for (auto id : ids) {
+                if (auto it = m_timers.find(id); it != m_timers.end()) {
+                    expired.push_back(std::move(it->second.callback));
+                    m_timers.erase(it);
+                }
+            }
+
+            if (m_timers.empty()) {
+                m_now = tick;
+                break;
+            }
+        }
+        return expired;
+    }
+
+    // The next tick worth waking up for: the next occupied slot in the lowest level, or the next
+    // cascade if that level is empty until then.
+    uint64_t next_tick() const
+    {
+        for (uint64_t tick = m_now + 1; tick <= (m_now | SLOT_MASK) + 1; ++tick) {
+            if (!(tick & SLOT_MASK) || !m_slots[0][tick & SLOT_MASK].empty()) {
+                return tick;
+            }
+        }
+        return (m_now | SLOT_MASK) + 1;
+    }
+
+private:
+    struct timer_t {
+        uint64_t expires {};
+        std::function<void()> callback {};
+    };
+
+    void place(uint64_t id, uint64_t expires)
+    {
+        auto delta = expires > m_now ? expires - m_now : 0;
+        if (delta == 0) {
+            // Already due (only during a cascade), fire on the next tick.
+            expires = m_now + 1;
+            delta = 1;
+        }
+        for (int level = 0; level < LEVELS; ++level) {
+            if (delta < (1ull << (SLOT_BITS * (level + 1)))) {
+                m_slots[level][(expires >> (SLOT_BITS * level)) & SLOT_MASK].push_back(id);
+                return;
+            }
+        }
+        // Beyond the wheel range: park it as far as possible, it's re-placed when cascaded.
+        auto parked = m_now + MAX_DELTA - 1;
+        m_slots[LEVELS - 1][(parked >> (SLOT_BITS * (LEVELS - 1))) & SLOT_MASK].push_back(id);
+    }
+
+    uint64_t m_now {};
+    uint64_t m_last_id {};
+    std::array<std::array<std::vector<uint64_t>, SLOTS>, LEVELS> m_slots {};
+    std::unordered_map<uint64_t, timer_t> m_timers {};
+};
+
 export class message_queue_t {
+    // epoll data of the timerfd, fd registrations start from 1.
+    static constexpr uint64_t TIMER_EVENT_ID = 0;
+
 public:
     static message_queue_t& current()
     {
@@ -28,13 +159,30 @@ public:
     message_queue_t()
     {
         // Create epoll fd.
-        if ((m_epollfd = epoll_create1(/*flags=*/0)) < 0) {
+        if ((m_epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
             throw std::system_error { errno, std::system_category(), "create epoll failed" };
         }
+
+        // Create the timerfd that drives the timer wheel.
+        if ((m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+            throw std::system_error { errno, std::system_category(), "timerfd_create failed" };
+        }
+        auto evt = epoll_event {
+            .events = EPOLLIN,
+            .data = {
+                .u64 = TIMER_EVENT_ID,
+            },
+        };
+        if (epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_timerfd, &evt) < 0) {
+            throw std::system_error { errno, std::system_category(), "add timerfd to epoll failed" };
+        }
     }
 
     ~message_queue_t()
     {
+        if (m_timerfd > 0) {
+            close(m_timerfd);
+        }
         if (m_epollfd) {
             close(m_epollfd);
         }
@@ -43,20 +191,66 @@ public:
     task_t<void> await(int fd, uint32_t events)
     {
         auto task_state = std::make_shared<task_state_t<void>>();
-        auto evt_ctx = std::make_unique<event_context_t>(fd, task_state);
+        auto id = ++m_last_event_id;
         auto evt = epoll_event {
             .events = events,
             .data = {
-                .ptr = evt_ctx.get(),
+                .u64 = id,
             },
         };
         if (epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &evt) < 0) {
             throw std::system_error { errno, std::system_category(), "add fd to epoll failed" };
         }
-        evt_ctx.release();
+
+        // A registration still recorded for this fd belongs to a closed descriptor whose number has
+        // been reused, epoll already forgot about it.
+        if (auto it = m_fd_events.find(fd); it != m_fd_events.end()) {
+            if (auto evt_it = m_events.find(it->second); evt_it != m_events.end()) {
+                cppl::trace::record(cppl::trace::phase_t::async_end, evt_it->second.name, evt_it->second.task_state.get(), fd);
+                m_events.erase(evt_it);
+            }
+        }
+        m_fd_events[fd] = id;
+        m_events.emplace(id, event_context_t { fd, task_state, wait_name(events) });
+        cppl::trace::record(cppl::trace::phase_t::async_begin, wait_name(events), task_state.get(), fd);
         return task_state;
     }
 
+    // Removes the pending registration of `fd`, its awaiter resumes with `error`. Does nothing if
+    // nothing is waiting on `fd`.
+    void cancel(int fd, std::exception_ptr error)
+    {
+        auto it = m_fd_events.find(fd);
+        if (it == m_fd_events.end()) {
+            return;
+        }
+
+        auto evt_it = m_events.find(it->second);
+        auto task_state = std::move(evt_it->second.task_state);
+        cppl::trace::record(cppl::trace::phase_t::async_end, evt_it->second.name, task_state.get(), fd);
+        m_events.erase(evt_it);
+        m_fd_events.erase(it);
+
+        // The fd may be closed already, which removed it from epoll.
+        if (epoll_ctl(m_epollfd, EPOLL_CTL_DEL, fd, nullptr) < 0 && errno != EBADF && errno != ENOENT) {
+            throw std::system_error { errno, std::system_category(), "delete fd from epoll failed" };
+        }
+        task_state->set_exception(std::move(error));
+    }
+
+    // Calls `callback` from the message loop once `delay` has passed, unless cancelled first.
+    uint64_t add_timer(std::chrono::milliseconds delay, std::function<void()> callback)
+    {
+        auto id = m_timer_wheel.add(current_tick() + std::max<int64_t>(delay.count(), 0), std::move(callback));
+        arm_timerfd();
+        return id;
+    }
+
+    void cancel_timer(uint64_t id)
+    {
+        m_timer_wheel.cancel(id);
+    }
+
     template <typename T>
     T wait(task_t<T> task)
     {
@@ -70,8 +264,67 @@ private:
     struct event_context_t {
         int fd {};
         std::shared_ptr<task_state_t<void>> task_state {};
+        // Trace event name of the wait.
+        const char* name {};
     };
 
+    static const char* wait_name(uint32_t events)
+    {
+        return events & EPOLLIN ? "wait readable" : events & EPOLLOUT ? "wait writable" : "wait fd";
+    }
+
+    uint64_t current_tick() const
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_epoch).count();
+    }
+
+    void arm_timerfd()
+    {
+        if (m_timer_wheel.empty()) {
+            if (m_armed_tick) {
+                auto spec = itimerspec {};
+                timerfd_settime(m_timerfd, /*flags=*/0, &spec, nullptr);
+                m_armed_tick = 0;
+            }
+            return;
+        }
+
+        auto next = m_timer_wheel.next_tick();
+        if (next == m_armed_tick) {
+            return;
+        }
+
+        // A zero value would disarm the timer, fire as soon as possible instead.
+        auto now = current_tick();
+        auto delay_ms = next > now ? next - now : 0;
+        auto spec = itimerspec {
+            .it_value = {
+                .tv_sec = (time_t)(delay_ms / 1000),
+                .tv_nsec = delay_ms ? (long)(delay_ms % 1000) * 1000000 : 1,
+            },
+        };
+        if (timerfd_settime(m_timerfd, /*flags=*/0, &spec, nullptr) < 0) {
+            throw std::system_error { errno, std::system_category(), "timerfd_settime failed" };
+        }
+        m_armed_tick = next;
+    }
+
+    void process_timers()
+    {
+        uint64_t expirations {};
+        while (read(m_timerfd, &expirations, sizeof(expirations)) < 0 && errno == EINTR) {
+        }
+        m_armed_tick = 0;
+
+        // Callbacks may add or cancel timers, so collect them before running any.
+        auto callbacks = m_timer_wheel.advance(current_tick());
+        cppl::trace::record(cppl::trace::phase_t::instant, "timers", nullptr, callbacks.size());
+        for (auto& callback : callbacks) {
+            callback();
+        }
+        arm_timerfd();
+    }
+
     void process_events()
     {
         std::array<epoll_event, 256> events;
@@ -85,14 +338,130 @@ private:
             }
         }
 
+        auto timer_fired = false;
         for (int i = 0; i < numEvents; ++i) {
-            auto evt_ctx = reinterpret_cast<event_context_t*>(events[i].data.ptr);
-            if (epoll_ctl(m_epollfd, EPOLL_CTL_DEL, evt_ctx->fd, nullptr) < 0) {
+            auto id = events[i].data.u64;
+            if (id == TIMER_EVENT_ID) {
+                timer_fired = true;
+                continue;
+            }
+
+            // Skip registrations cancelled by an earlier event of this batch.
+            auto it = m_events.find(id);
+            if (it == m_events.end()) {
+                continue;
+            }
+            auto evt_ctx = std::move(it->second);
+            m_events.erase(it);
+            m_fd_events.erase(evt_ctx.fd);
+            if (epoll_ctl(m_epollfd, EPOLL_CTL_DEL, evt_ctx.fd, nullptr) < 0) {
                 throw std::system_error { errno, std::system_category(), "delete fd from epoll failed" };
             }
-            (std::unique_ptr<event_context_t> { evt_ctx })->task_state->set_value();
+            cppl::trace::record(cppl::trace::phase_t::async_end, evt_ctx.name, evt_ctx.task_state.get(), evt_ctx.fd);
+            evt_ctx.task_state->set_value();
+        }
+
+        if (timer_fired) {
+            process_timers();
         }
     }
 
     int m_epollfd {};
-};
\ No newline at end of file
+    int m_timerfd {};
+    uint64_t m_last_event_id { TIMER_EVENT_ID };
+    std::unordered_map<uint64_t, event_context_t> m_events {};
+    std::unordered_map<int, uint64_t> m_fd_events {};
+    std::chrono::steady_clock::time_point m_epoch { std::chrono::steady_clock::now() };
+    timer_wheel_t m_timer_wheel {};
+    uint64_t m_armed_tick {};
+};
+
+// Completes after the given duration without blocking the message queue.
+export task_t<void> sleep_for(std::chrono::milliseconds duration)
+{
+    auto task_state = std::make_shared<task_state_t<void>>();
+    message_queue_t::current().add_timer(duration, [task_state] { task_state->set_value(); });
+    return task_state;
+}
+
+// Shared between with_deadline() and the timer that enforces it.
+template <typename T>
+struct deadline_state_t {
+    std::shared_ptr<task_state_t<T>> result { std::make_shared<task_state_t<T>>() };
+    bool done {};
+    uint64_t timer {};
+};
+
+template <typename T>
+std::shared_ptr<deadline_state_t<T>> start_deadline(std::chrono::milliseconds timeout, int fd)
+{
+    auto& queue = message_queue_t::current();
+    auto state = std::make_shared<deadline_state_t<T>>();
+    state->timer = queue.add_timer(timeout, [state, fd, &queue] {
+        if (state->done) {
+            return;
+        }
+        state->done = true;
+
+        auto error = std::make_exception_ptr(timeout_error { "operation timed out" });
+        // Unwind the operation before its awaiter can release what the operation still uses.
+        if (fd >= 0) {
+            queue.cancel(fd, error);
+        }
+        state->result->set_exception(error);
+    });
+    return state;
+}
+
+// Completes like `task`, or throws timeout_error once `timeout` has passed. When `fd` is given,
+// the pending wait on it is cancelled with the same error so the operation itself unwinds;
+// without it the operation is abandoned and must not outlive what it references.
+export template <typename T>
+task_t<T> with_deadline(task_t<T> task, std::chrono::milliseconds timeout, int fd = -1)
+{
+    auto state = start_deadline<T>(timeout, fd);
+    [](task_t<T> task, std::shared_ptr<deadline_state_t<T>> state) -> task_t<void> {
+        std::optional<T> value {};
+        std::exception_ptr error {};
+        try {
+            value.emplace(co_await task);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        if (state->done) {
+            co_return;
+        }
+        state->done = true;
+        message_queue_t::current().cancel_timer(state->timer);
+        if (error) {
+            state->result->set_exception(error);
+        } else {
+            state->result->set_value(std::move(*value));
+        }
+    }(std::move(task), state);
+    return state->result;
+}
+
+export task_t<void> with_deadline(task_t<void> task, std::chrono::milliseconds timeout, int fd = -1)
+{
+    auto state = start_deadline<void>(timeout, fd);
+    [](task_t<void> task, std::shared_ptr<deadline_state_t<void>> state) -> task_t<void> {
+        std::exception_ptr error {};
+        try {
+            co_await task;
+        } catch (...) {
+            error = std::current_exception();
+        }
+        if (state->done) {
+            co_return;
+        }
+        state->done = true;
+        message_queue_t::current().cancel_timer(state->timer);
+        if (error) {
+            state->result->set_exception(error);
+        } else {
+            state->result->set_value();
+        }
+    }(std::move(task), state);
+    return state->result;
+}
\ No newline at end of file
@@ -0,0 +1,164 @@
+module;
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <regex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <yaml-cpp/yaml.h>
+
+export module metadata;
+import codec;
+import string_utils;
+import tree_hash;
+
+// The file list of a .slp package.
+export struct Metadata {
+    // An independently compressed piece of a file in a v2 package.
+    struct Block {
+        // Of the compressed bytes, from the start of the file's data.
+        uint64_t offset {};
+        size_t compressed_size {};
+        size_t size {};
+        // CRC32 of the compressed bytes.
+        uint32_t crc32 {};
+    };
+
+    struct File {
+        std::string md5 {};
+        int mode {};
+        // Compressed size.
+        uint64_t size {};
+        std::string filepath {};
+        // From the block index of a v2 package, empty for v1 where the file is a single stream.
+        std::vector<Block> blocks {};
+        codec_t codec { codec_t::xz };
+        // Checked instead of the md5 when the package carries one.
+        tree_digest_t digest {};
+    };
+
+    std::vector<File> files {};
+};
+
+static int parse_string_permission(std::string_view permission)
+{
+    if (permission.size() != 9) {
+        throw std::runtime_error { std::format("bad permission string: {}", permission) };
+    }
+
+    int mode {};
+    for (int i = 0; i < 3; ++i) {
+        mode <<= 1;
+        if (auto c = permission[i * 3]; c == 'r') {
+            mode |= 1;
+        } else if (c != '-') {
+            throw std::runtime_error { std::format("bad permission string: {}", permission) };
+        }
+        mode <<= 1;
+        if (auto c = permission[i * 3 + 1]; c == 'w') {
+            mode |= 1;
+        } else if (c != '-') {
+            throw std::runtime_error { std::format("bad permission string: {}", permission) };
+        }
+        mode <<= 1;
+        if (auto c = permission[i * 3 + 2]; c == 'x') {
+            mode |= 1;
+        } else if (c != '-') {
+            throw std::runtime_error { std::format("bad permission string: {}", permission) };
+        }
+    }
+    return mode;
+}
+
+static tree_digest_t parse_tree_digest(const YAML::Node& node, std::string_view filepath)
+{
+    auto bad = [&] { return std::runtime_error { std::format("Bad digest of {}", filepath) }; };
+    auto digest = tree_digest_t { .chunk_size = node["chunk_size"].as<size_t>() };
+    auto root = parse_digest(node["blake3"].as<std::string>());
+    if (!digest.chunk_size || !root) {
+        throw bad();
+    }
+    digest.root = *root;
+    for (const auto& chunk : node["chunks"]) {
+        auto chunk_digest = parse_digest(chunk.as<std::string>());
+        if (!chunk_digest) {
+            throw bad();
+        }
+        digest.chunks.push_back(*chunk_digest);
+    }
+    return digest;
+}
+
+// True for an MD5 as the metadata lists it, 32 lowercase hex digits.
+export bool is_md5(std::string_view md5)
+{
+    return md5.size() == 32 && std::all_of(md5.begin(), md5.end(), [](char c) { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); });
+}
+
+// True for a relative path that stays inside the directory it is joined to: not absolute, no
+// ".." component and something left after lexically_normal(). File paths come from the server
+// and names from the user, neither may write outside the app's directory.
+export bool is_contained_path(std::string_view path)
+{
+    auto original = std::filesystem::path { path };
+    if (original.has_root_path() || std::find(original.begin(), original.end(), "..") != original.end()) {
+        return false;
+    }
+    auto normal = original.lexically_normal();
+    return !normal.empty() && normal != "." && *normal.begin() != "..";
+}
+
+// Parses the decompressed metadata document. A file is listed as
+//     MD5 -PERMISSIONS SIZE [CODEC] PATH
+// where the optional codec defaults to xz. Files may also have a tree digest:
+//     digests:
+//       PATH: { blake3: ROOT, chunk_size: BYTES, chunks: [DIGEST, ...] }
+export Metadata parse_metadata(std::string_view yaml)
+{
+    Metadata metadata {};
+    auto doc = YAML::Load(std::string { yaml });
+    const auto& files = doc["files"];
+    auto file_regex = std::regex { R"(^([0-9a-f]+)\s+-(([rwx-]{3}){3})\s+(\d+)\s+(?:\[(\w+)\]\s+)?([^\r\n]+)$)" };
+    for (const auto& file : files) {
+        auto line = file.as<std::string>();
+        auto res = std::smatch {};
+        if (!std::regex_match(line, res, file_regex)) {
+            throw std::runtime_error { std::format("Bad file item: {}", line) };
+        }
+        auto codec = res[5].matched ? parse_codec(res[5].str()) : codec_t::xz;
+        if (!codec) {
+            throw std::runtime_error { std::format("Unknown codec: {}", line) };
+        }
+        if (!is_md5(res[1].str())) {
+            throw std::runtime_error { std::format("Bad md5: {}", line) };
+        }
+        auto size = parse_u64(res[4].str());
+        if (!size) {
+            throw std::runtime_error { std::format("Bad file size: {}", line) };
+        }
+        if (!is_contained_path(res[6].str())) {
+            throw std::runtime_error { std::format("Bad file path: {}", line) };
+        }
+        metadata.files.push_back({
+            .md5 = res[1].str(),
+            .mode = parse_string_permission(res[2].str()),
+            .size = *size,
+            .filepath = std::move(res[6].str()),
+            .codec = *codec,
+        });
+    }
+
+    for (const auto& digest : doc["digests"]) {
+        auto filepath = digest.first.as<std::string>();
+        auto file = std::find_if(metadata.files.begin(), metadata.files.end(), [&](const auto& file) { return file.filepath == filepath; });
+        if (file == metadata.files.end()) {
+            throw std::runtime_error { std::format("Digest of unknown file: {}", filepath) };
+        }
+        file->digest = parse_tree_digest(digest.second, filepath);
+    }
+    return metadata;
+}
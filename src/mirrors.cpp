@@ -0,0 +1,396 @@
+module;
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <yaml-cpp/yaml.h>
+
+export module mirrors;
+import consts;
+import cppl;
+import http_client;
+import log;
+import message_queue;
+import read_stream;
+import stats;
+import string_utils;
+
+using cppl::task_state_t;
+using cppl::task_t;
+using namespace std::chrono_literals;
+
+// Weight of the newest sample in the moving averages.
+constexpr double EWMA_ALPHA = 0.3;
+// Recent time-to-first-byte samples kept per mirror for the hedging percentile.
+constexpr size_t TTFB_WINDOW = 32;
+// Hedge once a request is slower than this percentile of the mirror's recent requests.
+constexpr double HEDGE_PERCENTILE = 0.95;
+// Until a mirror has enough samples its percentile is meaningless.
+constexpr size_t HEDGE_MIN_SAMPLES = 8;
+constexpr auto HEDGE_DEFAULT_DELAY = 1000ms;
+constexpr auto HEDGE_MIN_DELAY = 50ms;
+// Each consecutive failure ranks a mirror as if it were this much slower.
+constexpr double FAILURE_PENALTY_MS = 5000;
+// Ranking estimates the time to fetch this many bytes.
+constexpr double REFERENCE_TRANSFER_BYTES = 1 << 20;
+
+export struct mirror_t {
+    std::string base_url {};
+    // Moving averages, zero until the first sample.
+    double ttfb_ms {};
+    double throughput {};
+    int failures {};
+    std::vector<double> ttfb_samples {};
+
+    double score() const
+    {
+        auto score = ttfb_ms + failures * FAILURE_PENALTY_MS;
+        if (throughput > 0) {
+            score += REFERENCE_TRANSFER_BYTES / throughput * 1000;
+        }
+        return score;
+    }
+
+    std::chrono::milliseconds hedge_delay() const
+    {
+        if (ttfb_samples.size() < HEDGE_MIN_SAMPLES) {
+            return HEDGE_DEFAULT_DELAY;
+        }
+        auto sorted = ttfb_samples;
+        std::sort(sorted.begin(), sorted.end());
+        auto p = sorted[std::min(sorted.size() - 1, (size_t)(sorted.size() * HEDGE_PERCENTILE))];
+        return std::max(std::chrono::milliseconds { (int64_t)p }, std::chrono::milliseconds { HEDGE_MIN_DELAY });
+    }
+};
+
+static double ewma(double average, double sample)
+{
+    return average ? average * (1 - EWMA_ALPHA) + sample * EWMA_ALPHA : sample;
+}
+
+static std::optional<std::filesystem::path> staticlinux_path()
+{
+    auto home = getenv("HOME");
+    if (!home) {
+        return std::nullopt;
+    }
+    return std::filesystem::path { home } / ".staticlinux";
+}
+
+// Mirror URLs from $APP_MIRRORS (separated by commas or spaces), else ~/.staticlinux/mirrors
+// (one per line), else the official site.
+static std::vector<std::string> load_mirror_urls()
+{
+    std::vector<std::string> urls;
+    auto add = [&](std::string url) {
+        url = trim(url);
+        while (url.ends_with('/')) {
+            url.pop_back();
+        }
+        if (!url.empty() && !url.starts_with('#') && std::find(urls.begin(), urls.end(), url) == urls.end()) {
+            urls.push_back(std::move(url));
+        }
+    };
+
+    if (auto env = getenv("APP_MIRRORS"); env && *env) {
+        std::string list { env };
+        std::replace(list.begin(), list.end(), ',', ' ');
+        std::istringstream words { list };
+        std::string url;
+        while (words >> url) {
+            add(url);
+        }
+    } else if (auto path = staticlinux_path()) {
+        std::ifstream file { *path / "mirrors" };
+        std::string line;
+        while (std::getline(file, line)) {
+            add(line);
+        }
+    }
+
+    if (urls.empty()) {
+        urls.push_back(APP_DOWNLOAD_BASE_LINK);
+    }
+    return urls;
+}
+
+export class mirror_list_t {
+public:
+    static mirror_list_t& current()
+    {
+        static thread_local mirror_list_t s_current {};
+        return s_current;
+    }
+
+    mirror_list_t()
+    {
+        for (auto& url : load_mirror_urls()) {
+            m_mirrors.push_back({ .base_url = std::move(url) });
+        }
+        load_stats();
+    }
+
+    // Mirrors from the most to the least promising. Mirrors without samples keep their configured
+    // order and go first, so each one gets measured.
+    std::vector<mirror_t*> ranked()
+    {
+        std::vector<mirror_t*> ranked;
+        for (auto& mirror : m_mirrors) {
+            ranked.push_back(&mirror);
+        }
+        std::stable_sort(ranked.begin(), ranked.end(), [](auto a, auto b) { return a->score() < b->score(); });
+        return ranked;
+    }
+
+    // Drops a mirror for the rest of the run. Invalidates the pointers ranked() returned, call it
+    // before any request is made.
+    void remove(std::string_view base_url)
+    {
+        std::erase_if(m_mirrors, [&](const auto& mirror) { return mirror.base_url == base_url; });
+    }
+
+    void record_ttfb(mirror_t& mirror, std::chrono::milliseconds ttfb)
+    {
+        mirror.failures = 0;
+        record_slow_ttfb(mirror, ttfb);
+    }
+
+    // A request that lost a hedge race: its real time-to-first-byte is at least `elapsed`. Without
+    // it a mirror that got slow would keep its old rank while always being out-raced.
+    void record_slow_ttfb(mirror_t& mirror, std::chrono::milliseconds elapsed)
+    {
+        mirror.ttfb_ms = ewma(mirror.ttfb_ms, elapsed.count());
+        mirror.ttfb_samples.push_back(elapsed.count());
+        if (mirror.ttfb_samples.size() > TTFB_WINDOW) {
+            mirror.ttfb_samples.erase(mirror.ttfb_samples.begin());
+        }
+        m_dirty = true;
+    }
+
+    void record_transfer(mirror_t& mirror, uint64_t bytes, std::chrono::milliseconds duration)
+    {
+        // Small bodies are dominated by latency and say nothing about bandwidth.
+        if (bytes < 64 * 1024 || duration.count() <= 0) {
+            return;
+        }
+        mirror.throughput = ewma(mirror.throughput, bytes * 1000.0 / duration.count());
+        m_dirty = true;
+    }
+
+    void record_failure(mirror_t& mirror)
+    {
+        ++mirror.failures;
+        m_dirty = true;
+    }
+
+    // Persists the scores to ~/.staticlinux/mirror-stats.yaml for the next run.
+    void save()
+    {
+        auto path = staticlinux_path();
+        if (!m_dirty || !path) {
+            return;
+        }
+
+        YAML::Node root;
+        for (const auto& mirror : m_mirrors) {
+            YAML::Node node;
+            node["url"] = mirror.base_url;
+            node["ttfb_ms"] = mirror.ttfb_ms;
+            node["throughput"] = mirror.throughput;
+            node["failures"] = mirror.failures;
+            for (auto sample : mirror.ttfb_samples) {
+                node["ttfb_samples"].push_back(sample);
+            }
+            root["mirrors"].push_back(node);
+        }
+
+        std::error_code ec;
+        std::filesystem::create_directories(*path, ec);
+        auto tmp = *path / "mirror-stats.yaml.tmp";
+        {
+            std::ofstream file { tmp };
+            file << YAML::Dump(root) << "\n";
+            if (!file) {
+                warning("Can't save mirror stats to {}", tmp.string());
+                return;
+            }
+        }
+        std::filesystem::rename(tmp, *path / "mirror-stats.yaml", ec);
+        if (ec) {
+            warning("Can't save mirror stats to {}: {}", (*path / "mirror-stats.yaml").string(), ec.message());
+            std::filesystem::remove(tmp, ec);
+            return;
+        }
+        m_dirty = false;
+    }
+
+private:
+    void load_stats()
+    {
+        auto path = staticlinux_path();
+        if (!path || !std::filesystem::exists(*path / "mirror-stats.yaml")) {
+            return;
+        }
+
+        try {
+            auto doc = YAML::LoadFile((*path / "mirror-stats.yaml").string());
+            for (const auto& node : doc["mirrors"]) {
+                auto url = node["url"].as<std::string>();
+                auto it = std::find_if(m_mirrors.begin(), m_mirrors.end(), [&](const auto& m) { return m.base_url == url; });
+                if (it == m_mirrors.end()) {
+                    continue;
+                }
+                it->ttfb_ms = node["ttfb_ms"].as<double>(0);
+                it->throughput = node["throughput"].as<double>(0);
+                it->failures = node["failures"].as<int>(0);
+                for (const auto& sample : node["ttfb_samples"]) {
+                    it->ttfb_samples.push_back(sample.as<double>());
+                }
+            }
+        } catch (const std::exception& ex) {
+            // Stats are only a hint, start over if they're damaged.
+            debug("Ignore mirror stats: {}", ex.what());
+        }
+    }
+
+    std::vector<mirror_t> m_mirrors {};
+    bool m_dirty {};
+};
+
+export struct hedged_response_t {
+    std::unordered_multimap<std::string, std::string> headers {};
+    read_stream_t read_stream;
+    mirror_t* mirror {};
+};
+
+// Shared between hedged_get_header_async() and its attempts.
+struct hedge_race_t {
+    std::optional<hedged_response_t> winner {};
+    std::exception_ptr last_error {};
+    size_t pending {};
+    size_t settled {};
+    // fd of each attempt while it waits for the response, -1 otherwise.
+    std::vector<int> fds {};
+    std::shared_ptr<task_state_t<void>> wake {};
+
+    void notify()
+    {
+        if (auto w = std::move(wake)) {
+            w->set_value();
+        }
+    }
+};
+
+static task_t<void> hedge_attempt_async(size_t index, mirror_t* mirror, std::string path, std::unordered_multimap<std::string, std::string> headers, std::shared_ptr<hedge_race_t> race)
+{
+    auto& mirrors = mirror_list_t::current();
+    auto url = mirror->base_url + path;
+    auto start = std::chrono::steady_clock::now();
+    try {
+        auto read_stream = co_await http_connect_async(url);
+        if (!race->winner) {
+            race->fds[index] = read_stream.native_handle();
+            auto [response_headers, response_stream] = co_await http_get_header_async(std::move(read_stream), url, std::move(headers));
+            race->fds[index] = -1;
+
+            auto ttfb = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+            mirrors.record_ttfb(*mirror, ttfb);
+            if (!race->winner) {
+                debug("{} answered in {}ms", mirror->base_url, ttfb.count());
+                race->winner.emplace(std::move(response_headers), std::move(response_stream), mirror);
+
+                // Cancel the other attempts that are waiting for their response.
+                for (size_t i = 0; i < race->fds.size(); ++i) {
+                    if (auto fd = std::exchange(race->fds[i], -1); fd >= 0) {
+                        message_queue_t::current().cancel(fd, std::make_exception_ptr(std::runtime_error { "lost the hedge race" }));
+                    }
+                }
+            }
+        }
+    } catch (...) {
+        race->fds[index] = -1;
+        // Losing the race is not the mirror's fault, but it was slower than the winner.
+        if (race->winner) {
+            mirrors.record_slow_ttfb(*mirror, std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start));
+        } else {
+            mirrors.record_failure(*mirror);
+            stats_t::current().count("mirror_failures");
+            race->last_error = std::current_exception();
+        }
+    }
+    --race->pending;
+    ++race->settled;
+    race->notify();
+}
+
+// GETs `path` from the best ranked mirror. When the response header takes longer than the
+// mirror's usual time-to-first-byte percentile, the same request is also sent to the next best
+// mirror; the first response wins and the others are cancelled. A failed attempt moves on to
+// the next mirror right away.
+export task_t<hedged_response_t> hedged_get_header_async(std::string path, std::unordered_multimap<std::string, std::string> headers)
+{
+    auto ranked = mirror_list_t::current().ranked();
+    auto race = std::make_shared<hedge_race_t>();
+    race->fds.resize(ranked.size(), -1);
+
+    for (size_t i = 0; i < ranked.size() && !race->winner; ++i) {
+        auto settled = race->settled;
+        ++race->pending;
+        hedge_attempt_async(i, ranked[i], path, headers, race);
+
+        if (i + 1 < ranked.size() && !race->winner && race->settled == settled) {
+            auto wake = race->wake = std::make_shared<task_state_t<void>>();
+            auto timer = message_queue_t::current().add_timer(ranked[i]->hedge_delay(), [race, wake] {
+                if (race->wake == wake) {
+                    race->notify();
+                }
+            });
+            co_await task_t<void> { wake };
+            message_queue_t::current().cancel_timer(timer);
+
+            if (!race->winner && race->settled == settled) {
+                debug("{} is slow, hedging with {}", ranked[i]->base_url, ranked[i + 1]->base_url);
+                stats_t::current().count("hedges");
+            } else if (!race->winner) {
+                stats_t::current().count("retries");
+            }
+        }
+    }
+
+    while (!race->winner && race->pending) {
+        auto wake = race->wake = std::make_shared<task_state_t<void>>();
+        co_await task_t<void> { wake };
+    }
+
+    if (race->winner) {
+        co_return std::move(*race->winner);
+    } else if (race->last_error) {
+        std::rethrow_exception(race->last_error);
+    }
+    throw std::runtime_error { "no mirror configured" };
+}
+
+// Hedged GET of a whole body, the transfer also feeds the winner's throughput score.
+export task_t<std::vector<uint8_t>> hedged_get_async(std::string path, std::unordered_multimap<std::string, std::string> headers)
+{
+    auto response = co_await hedged_get_header_async(std::move(path), std::move(headers));
+    auto start = std::chrono::steady_clock::now();
+    auto timer = stage_timer_t { "body_transfer" };
+    auto body = co_await response.read_stream.read_async(http_content_length(response.headers));
+    timer.add_bytes(body.size());
+    timer.stop();
+    mirror_list_t::current().record_transfer(*response.mirror, body.size(), std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start));
+    http_release_connection(response.mirror->base_url, std::move(response.read_stream), response.headers);
+    co_return body;
+}
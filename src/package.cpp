@@ -0,0 +1,962 @@
+module;
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unordered_map>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+export module package;
+import codec;
+import cppl;
+import log;
+import lzma;
+import md5;
+import metadata;
+import mirrors;
+import read_stream;
+import stats;
+import tree_hash;
+import worker_pool;
+
+using cppl::task_t;
+
+// Package layouts, told apart by the byte after "\xF1SLP".
+//
+// v1: magic, metadata length in the upper 24 bits of a uint32_t, xz metadata padded to 256 bytes,
+//     then one xz stream per file.
+// v2: a 32 byte header
+//         char     magic[8]        "\xF1SLP\x02" and 3 zero bytes
+//         uint64_t metadata_size
+//         uint64_t index_size
+//         uint32_t block_size      uncompressed bytes per block, the last one may be shorter
+//         uint32_t reserved
+//     xz metadata, the block index, then the files back to back, each split into blocks that are
+//     independent xz streams. Every block has a 24 byte index entry
+//         uint64_t offset          from the start of the package
+//         uint32_t compressed_size
+//         uint32_t size
+//         uint32_t file            index in the metadata file list
+//         uint32_t crc32           of the compressed bytes
+//     in file order. All integers are little endian.
+export constexpr size_t PACKAGE_HEADER_LEN = 8;
+export constexpr size_t PACKAGE_V2_HEADER_LEN = 32;
+export constexpr size_t PACKAGE_V2_BLOCK_ENTRY_LEN = 24;
+
+// Larger metadata or block indexes come from a damaged or hostile header, they aren't allocated.
+constexpr uint64_t PACKAGE_MAX_METADATA_LEN = 64 << 20;
+constexpr uint64_t PACKAGE_MAX_INDEX_LEN = 256 << 20;
+// Blocks are decoded whole on a worker, larger ones would defeat the point of splitting files.
+constexpr uint32_t PACKAGE_MAX_BLOCK_SIZE = 64 << 20;
+
+// Path of a package on the mirrors.
+export std::string package_download_path(std::string_view name, std::string_view version)
+{
+    auto arch = sizeof(void*) == 4 ? "x86" : "amd64";
+    return std::format("/{0}/{1}/{2}/{0}-{1}-{2}.slp", name, version, arch);
+}
+
+// The file list of a package and where the compressed bytes of each file start in it.
+export struct package_index_t {
+    std::string download_path {};
+    Metadata metadata {};
+    std::vector<uint64_t> offsets {};
+    mirror_t* mirror {};
+    int format_version { 1 };
+
+    // Returns the index of `filepath` in metadata.files, or -1.
+    int find(std::string_view filepath) const
+    {
+        for (size_t i = 0; i < metadata.files.size(); ++i) {
+            if (metadata.files[i].filepath == filepath) {
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+};
+
+static task_t<Metadata> read_metadata_async(read_stream_t& read_stream, size_t metadata_file_len)
+{
+    trace("Download metadata ...");
+
+    // Read metadata
+    auto download_timer = stage_timer_t { "metadata_download" };
+    auto data = co_await read_stream.read_async(metadata_file_len);
+    download_timer.add_bytes(data.size());
+    download_timer.stop();
+
+    trace("Depress metadata ...");
+    auto decompress_timer = stage_timer_t { "metadata_decompress" };
+    auto rawdata = lzma_decompress(data);
+    decompress_timer.add_bytes(rawdata.size());
+    decompress_timer.stop();
+
+    trace("Parse metadata ...");
+    auto parse_timer = stage_timer_t { "metadata_parse" };
+    auto metadata = parse_metadata(std::string_view { (const char*)rawdata.data(), rawdata.size() });
+    parse_timer.stop();
+    co_return metadata;
+}
+
+template <typename T>
+static T read_le(const uint8_t* p)
+{
+    T value {};
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Checks the parts of a v2 header that aren't sizes: the zero bytes after the magic and the block
+// size. Returns the block size.
+static uint32_t check_v2_header(std::span<const uint8_t> header, std::string_view download_path)
+{
+    auto block_size = read_le<uint32_t>(&header[24]);
+    if (header[5] || header[6] || header[7] || !block_size || block_size > PACKAGE_MAX_BLOCK_SIZE) {
+        throw std::runtime_error { std::format("Invalid package header: {}", download_path) };
+    }
+    return block_size;
+}
+
+// Attaches the v2 block index to the files and sets their offsets. The blocks of each file must
+// follow each other, the files must follow the index in metadata order, and no block may decode
+// to more than `block_size` bytes.
+static void apply_block_index(package_index_t& index, std::span<const uint8_t> entries, uint64_t body_offset, uint32_t block_size)
+{
+    if (entries.size() % PACKAGE_V2_BLOCK_ENTRY_LEN) {
+        throw std::runtime_error { std::format("Invalid block index: {}", index.download_path) };
+    }
+
+    auto& files = index.metadata.files;
+    auto expected = body_offset;
+    size_t last_file {};
+    for (size_t at = 0; at < entries.size(); at += PACKAGE_V2_BLOCK_ENTRY_LEN) {
+        auto offset = read_le<uint64_t>(&entries[at]);
+        auto file = read_le<uint32_t>(&entries[at + 16]);
+        if (file < last_file || file >= files.size() || offset != expected) {
+            throw std::runtime_error { std::format("Invalid block index: {}", index.download_path) };
+        }
+        last_file = file;
+
+        auto& blocks = files[file].blocks;
+        blocks.push_back({
+            .offset = blocks.empty() ? 0 : blocks.back().offset + blocks.back().compressed_size,
+            .compressed_size = read_le<uint32_t>(&entries[at + 8]),
+            .size = read_le<uint32_t>(&entries[at + 12]),
+            .crc32 = read_le<uint32_t>(&entries[at + 20]),
+        });
+        if (blocks.back().size > block_size) {
+            throw std::runtime_error { std::format("Invalid block index: {}", index.download_path) };
+        }
+        expected += blocks.back().compressed_size;
+    }
+
+    // Files without blocks are empty.
+    auto offset = body_offset;
+    for (const auto& file : files) {
+        auto size = file.blocks.empty() ? 0 : file.blocks.back().offset + file.blocks.back().compressed_size;
+        if (size != file.size) {
+            throw std::runtime_error { std::format("Block index of {} doesn't match its size", file.filepath) };
+        }
+        index.offsets.push_back(offset);
+        offset += size;
+    }
+}
+
+// A package response read up to the end of its metadata, the files follow in the stream.
+export struct package_stream_t {
+    package_index_t index {};
+    read_stream_t read_stream;
+};
+
+// GETs a whole package from the best mirror and reads its header and metadata.
+export task_t<package_stream_t> open_package_async(std::string name, std::string version)
+{
+    auto index = package_index_t { .download_path = package_download_path(name, version) };
+    auto [header, read_stream, mirror] = co_await hedged_get_header_async(index.download_path, {});
+    index.mirror = mirror;
+
+    // Read package file header
+    auto package_file_header = co_await read_stream.read_async(PACKAGE_HEADER_LEN);
+
+    // Verify magic number, the next byte is the format version.
+    if (memcmp(package_file_header.data(), "\xF1SLP", 4) || (package_file_header[4] != 0x00 && package_file_header[4] != 0x02)) {
+        throw std::runtime_error { std::format("Invalid package file: {}", index.download_path) };
+    }
+
+    if (package_file_header[4] == 0x02) {
+        index.format_version = 2;
+        auto rest = co_await read_stream.read_async(PACKAGE_V2_HEADER_LEN - PACKAGE_HEADER_LEN);
+        auto header = package_file_header;
+        header.insert(header.end(), rest.begin(), rest.end());
+        auto block_size = check_v2_header(header, index.download_path);
+        auto metadata_size = read_le<uint64_t>(&header[8]);
+        auto index_size = read_le<uint64_t>(&header[16]);
+        if (metadata_size > PACKAGE_MAX_METADATA_LEN || index_size > PACKAGE_MAX_INDEX_LEN) {
+            throw std::runtime_error { std::format("Invalid package header: {}", index.download_path) };
+        }
+        index.metadata = co_await read_metadata_async(read_stream, metadata_size);
+
+        auto timer = stage_timer_t { "block_index" };
+        auto entries = co_await read_stream.read_async(index_size);
+        apply_block_index(index, entries, PACKAGE_V2_HEADER_LEN + metadata_size + index_size, block_size);
+        timer.add_bytes(entries.size());
+        timer.stop();
+        co_return package_stream_t { std::move(index), std::move(read_stream) };
+    }
+
+    // Get metadata file length
+    uint64_t metadata_file_len = read_le<uint32_t>(package_file_header.data() + 4) & ~0xffu;
+    if (metadata_file_len > PACKAGE_MAX_METADATA_LEN) {
+        throw std::runtime_error { std::format("Invalid package header: {}", index.download_path) };
+    }
+    index.metadata = co_await read_metadata_async(read_stream, metadata_file_len);
+
+    uint64_t offset = PACKAGE_HEADER_LEN + metadata_file_len;
+    for (const auto& file : index.metadata.files) {
+        index.offsets.push_back(offset);
+        offset += file.size;
+    }
+    co_return package_stream_t { std::move(index), std::move(read_stream) };
+}
+
+// Indexes fetched by this process. A published package version never changes, so the daemon
+// answers repeated pulls of a package without fetching its metadata again.
+constexpr size_t INDEX_CACHE_SIZE = 64;
+
+static std::unordered_map<std::string, package_index_t>& index_cache()
+{
+    static thread_local std::unordered_map<std::string, package_index_t> s_cache {};
+    return s_cache;
+}
+
+// Reads the header and the metadata of a package, the rest of the response is dropped with the
+// connection.
+export task_t<package_index_t> fetch_package_index_async(std::string name, std::string version)
+{
+    auto& cache = index_cache();
+    if (auto it = cache.find(package_download_path(name, version)); it != cache.end()) {
+        trace("Metadata of {}:{} is cached", name, version);
+        co_return it->second;
+    }
+
+    auto package = co_await open_package_async(std::move(name), std::move(version));
+    if (cache.size() >= INDEX_CACHE_SIZE) {
+        cache.clear();
+    }
+    cache.emplace(package.index.download_path, package.index);
+    co_return std::move(package.index);
+}
+
+// ~/.staticlinux
+export std::filesystem::path staticlinux_home()
+{
+    auto home = getenv("HOME");
+    if (!home) {
+        throw std::runtime_error { "Can't get HOME environment variable" };
+    }
+    return std::filesystem::path { home } / ".staticlinux";
+}
+
+// Where an app file of package `name` is installed.
+export std::filesystem::path installed_file_path(std::string_view name, std::string_view filepath)
+{
+    return staticlinux_home() / name / filepath;
+}
+
+// MD5 of a local file, nothing when it can't be read. The file is mapped rather than read, so
+// hashing many files costs no copies and the page cache does the read-ahead.
+export std::optional<std::string> file_md5(const std::filesystem::path& path)
+{
+    auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+    struct stat st {};
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return std::nullopt;
+    }
+    if (!st.st_size) {
+        close(fd);
+        return md5_string({});
+    }
+    auto addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return std::nullopt;
+    }
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+    auto md5 = md5_string({ (uint8_t*)addr, (size_t)st.st_size });
+    munmap(addr, st.st_size);
+    return md5;
+}
+
+// An app file written aside and renamed over `path` on commit(), so another process never sees it
+// half written, and a running executable is replaced rather than overwritten. Dropped before
+// commit(), the partial file is removed.
+class app_file_writer_t {
+public:
+    app_file_writer_t(std::filesystem::path path, int mode)
+        : m_path { std::move(path) }
+        , m_mode { mode }
+    {
+        // Workers write files of the same directory concurrently, one of them creates it.
+        auto dir = m_path.parent_path();
+        auto ec = std::error_code {};
+        if (std::filesystem::create_directories(dir, ec); ec) {
+            throw std::runtime_error { std::format("Can't create path: {}", dir.string()) };
+        }
+
+        static std::atomic<uint32_t> s_serial {};
+        m_tmp = m_path;
+        m_tmp += std::format(".{}.{}.tmp", getpid(), s_serial++);
+        m_fp = fopen(m_tmp.c_str(), "wbxe");
+        if (!m_fp) {
+            throw std::runtime_error { std::format("Can't write file: {}", m_tmp.string()) };
+        }
+    }
+
+    app_file_writer_t(const app_file_writer_t&) = delete;
+
+    ~app_file_writer_t()
+    {
+        if (m_fp) {
+            fclose(m_fp);
+            auto ec = std::error_code {};
+            std::filesystem::remove(m_tmp, ec);
+        }
+    }
+
+    app_file_writer_t& operator=(const app_file_writer_t&) = delete;
+
+    void write(std::span<const uint8_t> data)
+    {
+        if (!data.empty() && fwrite(data.data(), data.size(), 1, m_fp) < 1) {
+            throw std::runtime_error { std::format("Write file '{}' failed", m_path.string()) };
+        }
+    }
+
+    void commit()
+    {
+        // change mode
+        if (fchmod(fileno(m_fp), m_mode) < 0) {
+            throw std::system_error { errno, std::system_category(), "chmod failed" };
+        }
+        // On disk before the rename, so a crash leaves the old file or the new one, never an
+        // empty file in its place.
+        if (fflush(m_fp) != 0 || fsync(fileno(m_fp)) < 0) {
+            throw std::runtime_error { std::format("Write file '{}' failed", m_path.string()) };
+        }
+        auto ret = fclose(std::exchange(m_fp, nullptr));
+        auto ec = std::error_code {};
+        if (ret != 0) {
+            std::filesystem::remove(m_tmp, ec);
+            throw std::runtime_error { std::format("Write file '{}' failed", m_path.string()) };
+        }
+        std::filesystem::rename(m_tmp, m_path, ec);
+        if (ec) {
+            std::filesystem::remove(m_tmp, ec);
+            throw std::runtime_error { std::format("Write file '{}' failed", m_path.string()) };
+        }
+    }
+
+private:
+    std::filesystem::path m_path {};
+    std::filesystem::path m_tmp {};
+    int m_mode {};
+    FILE* m_fp {};
+};
+
+// Writes an app file to `path` with the mode from the metadata, see app_file_writer_t.
+export void write_app_file(const std::filesystem::path& path, const Metadata::File& file, std::span<const uint8_t> data)
+{
+    auto writer = app_file_writer_t { path, file.mode };
+    writer.write(data);
+    writer.commit();
+}
+
+// A stand-in for an executable that isn't downloaded yet, left in ~/.staticlinux/bin by
+// `app pull --lazy`. It is a shell script that runs `app exec-stub` on itself; the package, version,
+// path and MD5 of the real file are on its marker line.
+export struct lazy_stub_t {
+    std::string name {};
+    std::string version {};
+    std::string filepath {};
+    std::string md5 {};
+};
+
+constexpr std::string_view LAZY_STUB_MARKER = "# app lazy stub: ";
+
+// ~/.staticlinux/bin/LINK for an executable of a package.
+static std::filesystem::path bin_link_path(const Metadata::File& file)
+{
+    // Another process may create it at the same time.
+    auto binpath = staticlinux_home() / "bin";
+    auto ec = std::error_code {};
+    if (std::filesystem::create_directories(binpath, ec); ec) {
+        throw std::runtime_error { std::format("Can't create path: {}", binpath.string()) };
+    }
+    return binpath / std::filesystem::path { file.filepath }.filename();
+}
+
+// The stub `path` stands in for, nothing when it isn't one.
+export std::optional<lazy_stub_t> read_lazy_stub(const std::filesystem::path& path)
+{
+    auto fp = std::unique_ptr<FILE, decltype(&fclose)> { fopen(path.c_str(), "rbe"), &fclose };
+    if (!fp) {
+        return std::nullopt;
+    }
+    char buffer[4096];
+    auto size = fread(buffer, 1, sizeof(buffer), fp.get());
+    auto text = std::string_view { buffer, size };
+    auto begin = text.find(LAZY_STUB_MARKER);
+    if (!text.starts_with("#!") || begin == std::string_view::npos) {
+        return std::nullopt;
+    }
+    text = text.substr(begin + LAZY_STUB_MARKER.size());
+    text = text.substr(0, text.find('\n'));
+
+    // NAME VERSION PATH MD5, where only the path may have spaces.
+    auto name_end = text.find(' ');
+    auto version_end = text.find(' ', name_end + 1);
+    auto md5_begin = text.rfind(' ');
+    if (name_end == std::string_view::npos || version_end == std::string_view::npos || md5_begin <= version_end) {
+        return std::nullopt;
+    }
+    return lazy_stub_t {
+        .name = std::string { text.substr(0, name_end) },
+        .version = std::string { text.substr(name_end + 1, version_end - name_end - 1) },
+        .filepath = std::string { text.substr(version_end + 1, md5_begin - version_end - 1) },
+        .md5 = std::string { text.substr(md5_begin + 1) },
+    };
+}
+
+// Leaves a stub for an executable in ~/.staticlinux/bin, which runs `app` to install the real file
+// the first time it is executed. Returns the name of the link, empty when the file is installed
+// already.
+export std::string write_lazy_stub(const std::filesystem::path& app, std::string_view name, std::string_view version, const Metadata::File& file)
+{
+    auto link = bin_link_path(file);
+    auto ec = std::error_code {};
+    if (std::filesystem::exists(std::filesystem::symlink_status(link, ec)) && !read_lazy_stub(link)) {
+        return {};
+    }
+
+    auto quoted = std::string { "'" };
+    for (auto c : app.string()) {
+        quoted += c == '\'' ? std::string { "'\\''" } : std::string { c };
+    }
+    quoted += '\'';
+    auto script = std::format("#!/bin/sh\n{}{} {} {} {}\nexec {} exec-stub \"$0\" \"$@\"\n", LAZY_STUB_MARKER, name, version, file.filepath, file.md5, quoted);
+
+    auto tmp = link;
+    tmp += std::format(".stub.{}", getpid());
+    write_app_file(tmp, Metadata::File { .mode = 0755 }, { (const uint8_t*)script.data(), script.size() });
+
+    // A pull of the same file may link it between the check above and here, the stub must not
+    // replace that link. It's put in place only if nothing is there, or swapped with an older
+    // stub and swapped back when what came out isn't one.
+    auto installed = false;
+    if (renameat2(AT_FDCWD, tmp.c_str(), AT_FDCWD, link.c_str(), RENAME_NOREPLACE) < 0) {
+        if (errno != EEXIST) {
+            std::filesystem::remove(tmp, ec);
+            throw std::system_error { errno, std::system_category(), "rename failed" };
+        }
+        if (!read_lazy_stub(link)) {
+            installed = true;
+        } else if (renameat2(AT_FDCWD, tmp.c_str(), AT_FDCWD, link.c_str(), RENAME_EXCHANGE) < 0) {
+            // The file system can't swap, overwrite the stub as before.
+            std::filesystem::rename(tmp, link, ec);
+        } else if (!read_lazy_stub(tmp)) {
+            renameat2(AT_FDCWD, tmp.c_str(), AT_FDCWD, link.c_str(), RENAME_EXCHANGE);
+            installed = true;
+        }
+        std::filesystem::remove(tmp, ec);
+    }
+    return installed ? std::string {} : link.filename().string();
+}
+
+// Links an installed executable into ~/.staticlinux/bin. Returns the name of the link, empty if
+// the file isn't executable.
+export std::string link_app_file(std::string_view name, const Metadata::File& file)
+{
+    if (!(file.mode & 0111)) {
+        return {};
+    }
+    auto path = installed_file_path(name, file.filepath);
+    auto path_str = path.string();
+    auto link = bin_link_path(file);
+    if (symlink(path_str.c_str(), link.c_str()) < 0) {
+        auto error = errno;
+        if (error == EEXIST && read_lazy_stub(link)) {
+            // A lazy stub is replaced in one step, processes running it meanwhile still find
+            // either the stub or the link.
+            auto tmp = link;
+            tmp += std::format(".link.{}", getpid());
+            if (symlink(path_str.c_str(), tmp.c_str()) < 0) {
+                throw std::system_error { errno, std::system_category(), "symlink failed" };
+            }
+            std::filesystem::rename(tmp, link);
+            return link.filename().string();
+        }
+
+        // Reinstalling leaves the link as it was.
+        auto ec = std::error_code {};
+        if (error != EEXIST || std::filesystem::read_symlink(link, ec) != path) {
+            throw std::system_error { error, std::system_category(), "symlink failed" };
+        }
+    }
+    return link.filename().string();
+}
+
+// Writes an app file to ~/.staticlinux/NAME/PATH and links executables into ~/.staticlinux/bin.
+// Returns the name of the link, empty if the file isn't executable.
+export std::string install_file(std::string_view name, const Metadata::File& file, std::span<const uint8_t> data)
+{
+    write_app_file(installed_file_path(name, file.filepath), file, data);
+    return link_app_file(name, file);
+}
+
+// Time spent in each step of decode_and_install(), for stats_t.
+export struct decoded_file_t {
+    std::chrono::steady_clock::duration decompress {};
+    std::chrono::steady_clock::duration verify {};
+    std::chrono::steady_clock::duration write {};
+    // "md5" or "blake3", the stage the verification is reported as.
+    const char* verify_stage { "md5" };
+    size_t size {};
+    std::string link {};
+};
+
+// A block of a v2 file that failed its check, fetching just that block again may fix it.
+export class corrupt_block_error : public std::runtime_error {
+public:
+    corrupt_block_error(const std::string& what, size_t block)
+        : std::runtime_error { what }
+        , m_block { block }
+    {
+    }
+
+    size_t block() const
+    {
+        return m_block;
+    }
+
+private:
+    size_t m_block {};
+};
+
+// True when the file's digest has one chunk per block, its chunks are then checked as each block
+// is decoded.
+static bool digest_chunks_are_blocks(const Metadata::File& file)
+{
+    if (!file.digest.chunk_size || file.digest.chunks.size() != file.blocks.size()) {
+        return false;
+    }
+    for (size_t i = 0; i + 1 < file.blocks.size(); ++i) {
+        if (file.blocks[i].size != file.digest.chunk_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Decompresses the compressed bytes of a file with its codec. The blocks of a v2 file are checked
+// against their CRC32, and their digest chunk if they have one, and decoded in parallel. Without an
+// index the data is decoded as consecutive streams.
+export std::vector<uint8_t> decompress_file(const Metadata::File& file, std::span<uint8_t> compressed)
+{
+    // An empty file of a v2 package has no blocks and no bytes.
+    if (!file.size) {
+        return {};
+    }
+    if (file.blocks.empty()) {
+        return decompress(file.codec, compressed);
+    }
+
+    auto starts = std::vector<size_t> {};
+    size_t size {};
+    for (const auto& block : file.blocks) {
+        if (block.offset + block.compressed_size > compressed.size()) {
+            throw std::runtime_error { std::format("{} is truncated", file.filepath) };
+        }
+        starts.push_back(size);
+        size += block.size;
+    }
+
+    auto out = std::vector<uint8_t>(size);
+    auto check_chunks = digest_chunks_are_blocks(file);
+    auto decode_block = [&](size_t i) {
+        const auto& block = file.blocks[i];
+        auto data = compressed.subspan(block.offset, block.compressed_size);
+        if (crc32(data) != block.crc32) {
+            throw corrupt_block_error { std::format("Block {} of {} is corrupted", i, file.filepath), i };
+        }
+        auto decoded = std::span { out }.subspan(starts[i], block.size);
+        decompress_to(file.codec, data, decoded);
+        if (check_chunks && blake3(decoded) != file.digest.chunks[i]) {
+            throw corrupt_block_error { std::format("Block {} of {} doesn't match its digest", i, file.filepath), i };
+        }
+    };
+    worker_pool_t::shared().parallel_for(file.blocks.size(), decode_block);
+    return out;
+}
+
+// Checks decompressed content against the file's tree digest, or its md5 for packages without
+// one. Returns the name of the check.
+export const char* verify_content(std::string_view name, const Metadata::File& file, std::span<uint8_t> rawdata)
+{
+    if (!file.digest.chunk_size) {
+        if (md5_string(rawdata) != file.md5) {
+            throw std::runtime_error { std::format("MD5 of {}/{} doesn't match please contact admin@staticlinux.org", name, file.filepath) };
+        }
+        return "md5";
+    }
+
+    // decompress_file() checked the chunks already, the digests themselves are still checked.
+    if (!file.blocks.empty() && digest_chunks_are_blocks(file)) {
+        if (tree_root(file.digest.chunks) != file.digest.root) {
+            throw std::runtime_error { std::format("Digest of {}/{} doesn't match its chunks", name, file.filepath) };
+        }
+        return "blake3";
+    }
+    if (auto bad = find_bad_chunk(file.digest, rawdata)) {
+        auto first = *bad * file.digest.chunk_size;
+        auto last = std::min(first + file.digest.chunk_size, rawdata.size()) - 1;
+        throw std::runtime_error { std::format("Chunk {} (bytes {}-{}) of {}/{} doesn't match please contact admin@staticlinux.org", *bad, first, last, name, file.filepath) };
+    }
+    return "blake3";
+}
+
+// Decompresses one file of package `name`, verifies it and writes it to `path`. Safe to call from
+// a worker thread: it records nothing itself, the caller adds the returned timings to its stats.
+export decoded_file_t decode_and_write(std::string_view name, const Metadata::File& file, std::span<uint8_t> compressed, const std::filesystem::path& path)
+{
+    auto result = decoded_file_t {};
+    auto start = std::chrono::steady_clock::now();
+    auto rawdata = decompress_file(file, compressed);
+    auto decompressed = std::chrono::steady_clock::now();
+    result.verify_stage = verify_content(name, file, rawdata);
+    auto verified = std::chrono::steady_clock::now();
+    write_app_file(path, file, rawdata);
+    result.decompress = decompressed - start;
+    result.verify = verified - decompressed;
+    result.write = std::chrono::steady_clock::now() - verified;
+    result.size = rawdata.size();
+    return result;
+}
+
+// decode_and_write() to ~/.staticlinux/NAME/PATH, executables are linked into ~/.staticlinux/bin.
+export decoded_file_t decode_and_install(std::string_view name, const Metadata::File& file, std::span<uint8_t> compressed)
+{
+    auto result = decode_and_write(name, file, compressed, installed_file_path(name, file.filepath));
+    result.link = link_app_file(name, file);
+    return result;
+}
+
+// Files larger than this are pulled in pieces through a file_decoder_t rather than held whole,
+// so memory doesn't grow with the size of the file.
+constexpr uint64_t STREAMED_FILE_SIZE = 64 << 20;
+
+// True when the compressed bytes of a file, or its content as told by a v2 block index, are over
+// STREAMED_FILE_SIZE. A v1 file doesn't tell the size of its content.
+export bool is_streamed_file(const Metadata::File& file)
+{
+    uint64_t size {};
+    for (const auto& block : file.blocks) {
+        size += block.size;
+    }
+    return std::max(file.size, size) > STREAMED_FILE_SIZE;
+}
+
+// Decodes one file of package `name` from its compressed bytes as they arrive, in order, and
+// verifies and writes the content on the way, holding at most a block of it. Pieces may be added
+// from a worker, one at a time. The blocks of a v2 file are checked like in decompress_file(), but
+// one after the other. Without a path the content is only verified.
+export class file_decoder_t {
+public:
+    file_decoder_t(std::string_view name, const Metadata::File& file, const std::filesystem::path& path)
+        : file_decoder_t { name, file }
+    {
+        m_writer.emplace(path, file.mode);
+    }
+
+    file_decoder_t(std::string_view name, const Metadata::File& file)
+        : m_name { name }
+        , m_file { file }
+        , m_check_chunks { !file.blocks.empty() && digest_chunks_are_blocks(file) }
+    {
+        // An empty file of a v2 package has no blocks and nothing to decode.
+        if (m_file.blocks.empty() && m_file.size) {
+            m_stream.emplace(m_file.codec);
+        }
+        if (!m_file.digest.chunk_size) {
+            m_md5.emplace();
+        } else if (m_check_chunks) {
+            if (tree_root(m_file.digest.chunks) != m_file.digest.root) {
+                throw std::runtime_error { std::format("Digest of {}/{} doesn't match its chunks", m_name, m_file.filepath) };
+            }
+        } else {
+            m_tree.emplace(m_file.digest);
+        }
+        m_result.verify_stage = m_file.digest.chunk_size ? "blake3" : "md5";
+    }
+
+    file_decoder_t(const file_decoder_t&) = delete;
+    file_decoder_t& operator=(const file_decoder_t&) = delete;
+
+    void add(std::span<const uint8_t> compressed)
+    {
+        m_received += compressed.size();
+        if (m_received > m_file.size) {
+            throw std::runtime_error { std::format("{} is longer than its size", m_file.filepath) };
+        }
+        timed([&] {
+            if (m_stream) {
+                m_stream->decode(compressed, [this](auto decoded) { output(decoded); });
+            } else {
+                m_pending.insert(m_pending.end(), compressed.begin(), compressed.end());
+                decode_blocks();
+            }
+        });
+    }
+
+    // After the last piece: checks that the whole file came and matches, then puts it in place.
+    decoded_file_t finish()
+    {
+        if (m_received != m_file.size) {
+            throw std::runtime_error { std::format("{} is truncated", m_file.filepath) };
+        }
+        timed([&] {
+            if (m_stream) {
+                m_stream->finish([this](auto decoded) { output(decoded); });
+            }
+        });
+
+        auto start = std::chrono::steady_clock::now();
+        if (m_md5 && m_md5->finish() != m_file.md5) {
+            throw std::runtime_error { std::format("MD5 of {}/{} doesn't match please contact admin@staticlinux.org", m_name, m_file.filepath) };
+        } else if (m_tree) {
+            if (auto bad = m_tree->finish()) {
+                throw bad_chunk_error(*bad);
+            }
+        }
+        auto verified = std::chrono::steady_clock::now();
+        if (m_writer) {
+            m_writer->commit();
+        }
+        m_result.verify += verified - start;
+        m_result.write += std::chrono::steady_clock::now() - verified;
+        m_result.size = m_size;
+        return m_result;
+    }
+
+private:
+    // Runs a decoding step, its time less the verifying and writing it did counts as decompress.
+    template <typename F>
+    void timed(F f)
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto nested = m_result.verify + m_result.write;
+        f();
+        m_result.decompress += std::chrono::steady_clock::now() - start - (m_result.verify + m_result.write - nested);
+    }
+
+    // Decodes the blocks whose compressed bytes are all here.
+    void decode_blocks()
+    {
+        size_t used {};
+        while (m_next_block < m_file.blocks.size()) {
+            auto i = m_next_block;
+            const auto& block = m_file.blocks[i];
+            if (m_pending.size() - used < block.compressed_size) {
+                break;
+            }
+            auto data = std::span { m_pending }.subspan(used, block.compressed_size);
+            if (crc32(data) != block.crc32) {
+                throw corrupt_block_error { std::format("Block {} of {} is corrupted", i, m_file.filepath), i };
+            }
+            m_decoded.resize(block.size);
+            decompress_to(m_file.codec, data, m_decoded);
+            if (m_check_chunks) {
+                auto start = std::chrono::steady_clock::now();
+                auto ok = blake3(m_decoded) == m_file.digest.chunks[i];
+                m_result.verify += std::chrono::steady_clock::now() - start;
+                if (!ok) {
+                    throw corrupt_block_error { std::format("Block {} of {} doesn't match its digest", i, m_file.filepath), i };
+                }
+            }
+            output(m_decoded);
+            used += block.compressed_size;
+            ++m_next_block;
+        }
+        m_pending.erase(m_pending.begin(), m_pending.begin() + used);
+    }
+
+    void output(std::span<const uint8_t> decoded)
+    {
+        auto start = std::chrono::steady_clock::now();
+        m_size += decoded.size();
+        if (m_md5) {
+            m_md5->update(decoded);
+        } else if (m_tree) {
+            if (auto bad = m_tree->update(decoded)) {
+                throw bad_chunk_error(*bad);
+            }
+        }
+        auto verified = std::chrono::steady_clock::now();
+        if (m_writer) {
+            m_writer->write(decoded);
+        }
+        m_result.verify += verified - start;
+        m_result.write += std::chrono::steady_clock::now() - verified;
+    }
+
+    std::runtime_error bad_chunk_error(size_t bad) const
+    {
+        auto first = (uint64_t)bad * m_file.digest.chunk_size;
+        auto last = std::min<uint64_t>(first + m_file.digest.chunk_size, m_size) - 1;
+        return std::runtime_error { std::format("Chunk {} (bytes {}-{}) of {}/{} doesn't match please contact admin@staticlinux.org", bad, first, last, m_name, m_file.filepath) };
+    }
+
+    std::string m_name {};
+    Metadata::File m_file {};
+    std::optional<app_file_writer_t> m_writer {};
+    bool m_check_chunks {};
+    std::optional<stream_decoder_t> m_stream {};
+    std::optional<md5_hasher_t> m_md5 {};
+    std::optional<tree_verifier_t> m_tree {};
+    // Compressed bytes of the blocks not decoded yet, and the content of the last one decoded.
+    std::vector<uint8_t> m_pending {};
+    std::vector<uint8_t> m_decoded {};
+    size_t m_next_block {};
+    uint64_t m_received {};
+    uint64_t m_size {};
+    decoded_file_t m_result {};
+};
+
+// Parses the metadata and the block index of a whole package held in memory.
+static package_index_t parse_package_index(std::span<const uint8_t> data, std::string_view download_path)
+{
+    auto index = package_index_t { .download_path = std::string { download_path } };
+    auto invalid = [&] {
+        return std::runtime_error { std::format("Invalid package file: {}", download_path) };
+    };
+    auto decode_metadata = [&](uint64_t offset, uint64_t size) {
+        if (size > PACKAGE_MAX_METADATA_LEN || offset + size > data.size()) {
+            throw invalid();
+        }
+        auto compressed = std::vector<uint8_t> { data.begin() + offset, data.begin() + offset + size };
+        auto rawdata = lzma_decompress(compressed);
+        return parse_metadata(std::string_view { (const char*)rawdata.data(), rawdata.size() });
+    };
+
+    if (data.size() < PACKAGE_HEADER_LEN || memcmp(data.data(), "\xF1SLP", 4)) {
+        throw invalid();
+    }
+    if (data[4] == 0x02) {
+        index.format_version = 2;
+        if (data.size() < PACKAGE_V2_HEADER_LEN) {
+            throw invalid();
+        }
+        auto block_size = check_v2_header(data, download_path);
+        auto metadata_size = read_le<uint64_t>(&data[8]);
+        auto index_size = read_le<uint64_t>(&data[16]);
+        index.metadata = decode_metadata(PACKAGE_V2_HEADER_LEN, metadata_size);
+        auto index_offset = PACKAGE_V2_HEADER_LEN + metadata_size;
+        if (index_size > PACKAGE_MAX_INDEX_LEN || index_offset + index_size > data.size()) {
+            throw invalid();
+        }
+        apply_block_index(index, data.subspan(index_offset, index_size), index_offset + index_size, block_size);
+        return index;
+    } else if (data[4] != 0x00) {
+        throw invalid();
+    }
+
+    uint64_t metadata_file_len = read_le<uint32_t>(data.data() + 4) & ~0xffu;
+    index.metadata = decode_metadata(PACKAGE_HEADER_LEN, metadata_file_len);
+    uint64_t offset = PACKAGE_HEADER_LEN + metadata_file_len;
+    for (const auto& file : index.metadata.files) {
+        index.offsets.push_back(offset);
+        offset += file.size;
+    }
+    return index;
+}
+
+// Checks a whole package file, e.g. one app serve downloaded before it goes into the cache: the
+// header, metadata and block index must be valid, the files must fill the package exactly and
+// each must decode to its digest or MD5. Files are decoded in pieces, so memory doesn't grow with
+// the package. Blocks the calling thread.
+export void verify_package_file(const std::filesystem::path& path, std::string_view download_path)
+{
+    constexpr size_t PIECE = 1 << 20;
+
+    auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error { errno, std::system_category(), std::format("open {} failed", path.string()) };
+    }
+    struct stat st {};
+    fstat(fd, &st);
+    auto size = (size_t)st.st_size;
+    auto addr = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::system_error { errno, std::system_category(), std::format("mmap {} failed", path.string()) };
+    }
+    if (addr) {
+        madvise(addr, size, MADV_SEQUENTIAL);
+    }
+
+    try {
+        auto data = std::span { (const uint8_t*)addr, size };
+        auto index = parse_package_index(data, download_path);
+        auto end = index.offsets.empty() ? data.size() : index.offsets.back() + index.metadata.files.back().size;
+        if (end != data.size()) {
+            throw std::runtime_error { std::format("Size of {} doesn't match its metadata", download_path) };
+        }
+        for (size_t i = 0; i < index.metadata.files.size(); ++i) {
+            const auto& file = index.metadata.files[i];
+            auto decoder = file_decoder_t { download_path, file };
+            for (uint64_t offset = 0; offset < file.size; offset += PIECE) {
+                decoder.add(data.subspan(index.offsets[i] + offset, (size_t)std::min<uint64_t>(PIECE, file.size - offset)));
+            }
+            decoder.finish();
+        }
+    } catch (...) {
+        if (addr) {
+            munmap(addr, size);
+        }
+        throw;
+    }
+    if (addr) {
+        munmap(addr, size);
+    }
+}
+
+// Adds the timings of a decode_and_install() call to the current stats.
+export void record_decoded_file(const decoded_file_t& file)
+{
+    auto& stats = stats_t::current();
+    stats.add("decompress", file.decompress, file.size);
+    stats.add(file.verify_stage, file.verify, file.size);
+    stats.add("write", file.write, file.size);
+}
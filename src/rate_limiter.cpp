@@ -0,0 +1,125 @@
+module;
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string_view>
+
+export module rate_limiter;
+
+using namespace std::chrono_literals;
+
+// Token bucket that lets readers reserve bytes and tells them how long to wait for them.
+// Reservations may drive the bucket into debt, later readers then wait behind earlier ones, so
+// concurrent transfers share the rate in the order they asked.
+export class rate_limiter_t {
+public:
+    explicit rate_limiter_t(uint64_t bytes_per_second)
+        : m_rate { (double)bytes_per_second }
+        , m_burst { std::max(m_rate / 20, (double)MIN_BURST) }
+        , m_tokens { m_burst }
+    {
+    }
+
+    uint64_t rate() const
+    {
+        return (uint64_t)m_rate;
+    }
+
+    // Largest read worth reserving at once, smaller reads interleave transfers more finely.
+    size_t chunk_size() const
+    {
+        return std::clamp((size_t)m_burst / 4, MIN_BURST, MAX_CHUNK);
+    }
+
+    // Takes `bytes` from the bucket and returns how long the caller must wait before using them.
+    std::chrono::nanoseconds reserve(uint64_t bytes)
+    {
+        auto now = std::chrono::steady_clock::now();
+        auto elapsed = std::chrono::duration<double>(now - m_last).count();
+        m_last = now;
+        m_tokens = std::min(m_tokens + elapsed * m_rate, m_burst) - bytes;
+        if (m_tokens >= 0) {
+            return 0ns;
+        }
+        return std::chrono::nanoseconds { (int64_t)(-m_tokens / m_rate * 1e9) };
+    }
+
+private:
+    static constexpr size_t MIN_BURST = 16 << 10;
+    static constexpr size_t MAX_CHUNK = 256 << 10;
+
+    double m_rate {};
+    double m_burst {};
+    double m_tokens {};
+    std::chrono::steady_clock::time_point m_last { std::chrono::steady_clock::now() };
+};
+
+// Limits set for the transfers of this thread's message loop, e.g. by --limit-rate.
+export struct rate_limits_t {
+    static rate_limits_t& current()
+    {
+        static thread_local rate_limits_t s_current {};
+        return s_current;
+    }
+
+    // Shared by all connections, empty when unlimited.
+    std::optional<rate_limiter_t> total {};
+    // Bytes per second of each connection, zero when unlimited.
+    uint64_t per_connection {};
+};
+
+// Parses a rate like 500K, 20M or 1G (powers of 1024, an optional trailing "B" or "/s" is
+// accepted). Returns nothing when malformed, zero or too large for 64 bits.
+export std::optional<uint64_t> parse_rate(std::string_view str)
+{
+    if (str.ends_with("/s")) {
+        str.remove_suffix(2);
+    }
+    if (str.ends_with('B') || str.ends_with('b')) {
+        str.remove_suffix(1);
+    }
+
+    constexpr auto MAX = std::numeric_limits<uint64_t>::max();
+    uint64_t value {};
+    size_t i {};
+    for (; i < str.size() && str[i] >= '0' && str[i] <= '9'; ++i) {
+        auto digit = (uint64_t)(str[i] - '0');
+        if (value > (MAX - digit) / 10) {
+            return {};
+        }
+        value = value * 10 + digit;
+    }
+    if (i == 0 || i + 1 < str.size()) {
+        return {};
+    }
+    if (i < str.size()) {
+        int shift {};
+        switch (str[i]) {
+        case 'k':
+        case 'K':
+            shift = 10;
+            break;
+        case 'm':
+        case 'M':
+            shift = 20;
+            break;
+        case 'g':
+        case 'G':
+            shift = 30;
+            break;
+        default:
+            return {};
+        }
+        if (value > MAX >> shift) {
+            return {};
+        }
+        value <<= shift;
+    }
+    if (!value) {
+        return {};
+    }
+    return value;
+}
@@ -1,9 +1,12 @@
 module;
 
 #include <algorithm>
+#include <chrono>
 #include <coroutine>
 #include <cstdint>
 #include <errno.h>
+#include <optional>
+#include <string>
 #include <system_error>
 #include <unistd.h>
 #include <vector>
@@ -11,11 +14,13 @@ module;
 export module read_stream;
 import cppl;
 import message_queue;
+import rate_limiter;
+import stats;
 
 using cppl::task_state_t;
 using cppl::task_t;
 
-static task_t<std::vector<uint8_t>> read_async_at_most(int fd, size_t at_most)
+static task_t<std::vector<uint8_t>> read_async_at_most(int fd, size_t at_most, std::chrono::milliseconds idle_timeout)
 {
     std::vector<uint8_t> buffer(at_most);
     while (true) {
@@ -26,7 +31,11 @@ static task_t<std::vector<uint8_t>> read_async_at_most(int fd, size_t at_most)
         } else if (num < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // No more data, wait.
-                co_await message_queue_t::current().await(fd, EPOLLIN);
+                if (idle_timeout.count()) {
+                    co_await with_deadline(message_queue_t::current().await(fd, EPOLLIN), idle_timeout, fd);
+                } else {
+                    co_await message_queue_t::current().await(fd, EPOLLIN);
+                }
             } else if (errno == EINTR) {
                 // interrupted by signal, retry.
                 continue;
@@ -55,6 +64,9 @@ public:
     read_stream_t(read_stream_t&& r)
         : m_fd { r.m_fd }
         , m_buffer { std::move(r.m_buffer) }
+        , m_idle_timeout { r.m_idle_timeout }
+        , m_limiter { std::move(r.m_limiter) }
+        , m_request_buffer { std::move(r.m_request_buffer) }
     {
         r.m_fd = INVALID_FD;
     }
@@ -71,6 +83,9 @@ public:
         close();
         m_fd = r.m_fd;
         m_buffer = std::move(r.m_buffer);
+        m_idle_timeout = r.m_idle_timeout;
+        m_limiter = std::move(r.m_limiter);
+        m_request_buffer = std::move(r.m_request_buffer);
         r.m_fd = INVALID_FD;
         return *this;
     }
@@ -96,7 +111,7 @@ public:
             }
 
             // no '\n' in the buffer, try to read more from the input.
-            auto more = co_await read_async_at_most(m_fd, 1024);
+            auto more = co_await read_more_async(1024);
             if (more.empty()) {
                 // No more data.
                 throw std::runtime_error { "connection is closed" };
@@ -117,7 +132,7 @@ public:
             auto data = std::move(m_buffer);
             auto remain = size - data.size();
             while (remain) {
-                auto more = co_await read_async_at_most(m_fd, remain);
+                auto more = co_await read_more_async(remain);
                 if (more.empty()) {
                     // No more data.
                     throw std::runtime_error { "connection is closed" };
@@ -129,12 +144,72 @@ public:
         }
     }
 
+    // Reads until the peer closes the connection, for a body that ends with it.
+    task_t<std::vector<uint8_t>> read_to_end_async()
+    {
+        auto data = std::move(m_buffer);
+        m_buffer.clear();
+        while (true) {
+            auto more = co_await read_more_async(64 << 10);
+            if (more.empty()) {
+                co_return data;
+            }
+            data.insert(data.end(), more.begin(), more.end());
+        }
+    }
+
     int native_handle() const
     {
         return m_fd;
     }
 
+    // Scratch space for the requests written to this connection. It moves with the connection,
+    // so a pooled connection formats its requests without allocating.
+    std::string& request_buffer()
+    {
+        return m_request_buffer;
+    }
+
+    // Reads fail with timeout_error when no data arrives for this long, zero waits forever.
+    void set_idle_timeout(std::chrono::milliseconds idle_timeout)
+    {
+        m_idle_timeout = idle_timeout;
+    }
+
+    // Forgets the per connection rate, for a connection that is reused by another transfer.
+    void reset_limiter()
+    {
+        m_limiter.reset();
+    }
+
 private:
+    // Reads from the socket within the rate limits, see rate_limits_t.
+    task_t<std::vector<uint8_t>> read_more_async(size_t at_most)
+    {
+        auto& limits = rate_limits_t::current();
+        if (limits.per_connection && !m_limiter) {
+            m_limiter.emplace(limits.per_connection);
+        }
+        if (!m_limiter && !limits.total) {
+            co_return co_await read_async_at_most(m_fd, at_most, m_idle_timeout);
+        }
+
+        // Keep reservations small so concurrent transfers take turns.
+        auto chunk = std::min(m_limiter ? m_limiter->chunk_size() : SIZE_MAX, limits.total ? limits.total->chunk_size() : SIZE_MAX);
+        auto data = co_await read_async_at_most(m_fd, std::min(at_most, chunk), m_idle_timeout);
+        auto delay = std::max(m_limiter ? m_limiter->reserve(data.size()) : std::chrono::nanoseconds {},
+            limits.total ? limits.total->reserve(data.size()) : std::chrono::nanoseconds {});
+
+        // The timers tick in milliseconds, a shorter wait stays in the bucket as debt and is
+        // paid by a later read.
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(delay);
+        if (wait.count()) {
+            stats_t::current().add("throttle", wait);
+            co_await sleep_for(wait);
+        }
+        co_return data;
+    }
+
     void close()
     {
         if (m_fd >= 0) {
@@ -145,4 +220,8 @@ private:
 
     int m_fd { INVALID_FD };
     std::vector<uint8_t> m_buffer {};
+    std::chrono::milliseconds m_idle_timeout {};
+    // Per connection rate limit, created on the first read when one is set.
+    std::optional<rate_limiter_t> m_limiter {};
+    std::string m_request_buffer {};
 };
\ No newline at end of file
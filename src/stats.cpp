@@ -0,0 +1,263 @@
+module;
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+export module stats;
+import alloc_stats;
+import cppl;
+
+using namespace std::chrono_literals;
+
+// Time and bytes spent in one phase of a command, summed over every time it ran.
+export struct stage_t {
+    std::string name {};
+    std::chrono::steady_clock::duration duration {};
+    uint64_t bytes {};
+    uint32_t count {};
+    // Only counted in APP_ALLOC_STATS builds. Peaks are the highest seen by any run of the stage.
+    uint64_t allocations {};
+    uint64_t allocated_bytes {};
+    uint64_t peak_live_bytes {};
+    uint64_t peak_rss_bytes {};
+};
+
+// Collects per-phase timings and counters of the running command. Collection is always on, it is
+// a handful of clock reads per transfer; --stats only decides whether the report is printed.
+export class stats_t {
+public:
+    static stats_t& current()
+    {
+        static thread_local stats_t s_current {};
+        return s_current;
+    }
+
+    void add(std::string_view stage, std::chrono::steady_clock::duration duration, uint64_t bytes = 0)
+    {
+        auto& s = find_stage(stage);
+        s.duration += duration;
+        s.bytes += bytes;
+        ++s.count;
+    }
+
+    void add_memory(std::string_view stage, const alloc_window_t::result_t& memory, uint64_t peak_rss_bytes)
+    {
+        auto& s = find_stage(stage);
+        s.allocations += memory.allocations;
+        s.allocated_bytes += memory.allocated_bytes;
+        s.peak_live_bytes = std::max(s.peak_live_bytes, memory.peak_live_bytes);
+        s.peak_rss_bytes = std::max(s.peak_rss_bytes, peak_rss_bytes);
+    }
+
+    void count(std::string_view counter, uint64_t n = 1)
+    {
+        auto it = std::find_if(m_counters.begin(), m_counters.end(), [&](const auto& c) { return c.first == counter; });
+        if (it == m_counters.end()) {
+            it = m_counters.insert(m_counters.end(), { std::string { counter }, 0 });
+        }
+        it->second += n;
+    }
+
+    // Context for the report, e.g. which mirror served the package.
+    void label(std::string_view key, std::string_view value)
+    {
+        auto it = std::find_if(m_labels.begin(), m_labels.end(), [&](const auto& l) { return l.first == key; });
+        if (it == m_labels.end()) {
+            m_labels.emplace_back(key, value);
+        } else {
+            it->second = value;
+        }
+    }
+
+    std::string to_text() const
+    {
+        auto out = std::string {};
+        auto it = std::back_inserter(out);
+        for (const auto& [key, value] : m_labels) {
+            std::format_to(it, "{}: {}\n", key, value);
+        }
+        std::format_to(it, "{:<22}{:>12}{:>14}{:>12}", "stage", "time", "bytes", "MB/s");
+        if constexpr (alloc_stats_enabled) {
+            std::format_to(it, "{:>10}{:>14}{:>10}", "allocs", "peak live", "peak rss");
+        }
+        out += '\n';
+        for (const auto& stage : m_stages) {
+            std::format_to(it, "{:<22}{:>10.2f}ms", stage.name, to_ms(stage.duration));
+            if (stage.bytes) {
+                std::format_to(it, "{:>14}{:>12.2f}", stage.bytes, megabytes_per_second(stage));
+            } else if (alloc_stats_enabled) {
+                std::format_to(it, "{:>26}", "");
+            }
+            if constexpr (alloc_stats_enabled) {
+                std::format_to(it, "{:>10}{:>12.2f}MB{:>8.1f}MB", stage.allocations, to_mb(stage.peak_live_bytes), to_mb(stage.peak_rss_bytes));
+            }
+            out += '\n';
+        }
+        std::format_to(it, "{:<22}{:>10.2f}ms", "total", to_ms(elapsed()));
+        if constexpr (alloc_stats_enabled) {
+            auto memory = alloc_snapshot();
+            std::format_to(it, "{:>26}{:>10}{:>14}{:>8.1f}MB", "", memory.allocations, "", to_mb(peak_rss_bytes()));
+        }
+        out += '\n';
+        for (size_t i = 0; i < m_counters.size(); ++i) {
+            std::format_to(it, "{}{}: {}", i ? ", " : "", m_counters[i].first, m_counters[i].second);
+        }
+        if (!m_counters.empty()) {
+            out += '\n';
+        }
+        return out;
+    }
+
+    std::string to_json() const
+    {
+        auto out = std::string {};
+        auto it = std::back_inserter(out);
+        std::format_to(it, "{{\"total_ms\":{:.3f},", to_ms(elapsed()));
+        if constexpr (alloc_stats_enabled) {
+            std::format_to(it, "\"allocations\":{},\"peak_rss_bytes\":{},", alloc_snapshot().allocations, peak_rss_bytes());
+        }
+        out += "\"labels\":{";
+        for (size_t i = 0; i < m_labels.size(); ++i) {
+            std::format_to(it, "{}\"{}\":\"{}\"", i ? "," : "", json_escape(m_labels[i].first), json_escape(m_labels[i].second));
+        }
+        out += "},\"stages\":{";
+        for (size_t i = 0; i < m_stages.size(); ++i) {
+            const auto& stage = m_stages[i];
+            std::format_to(it, "{}\"{}\":{{\"ms\":{:.3f},\"count\":{},\"bytes\":{},\"mb_per_s\":{:.3f}",
+                i ? "," : "", stage.name, to_ms(stage.duration), stage.count, stage.bytes, megabytes_per_second(stage));
+            if constexpr (alloc_stats_enabled) {
+                std::format_to(it, ",\"allocations\":{},\"allocated_bytes\":{},\"peak_live_bytes\":{},\"peak_rss_bytes\":{}",
+                    stage.allocations, stage.allocated_bytes, stage.peak_live_bytes, stage.peak_rss_bytes);
+            }
+            out += '}';
+        }
+        out += "},\"counters\":{";
+        for (size_t i = 0; i < m_counters.size(); ++i) {
+            std::format_to(it, "{}\"{}\":{}", i ? "," : "", m_counters[i].first, m_counters[i].second);
+        }
+        out += "}}\n";
+        return out;
+    }
+
+private:
+    stage_t& find_stage(std::string_view stage)
+    {
+        auto it = std::find_if(m_stages.begin(), m_stages.end(), [&](const auto& s) { return s.name == stage; });
+        if (it == m_stages.end()) {
+            it = m_stages.insert(m_stages.end(), stage_t { .name = std::string { stage } });
+        }
+        return *it;
+    }
+
+    static double to_mb(uint64_t bytes)
+    {
+        return (double)bytes / (1 << 20);
+    }
+
+    static double to_ms(std::chrono::steady_clock::duration duration)
+    {
+        return std::chrono::duration<double, std::milli>(duration).count();
+    }
+
+    static double megabytes_per_second(const stage_t& stage)
+    {
+        auto seconds = std::chrono::duration<double>(stage.duration).count();
+        return seconds > 0 ? stage.bytes / seconds / (1 << 20) : 0;
+    }
+
+    static std::string json_escape(std::string_view str)
+    {
+        auto out = std::string {};
+        for (auto c : str) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if ((unsigned char)c < 0x20) {
+                std::format_to(std::back_inserter(out), "\\u{:04x}", (int)c);
+            } else {
+                out += c;
+            }
+        }
+        return out;
+    }
+
+    std::chrono::steady_clock::duration elapsed() const
+    {
+        return std::chrono::steady_clock::now() - m_start;
+    }
+
+    std::chrono::steady_clock::time_point m_start { std::chrono::steady_clock::now() };
+    std::vector<stage_t> m_stages {};
+    std::vector<std::pair<std::string, uint64_t>> m_counters {};
+    std::vector<std::pair<std::string, std::string>> m_labels {};
+};
+
+// Adds the time until stop() or until it goes out of scope to `stage`. Stages of concurrent
+// coroutines overlap, so the sum of the stages may exceed the total.
+//
+// A task's co_return resumes its awaiter before the task's locals are destroyed, so coroutines
+// call stop() before returning.
+//
+// `stage` must be a string literal, it also names the span of the stage in the cppl trace.
+//
+// With APP_ALLOC_STATS it also records the allocations made while the stage runs, attributed by
+// time window: allocations of other coroutines running meanwhile are included.
+export class stage_timer_t {
+public:
+    explicit stage_timer_t(std::string_view stage)
+        : m_stage { stage }
+        , m_span { stage.data() }
+    {
+    }
+
+    stage_timer_t(const stage_timer_t&) = delete;
+
+    ~stage_timer_t()
+    {
+        stop();
+    }
+
+    stage_timer_t& operator=(const stage_timer_t&) = delete;
+
+    void add_bytes(uint64_t bytes)
+    {
+        m_bytes += bytes;
+    }
+
+    // Drops the measurement, for work whose result is thrown away, e.g. a hedge attempt that
+    // lost the race.
+    void discard()
+    {
+        if (!m_stopped) {
+            m_stopped = true;
+            m_span.end();
+        }
+    }
+
+    void stop()
+    {
+        if (!m_stopped) {
+            m_stopped = true;
+            m_span.end();
+            stats_t::current().add(m_stage, std::chrono::steady_clock::now() - m_start, m_bytes);
+            if constexpr (alloc_stats_enabled) {
+                stats_t::current().add_memory(m_stage, m_memory.stop(), peak_rss_bytes());
+            }
+        }
+    }
+
+private:
+    std::string_view m_stage {};
+    cppl::trace::span_t m_span;
+    std::chrono::steady_clock::time_point m_start { std::chrono::steady_clock::now() };
+    alloc_window_t m_memory {};
+    uint64_t m_bytes {};
+    bool m_stopped {};
+};
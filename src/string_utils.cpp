@@ -1,7 +1,11 @@
 module;
 
+#include <charconv>
+#include <cstdint>
+#include <optional>
 #include <ranges>
 #include <string>
+#include <string_view>
 
 export module string_utils;
 
@@ -19,4 +23,15 @@ export std::string tolower(std::string_view str)
 {
     auto v = str | std::views::transform([](auto c) { return tolower(c); });
     return std::string { v.begin(), v.end() };
-}
\ No newline at end of file
+}
+
+// A plain decimal number, nothing when there is anything else around it or it doesn't fit.
+export std::optional<uint64_t> parse_u64(std::string_view str)
+{
+    uint64_t value {};
+    auto [end, error] = std::from_chars(str.data(), str.data() + str.size(), value);
+    if (str.empty() || error != std::errc {} || end != str.data() + str.size()) {
+        return std::nullopt;
+    }
+    return value;
+}
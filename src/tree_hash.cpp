@@ -0,0 +1,184 @@
+module;
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <blake3.h>
+#include <cstdint>
+#include <format>
+#include <iterator>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+export module tree_hash;
+import worker_pool;
+
+export using blake3_digest_t = std::array<uint8_t, BLAKE3_OUT_LEN>;
+
+export blake3_digest_t blake3(std::span<const uint8_t> data)
+{
+    blake3_hasher hasher;
+    blake3_hasher_init(&hasher);
+    blake3_hasher_update(&hasher, data.data(), data.size());
+    auto digest = blake3_digest_t {};
+    blake3_hasher_finalize(&hasher, digest.data(), digest.size());
+    return digest;
+}
+
+export std::string to_hex(const blake3_digest_t& digest)
+{
+    auto hex = std::string {};
+    hex.reserve(digest.size() * 2);
+    for (auto byte : digest) {
+        std::format_to(std::back_inserter(hex), "{:02x}", byte);
+    }
+    return hex;
+}
+
+export std::optional<blake3_digest_t> parse_digest(std::string_view hex)
+{
+    auto digest = blake3_digest_t {};
+    if (hex.size() != digest.size() * 2) {
+        return std::nullopt;
+    }
+    auto nibble = [](char c) -> int {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        return -1;
+    };
+    for (size_t i = 0; i < digest.size(); ++i) {
+        auto high = nibble(hex[i * 2]);
+        auto low = nibble(hex[i * 2 + 1]);
+        if (high < 0 || low < 0) {
+            return std::nullopt;
+        }
+        digest[i] = high << 4 | low;
+    }
+    return digest;
+}
+
+// A content digest that can be checked a chunk at a time: the BLAKE3 of every `chunk_size` bytes
+// and, as the root, the BLAKE3 of those digests concatenated. Chunks hash independently, so they
+// are spread over the worker pool, and a mismatch tells which chunk is bad.
+export struct tree_digest_t {
+    // Zero when the package carries no digest for the file.
+    size_t chunk_size {};
+    std::vector<blake3_digest_t> chunks {};
+    blake3_digest_t root {};
+};
+
+export blake3_digest_t tree_root(std::span<const blake3_digest_t> chunks)
+{
+    return blake3({ (const uint8_t*)chunks.data(), chunks.size_bytes() });
+}
+
+export tree_digest_t tree_digest(std::span<const uint8_t> data, size_t chunk_size)
+{
+    auto digest = tree_digest_t { .chunk_size = chunk_size };
+    digest.chunks.resize((data.size() + chunk_size - 1) / chunk_size);
+    auto hash_chunk = [&](size_t i) {
+        digest.chunks[i] = blake3(data.subspan(i * chunk_size, std::min(chunk_size, data.size() - i * chunk_size)));
+    };
+    worker_pool_t::shared().parallel_for(digest.chunks.size(), hash_chunk);
+    digest.root = tree_root(digest.chunks);
+    return digest;
+}
+
+// Returns the index of the first chunk of `data` that doesn't match `digest`, nothing when all
+// match. When the data has more or fewer chunks than the digest, the first unmatched one is bad.
+export std::optional<size_t> find_bad_chunk(const tree_digest_t& digest, std::span<const uint8_t> data)
+{
+    if (tree_root(digest.chunks) != digest.root) {
+        throw std::runtime_error { "chunk digests don't match their root" };
+    }
+
+    auto chunks = (data.size() + digest.chunk_size - 1) / digest.chunk_size;
+    auto checked = std::min(chunks, digest.chunks.size());
+    auto first_bad = std::atomic<size_t> { checked };
+    auto check_chunk = [&](size_t i) {
+        auto chunk = data.subspan(i * digest.chunk_size, std::min(digest.chunk_size, data.size() - i * digest.chunk_size));
+        if (blake3(chunk) != digest.chunks[i]) {
+            for (auto bad = first_bad.load(); i < bad && !first_bad.compare_exchange_weak(bad, i);) {
+            }
+        }
+    };
+    worker_pool_t::shared().parallel_for(checked, check_chunk);
+    if (first_bad < checked || chunks != digest.chunks.size()) {
+        return first_bad.load();
+    }
+    return std::nullopt;
+}
+
+// Checks content against a tree digest as it arrives, a chunk at a time, for content that isn't
+// held whole. Chunks are hashed in order on the calling thread.
+export class tree_verifier_t {
+public:
+    explicit tree_verifier_t(const tree_digest_t& digest)
+        : m_digest { &digest }
+    {
+        if (tree_root(digest.chunks) != digest.root) {
+            throw std::runtime_error { "chunk digests don't match their root" };
+        }
+        blake3_hasher_init(&m_hasher);
+    }
+
+    // Returns the index of the first chunk completed by `data` that doesn't match.
+    std::optional<size_t> update(std::span<const uint8_t> data)
+    {
+        while (!data.empty()) {
+            auto n = std::min(data.size(), m_digest->chunk_size - m_filled);
+            blake3_hasher_update(&m_hasher, data.data(), n);
+            m_filled += n;
+            data = data.subspan(n);
+            if (m_filled == m_digest->chunk_size) {
+                if (auto bad = finish_chunk()) {
+                    return bad;
+                }
+            }
+        }
+        return std::nullopt;
+    }
+
+    // After the last byte. Like find_bad_chunk(), content with more or fewer chunks than the
+    // digest is bad at the first unmatched chunk.
+    std::optional<size_t> finish()
+    {
+        if (m_filled) {
+            if (auto bad = finish_chunk()) {
+                return bad;
+            }
+        }
+        if (m_chunk != m_digest->chunks.size()) {
+            return m_chunk;
+        }
+        return std::nullopt;
+    }
+
+private:
+    std::optional<size_t> finish_chunk()
+    {
+        auto digest = blake3_digest_t {};
+        blake3_hasher_finalize(&m_hasher, digest.data(), digest.size());
+        blake3_hasher_init(&m_hasher);
+        m_filled = 0;
+        auto i = m_chunk++;
+        if (i >= m_digest->chunks.size() || digest != m_digest->chunks[i]) {
+            return i;
+        }
+        return std::nullopt;
+    }
+
+    const tree_digest_t* m_digest {};
+    blake3_hasher m_hasher {};
+    size_t m_filled {};
+    size_t m_chunk {};
+};
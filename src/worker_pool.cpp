@@ -0,0 +1,197 @@
+module;
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sys/eventfd.h>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
+
+export module worker_pool;
+import cppl;
+import message_queue;
+
+using cppl::task_t;
+
+// Runs CPU-bound work, e.g. decompression, on background threads so the message loop keeps
+// serving sockets meanwhile. Each job signals its completion through an eventfd that the loop
+// waits on like any other fd.
+export class worker_pool_t {
+public:
+    // Shared by the whole process, one thread per core, at most 8.
+    static worker_pool_t& shared()
+    {
+        static worker_pool_t s_shared { std::clamp(std::thread::hardware_concurrency(), 1u, 8u) };
+        return s_shared;
+    }
+
+    explicit worker_pool_t(size_t threads)
+    {
+        for (size_t i = 0; i < threads; ++i) {
+            m_threads.emplace_back([this] { run(); });
+        }
+    }
+
+    worker_pool_t(const worker_pool_t&) = delete;
+
+    ~worker_pool_t()
+    {
+        {
+            auto lock = std::lock_guard { m_mutex };
+            m_stopping = true;
+        }
+        m_cv.notify_all();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    worker_pool_t& operator=(const worker_pool_t&) = delete;
+
+    size_t size() const
+    {
+        return m_threads.size();
+    }
+
+    // Calls `f` on a worker thread and completes with its result, or its exception, on the
+    // calling thread's message loop. `f` must not touch loop-thread state such as stats_t.
+    //
+    // Pass a named callable, GCC 12 destroys a lambda temporary inside a co_await expression twice.
+    template <typename F>
+    task_t<std::invoke_result_t<F>> run_async(F f)
+    {
+        using result_t = std::invoke_result_t<F>;
+        auto state = std::make_shared<job_state_t<result_t>>();
+        if ((state->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            throw std::system_error { errno, std::system_category(), "eventfd failed" };
+        }
+        post([state, f = std::move(f)]() mutable {
+            try {
+                if constexpr (std::is_void_v<result_t>) {
+                    f();
+                } else {
+                    state->result.emplace(f());
+                }
+            } catch (...) {
+                state->error = std::current_exception();
+            }
+            uint64_t one = 1;
+            while (write(state->fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+            }
+        });
+        return wait_async(std::move(state));
+    }
+
+    // Calls `f(i)` for every i in [0, n) on the pool and the calling thread, returns once all
+    // calls are done and rethrows the first error. Safe to call from a worker: the caller runs
+    // whatever no idle worker picks up, so it never waits for a queued job.
+    template <typename F>
+    void parallel_for(size_t n, F&& f)
+    {
+        auto state = std::make_shared<parallel_state_t>();
+        auto work = [state, n, fn = &f] {
+            for (size_t i; (i = state->next++) < n;) {
+                // `f` is alive as long as some index hasn't completed.
+                try {
+                    (*fn)(i);
+                } catch (...) {
+                    auto lock = std::lock_guard { state->mutex };
+                    if (!state->error) {
+                        state->error = std::current_exception();
+                    }
+                }
+                auto lock = std::lock_guard { state->mutex };
+                if (++state->done == n) {
+                    state->cv.notify_all();
+                }
+            }
+        };
+        for (size_t i = 1; i < std::min(n, m_threads.size() + 1); ++i) {
+            post(work);
+        }
+        work();
+
+        auto lock = std::unique_lock { state->mutex };
+        state->cv.wait(lock, [&] { return state->done == n; });
+        if (state->error) {
+            std::rethrow_exception(state->error);
+        }
+    }
+
+private:
+    struct parallel_state_t {
+        std::atomic<size_t> next {};
+        std::mutex mutex {};
+        std::condition_variable cv {};
+        size_t done {};
+        std::exception_ptr error {};
+    };
+
+    template <typename T>
+    struct job_state_t {
+        std::conditional_t<std::is_void_v<T>, bool, std::optional<T>> result {};
+        std::exception_ptr error {};
+        int fd { -1 };
+
+        ~job_state_t()
+        {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    };
+
+    template <typename T>
+    static task_t<T> wait_async(std::shared_ptr<job_state_t<T>> state)
+    {
+        co_await message_queue_t::current().await(state->fd, EPOLLIN);
+        if (state->error) {
+            std::rethrow_exception(state->error);
+        }
+        if constexpr (!std::is_void_v<T>) {
+            co_return std::move(*state->result);
+        }
+    }
+
+    void post(std::function<void()> job)
+    {
+        {
+            auto lock = std::lock_guard { m_mutex };
+            m_jobs.push_back(std::move(job));
+        }
+        m_cv.notify_one();
+    }
+
+    void run()
+    {
+        while (true) {
+            auto job = std::function<void()> {};
+            {
+                auto lock = std::unique_lock { m_mutex };
+                m_cv.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+                if (m_jobs.empty()) {
+                    return;
+                }
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::mutex m_mutex {};
+    std::condition_variable m_cv {};
+    std::deque<std::function<void()>> m_jobs {};
+    bool m_stopping {};
+    std::vector<std::thread> m_threads {};
+};
@@ -0,0 +1,298 @@
+module;
+
+#include <arpa/inet.h>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <netinet/in.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+export module dns_test;
+import cppl;
+import dns;
+import message_queue;
+import test_harness;
+
+using cppl::task_t;
+using namespace std::chrono_literals;
+
+struct dns_query_t {
+    uint16_t id {};
+    std::string name {};
+    uint16_t qtype {};
+};
+
+static void append_u16(std::vector<uint8_t>& out, uint16_t value)
+{
+    out.push_back(value >> 8);
+    out.push_back(value & 0xff);
+}
+
+static void append_name(std::vector<uint8_t>& out, const std::string& name)
+{
+    size_t start = 0;
+    while (start < name.size()) {
+        auto end = name.find('.', start);
+        end = end == std::string::npos ? name.size() : end;
+        out.push_back(end - start);
+        out.insert(out.end(), name.begin() + start, name.begin() + end);
+        start = end + 1;
+    }
+    out.push_back(0);
+}
+
+// A response to `query` with the question repeated and one A record per address, whose owner
+// name points back at the question.
+static std::vector<uint8_t> make_response(const dns_query_t& query, int rcode, const std::vector<std::string>& addresses = {})
+{
+    auto out = std::vector<uint8_t> {};
+    append_u16(out, query.id);
+    append_u16(out, 0x8180 | rcode);
+    append_u16(out, 1);
+    append_u16(out, addresses.size());
+    append_u16(out, 0);
+    append_u16(out, 0);
+    append_name(out, query.name);
+    append_u16(out, query.qtype);
+    append_u16(out, 1);
+    for (const auto& address : addresses) {
+        in_addr addr {};
+        inet_pton(AF_INET, address.c_str(), &addr);
+        append_u16(out, 0xc00c);
+        append_u16(out, 1);
+        append_u16(out, 1);
+        append_u16(out, 0);
+        append_u16(out, 60);
+        append_u16(out, 4);
+        auto bytes = (const uint8_t*)&addr;
+        out.insert(out.end(), bytes, bytes + 4);
+    }
+    return out;
+}
+
+static dns_query_t parse_query(const uint8_t* data, size_t size)
+{
+    auto query = dns_query_t { .id = (uint16_t)(data[0] << 8 | data[1]) };
+    size_t pos = 12;
+    while (pos < size && data[pos]) {
+        if (!query.name.empty()) {
+            query.name += '.';
+        }
+        query.name.append((const char*)data + pos + 1, data[pos]);
+        pos += data[pos] + 1;
+    }
+    query.qtype = data[pos + 1] << 8 | data[pos + 2];
+    return query;
+}
+
+// A nameserver on the loopback interface, served from the test's message loop. `respond` returns
+// the datagrams sent back for each query, in order.
+class stub_dns_server_t {
+public:
+    using responder_t = std::function<std::vector<std::vector<uint8_t>>(const dns_query_t&)>;
+
+    explicit stub_dns_server_t(responder_t respond)
+        : m_respond { std::move(respond) }
+    {
+        m_sd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+        if (m_sd < 0) {
+            throw std::system_error { errno, std::system_category(), "create socket failed" };
+        }
+        auto addr = sockaddr_in { .sin_family = AF_INET, .sin_port = 0, .sin_addr = { htonl(INADDR_LOOPBACK) } };
+        if (bind(m_sd, (const sockaddr*)&addr, sizeof(addr)) < 0) {
+            throw std::system_error { errno, std::system_category(), "bind failed" };
+        }
+        m_address.length = sizeof(sockaddr_in);
+        getsockname(m_sd, (sockaddr*)&m_address.storage, &m_address.length);
+        m_serving.emplace(serve_async());
+    }
+
+    ~stub_dns_server_t()
+    {
+        message_queue_t::current().cancel(m_sd, std::make_exception_ptr(std::runtime_error { "stopped" }));
+        close(m_sd);
+    }
+
+    const socket_address_t& address() const
+    {
+        return m_address;
+    }
+
+    // Names queried so far, one per query.
+    const std::vector<std::string>& names() const
+    {
+        return m_names;
+    }
+
+private:
+    task_t<void> serve_async()
+    {
+        while (true) {
+            try {
+                co_await message_queue_t::current().await(m_sd, EPOLLIN);
+            } catch (const std::exception&) {
+                co_return;
+            }
+
+            uint8_t buffer[1500];
+            sockaddr_storage peer {};
+            socklen_t peer_len = sizeof(peer);
+            ssize_t num;
+            while ((num = recvfrom(m_sd, buffer, sizeof(buffer), /*flags=*/0, (sockaddr*)&peer, &peer_len)) > 0) {
+                auto query = parse_query(buffer, num);
+                m_names.push_back(query.name);
+                for (const auto& datagram : m_respond(query)) {
+                    sendto(m_sd, datagram.data(), datagram.size(), /*flags=*/0, (const sockaddr*)&peer, peer_len);
+                }
+            }
+        }
+    }
+
+    responder_t m_respond {};
+    int m_sd { -1 };
+    socket_address_t m_address {};
+    std::vector<std::string> m_names {};
+    std::optional<task_t<void>> m_serving {};
+};
+
+static resolv_conf_t stub_conf(const stub_dns_server_t& server, std::vector<std::string> search = {}, int ndots = 1)
+{
+    return {
+        .nameservers = { server.address() },
+        .timeout = 1000ms,
+        .attempts = 1,
+        .search = std::move(search),
+        .ndots = ndots,
+    };
+}
+
+static std::vector<std::string> resolve(const std::string& host)
+{
+    auto addresses = message_queue_t::current().wait(dns_resolver_t::current().resolve_async(host, 80));
+    auto result = std::vector<std::string> {};
+    for (const auto& address : addresses) {
+        result.push_back(address.to_string());
+    }
+    return result;
+}
+
+// Answers A queries for `name` with `address`, everything else with NXDOMAIN.
+static stub_dns_server_t::responder_t answer_only(std::string name, std::string address)
+{
+    return [name, address](const dns_query_t& query) -> std::vector<std::vector<uint8_t>> {
+        if (query.name != name) {
+            return { make_response(query, /*rcode=*/3) };
+        } else if (query.qtype != 1) {
+            return { make_response(query, /*rcode=*/0) };
+        }
+        return { make_response(query, /*rcode=*/0, { address }) };
+    };
+}
+
+export std::vector<test_t> dns_tests()
+{
+    auto list = std::vector<test_t> {};
+
+    list.push_back({
+        .name = "dns/parse_resolv_conf",
+        .run = [] {
+            auto conf = parse_resolv_conf("nameserver 10.0.0.53\ndomain old.example\nsearch Corp.Example. lab.example\noptions ndots:2 timeout:3\n");
+            check_eq(conf.nameservers.size(), 1u);
+            check_eq(conf.nameservers[0].to_string(), "10.0.0.53:53");
+            check(conf.search == std::vector<std::string> { "corp.example", "lab.example" }, "search replaces domain");
+            check_eq(conf.ndots, 2);
+            check_eq(conf.timeout.count(), 3000);
+        },
+    });
+
+    list.push_back({
+        .name = "dns/candidate_names",
+        .run = [] {
+            auto conf = resolv_conf_t { .search = { "corp.example" }, .ndots = 1 };
+            check(candidate_names("db", conf) == std::vector<std::string> { "db.corp.example", "db" }, "short names try the search list first");
+            check(candidate_names("a.b", conf) == std::vector<std::string> { "a.b", "a.b.corp.example" }, "names with ndots dots go as is first");
+            check(candidate_names("db.", conf) == std::vector<std::string> { "db" }, "a trailing dot makes the name absolute");
+        },
+    });
+
+    // Malformed and unrelated datagrams arrive ahead of the answer; they're dropped and the
+    // answer is still taken.
+    list.push_back({
+        .name = "dns/drops_bad_datagrams",
+        .run = [] {
+            auto server = stub_dns_server_t { [](const dns_query_t& query) -> std::vector<std::vector<uint8_t>> {
+                auto datagrams = std::vector<std::vector<uint8_t>> {};
+                if (query.qtype != 1) {
+                    datagrams.push_back(make_response(query, /*rcode=*/0));
+                    return datagrams;
+                }
+
+                auto answer = make_response(query, /*rcode=*/0, { "192.0.2.7" });
+                auto owner = answer.size() - 16;
+
+                // The answer's owner name points at itself.
+                auto loop = answer;
+                loop[owner] = 0xc0 | owner >> 8;
+                loop[owner + 1] = owner & 0xff;
+                datagrams.push_back(loop);
+
+                // It points forward, past the end of the message.
+                auto forward = answer;
+                forward[owner + 1] = 0xff;
+                datagrams.push_back(forward);
+
+                // Cut off inside the question.
+                datagrams.push_back({ answer.begin(), answer.begin() + 16 });
+
+                // The right id for another name.
+                auto other = query;
+                other.name = "other.example";
+                datagrams.push_back(make_response(other, /*rcode=*/0, { "198.51.100.1" }));
+
+                datagrams.push_back(answer);
+                return datagrams;
+            } };
+            dns_resolver_t::current().configure(stub_conf(server));
+            check(resolve("www.example") == std::vector<std::string> { "192.0.2.7:80" }, "the valid answer after the bad ones wins");
+        },
+    });
+
+    list.push_back({
+        .name = "dns/search_list",
+        .run = [] {
+            auto server = stub_dns_server_t { answer_only("db.corp.example", "192.0.2.8") };
+            dns_resolver_t::current().configure(stub_conf(server, { "lab.example", "corp.example" }));
+            check(resolve("db") == std::vector<std::string> { "192.0.2.8:80" }, "resolved through the search list");
+            check_eq(server.names().front(), "db.lab.example");
+        },
+    });
+
+    list.push_back({
+        .name = "dns/ndots",
+        .run = [] {
+            auto server = stub_dns_server_t { answer_only("db.corp", "192.0.2.9") };
+            dns_resolver_t::current().configure(stub_conf(server, { "corp.example" }, /*ndots=*/1));
+            check(resolve("db.corp") == std::vector<std::string> { "192.0.2.9:80" }, "resolved as given");
+            check_eq(server.names().front(), "db.corp");
+        },
+    });
+
+    list.push_back({
+        .name = "dns/not_found",
+        .run = [] {
+            auto server = stub_dns_server_t { answer_only("", "") };
+            dns_resolver_t::current().configure(stub_conf(server, { "corp.example" }));
+            check_throws([] { resolve("missing"); }, "host not found: missing");
+        },
+    });
+
+    return list;
+}
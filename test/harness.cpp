@@ -0,0 +1,70 @@
+module;
+
+#include <cerrno>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <functional>
+#include <source_location>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+export module test_harness;
+
+export struct test_t {
+    std::string name {};
+    std::function<void()> run {};
+};
+
+// Thrown by the checks below; the runner reports it and carries on with the next test.
+export class test_failure : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+export void check(bool condition, std::string_view what, std::source_location location = std::source_location::current())
+{
+    if (!condition) {
+        throw test_failure { std::format("{}:{}: check failed: {}", location.file_name(), location.line(), what) };
+    }
+}
+
+template <typename T>
+concept formattable_t = requires(const T& value) { std::format("{}", value); };
+
+export template <formattable_t T, formattable_t U>
+void check_eq(const T& actual, const U& expected, std::source_location location = std::source_location::current())
+{
+    if (!(actual == expected)) {
+        throw test_failure { std::format("{}:{}: expected {}, got {}", location.file_name(), location.line(), expected, actual) };
+    }
+}
+
+// Checks that `f` throws an exception whose message contains `message`.
+export void check_throws(std::function<void()> f, std::string_view message, std::source_location location = std::source_location::current())
+{
+    try {
+        f();
+    } catch (const test_failure&) {
+        throw;
+    } catch (const std::exception& ex) {
+        if (std::string_view { ex.what() }.find(message) == std::string_view::npos) {
+            throw test_failure { std::format("{}:{}: expected an error with \"{}\", got \"{}\"", location.file_name(), location.line(), message, ex.what()) };
+        }
+        return;
+    }
+    throw test_failure { std::format("{}:{}: expected an error with \"{}\"", location.file_name(), location.line(), message) };
+}
+
+// A new empty directory under $TMPDIR, left behind for inspection.
+export std::filesystem::path scratch_dir()
+{
+    auto tmpdir = getenv("TMPDIR");
+    auto pattern = (std::filesystem::path { tmpdir && *tmpdir ? tmpdir : "/tmp" } / "app-test.XXXXXX").string();
+    if (!mkdtemp(pattern.data())) {
+        throw std::system_error { errno, std::system_category(), "mkdtemp failed" };
+    }
+    return pattern;
+}
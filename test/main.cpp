@@ -0,0 +1,89 @@
+import dns_test;
+import metadata_test;
+import mirrors_test;
+import package_test;
+import pull_test;
+import rate_limiter_test;
+import test_harness;
+
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <vector>
+
+struct Options {
+    bool help {};
+    std::string filter {};
+};
+
+static Options parse_options(int& argc, const char**& argv)
+{
+    auto options = Options {};
+    while (argc && **argv == '-') {
+        if (!strcmp(*argv + 1, "h") || !strcmp(*argv + 1, "-help")) {
+            options.help = true;
+        } else {
+            fprintf(stderr, "unknown option: %s\n", *argv);
+            exit(1);
+        }
+        --argc;
+        ++argv;
+    }
+    if (argc) {
+        options.filter = *argv;
+    }
+    return options;
+}
+
+static void print_help()
+{
+    fprintf(stdout, R"(Tests of the app modules
+Usage: app-test [OPTIONS] [FILTER]
+
+Options:
+    -h,--help                   Print this help message and exit
+
+Parameters:
+    FILTER                      Only run tests whose name contains FILTER
+)");
+}
+
+static std::vector<test_t> tests()
+{
+    auto list = std::vector<test_t> {};
+    for (auto group : { dns_tests, metadata_tests, mirrors_tests, package_tests, pull_tests, rate_limiter_tests }) {
+        auto tests = group();
+        list.insert(list.end(), std::make_move_iterator(tests.begin()), std::make_move_iterator(tests.end()));
+    }
+    return list;
+}
+
+int main(int argc, const char* argv[])
+{
+    --argc;
+    ++argv;
+
+    auto options = parse_options(argc, argv);
+    if (options.help) {
+        print_help();
+        return 0;
+    }
+
+    auto passed = 0, failed = 0;
+    for (const auto& test : tests()) {
+        if (test.name.find(options.filter) == std::string::npos) {
+            continue;
+        }
+        try {
+            test.run();
+            fprintf(stderr, "PASS %s\n", test.name.c_str());
+            ++passed;
+        } catch (const std::exception& ex) {
+            fprintf(stderr, "FAIL %s: %s\n", test.name.c_str(), ex.what());
+            ++failed;
+        }
+    }
+    fprintf(stderr, "%d passed, %d failed\n", passed, failed);
+    return failed || !passed ? 1 : 0;
+}
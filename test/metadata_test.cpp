@@ -0,0 +1,49 @@
+module;
+
+#include <string>
+#include <vector>
+
+export module metadata_test;
+import metadata;
+import test_harness;
+
+export std::vector<test_t> metadata_tests()
+{
+    auto list = std::vector<test_t> {};
+
+    list.push_back({
+        .name = "metadata/contained_path",
+        .run = [] {
+            check(is_contained_path("bin/bash"), "a plain path");
+            check(is_contained_path("./bin//bash"), "normalizes to a plain path");
+            check(!is_contained_path(""), "empty");
+            check(!is_contained_path("."), "the directory itself");
+            check(!is_contained_path("/etc/passwd"), "absolute");
+            check(!is_contained_path("../bin/app"), "leaves the directory");
+            check(!is_contained_path("bin/../../x"), "leaves it after normalizing");
+            check(!is_contained_path("bin/../bash"), "any .. component");
+        },
+    });
+
+    list.push_back({
+        .name = "metadata/bad_file_path",
+        .run = [] {
+            auto md5 = std::string { "d41d8cd98f00b204e9800998ecf8427e" };
+            check_eq(parse_metadata("files:\n  - " + md5 + " -rwxr-xr-x 10 bin/app\n").files.size(), 1u);
+            check_throws([&] { parse_metadata("files:\n  - " + md5 + " -rwxr-xr-x 10 ../../.bashrc\n"); }, "Bad file path");
+            check_throws([&] { parse_metadata("files:\n  - " + md5 + " -rwxr-xr-x 10 /usr/bin/app\n"); }, "Bad file path");
+        },
+    });
+
+    list.push_back({
+        .name = "metadata/bad_md5",
+        .run = [] {
+            check(is_md5("d41d8cd98f00b204e9800998ecf8427e"), "32 hex digits");
+            check(!is_md5("d41d8cd98f00b204e9800998ecf8427"), "too short");
+            check(!is_md5("D41D8CD98F00B204E9800998ECF8427E"), "uppercase");
+            check_throws([] { parse_metadata("files:\n  - abc -rwxr-xr-x 10 bin/app\n"); }, "Bad md5");
+        },
+    });
+
+    return list;
+}
@@ -0,0 +1,179 @@
+module;
+
+#include <chrono>
+#include <coroutine>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+export module mirrors_test;
+import cppl;
+import http_client;
+import message_queue;
+import mirror_server;
+import mirrors;
+import test_harness;
+
+using cppl::task_t;
+using namespace std::chrono_literals;
+
+constexpr auto PACKAGE_PATH = "/pkg0/1.0/amd64/pkg0-1.0-amd64.slp";
+
+// Points $HOME at a scratch directory and the mirror list at `urls`, with no stats from before.
+static std::filesystem::path use_mirrors(const std::vector<std::string>& urls)
+{
+    auto home = scratch_dir();
+    auto list = std::string {};
+    for (const auto& url : urls) {
+        list += list.empty() ? url : "," + url;
+    }
+    setenv("HOME", home.c_str(), /*overwrite=*/1);
+    setenv("APP_MIRRORS", list.c_str(), /*overwrite=*/1);
+    mirror_list_t::current() = mirror_list_t {};
+    return home;
+}
+
+// A mirror on its own thread and message loop, running until the tests exit.
+static std::shared_ptr<mirror_server_t> start_mirror(mirror_server_options_t options)
+{
+    auto server = std::make_shared<mirror_server_t>(std::move(options));
+    server->preload(PACKAGE_PATH);
+    std::thread { [server] {
+        message_queue_t::current().wait(server->serve_async());
+    } }.detach();
+    return server;
+}
+
+static std::vector<std::string> ranked_urls()
+{
+    auto urls = std::vector<std::string> {};
+    for (auto mirror : mirror_list_t::current().ranked()) {
+        urls.push_back(mirror->base_url);
+    }
+    return urls;
+}
+
+static mirror_t& find_mirror(const std::string& url)
+{
+    for (auto mirror : mirror_list_t::current().ranked()) {
+        if (mirror->base_url == url) {
+            return *mirror;
+        }
+    }
+    throw test_failure { std::format("no mirror {}", url) };
+}
+
+struct fetch_result_t {
+    std::string base_url {};
+    std::chrono::milliseconds elapsed {};
+};
+
+static task_t<fetch_result_t> fetch_async()
+{
+    auto start = std::chrono::steady_clock::now();
+    auto response = co_await hedged_get_header_async(PACKAGE_PATH, {});
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    co_await response.read_stream.read_async(http_content_length(response.headers));
+    co_return fetch_result_t { response.mirror->base_url, elapsed };
+}
+
+export std::vector<test_t> mirrors_tests()
+{
+    auto list = std::vector<test_t> {};
+
+    list.push_back({
+        .name = "mirrors/ranking",
+        .run = [] {
+            use_mirrors({ "http://a", "http://b", "http://c" });
+            auto& mirrors = mirror_list_t::current();
+            check(ranked_urls() == std::vector<std::string> { "http://a", "http://b", "http://c" }, "unmeasured mirrors keep their order");
+
+            mirrors.record_ttfb(find_mirror("http://a"), 300ms);
+            mirrors.record_ttfb(find_mirror("http://b"), 100ms);
+            check(ranked_urls() == std::vector<std::string> { "http://c", "http://b", "http://a" }, "unmeasured first, then the fastest");
+
+            mirrors.record_failure(find_mirror("http://b"));
+            check(ranked_urls() == std::vector<std::string> { "http://c", "http://a", "http://b" }, "a failure ranks a mirror down");
+
+            mirrors.record_ttfb(find_mirror("http://b"), 100ms);
+            check_eq(find_mirror("http://b").failures, 0);
+            check_eq(ranked_urls()[1], "http://b");
+        },
+    });
+
+    list.push_back({
+        .name = "mirrors/hedge_delay",
+        .run = [] {
+            auto mirror = mirror_t {};
+            for (int i = 1; i <= 7; ++i) {
+                mirror.ttfb_samples.push_back(i * 10);
+            }
+            check_eq(mirror.hedge_delay().count(), 1000);
+
+            mirror.ttfb_samples.push_back(200);
+            check_eq(mirror.hedge_delay().count(), 200);
+
+            mirror.ttfb_samples.assign(10, 1);
+            check_eq(mirror.hedge_delay().count(), 50);
+        },
+    });
+
+    list.push_back({
+        .name = "mirrors/save",
+        .run = [] {
+            auto home = use_mirrors({ "http://a", "http://b" });
+            mirror_list_t::current().record_ttfb(find_mirror("http://b"), 100ms);
+            mirror_list_t::current().save();
+
+            mirror_list_t::current() = mirror_list_t {};
+            check_eq(find_mirror("http://b").ttfb_ms, 100.0);
+            check_eq(ranked_urls()[0], "http://a");
+
+            // The stats file can't be replaced; the save is skipped without leaving a temporary.
+            auto stats_path = home / ".staticlinux" / "mirror-stats.yaml";
+            std::filesystem::remove(stats_path);
+            std::filesystem::create_directories(stats_path / "blocker");
+            mirror_list_t::current().record_failure(find_mirror("http://a"));
+            mirror_list_t::current().save();
+            check(std::filesystem::is_directory(stats_path), "the stats path is left alone");
+            check(!std::filesystem::exists(home / ".staticlinux" / "mirror-stats.yaml.tmp"), "the temporary is removed");
+        },
+    });
+
+    // The first mirror doesn't answer within the default hedge delay, the second one does.
+    list.push_back({
+        .name = "mirrors/hedge",
+        .run = [] {
+            auto slow = start_mirror({ .latency = 1500ms, .files = 2, .file_size = 4096 });
+            auto fast = start_mirror({ .files = 2, .file_size = 4096 });
+            use_mirrors({ slow->base_url(), fast->base_url() });
+
+            auto result = message_queue_t::current().wait(fetch_async());
+            check_eq(result.base_url, fast->base_url());
+            check(result.elapsed >= 1000ms && result.elapsed < 1500ms, "answered by the hedge");
+            check(find_mirror(slow->base_url()).ttfb_ms >= 1000, "the loser is ranked as slow");
+            check_eq(ranked_urls()[0], fast->base_url());
+        },
+    });
+
+    // A refused connection moves on to the next mirror without waiting for the hedge delay.
+    list.push_back({
+        .name = "mirrors/failover",
+        .run = [] {
+            auto fast = start_mirror({ .files = 2, .file_size = 4096 });
+            use_mirrors({ "http://127.0.0.1:1", fast->base_url() });
+
+            auto result = message_queue_t::current().wait(fetch_async());
+            check_eq(result.base_url, fast->base_url());
+            check(result.elapsed < 500ms, "no hedge delay");
+            check_eq(find_mirror("http://127.0.0.1:1").failures, 1);
+            check_eq(ranked_urls()[0], fast->base_url());
+        },
+    });
+
+    return list;
+}
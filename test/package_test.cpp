@@ -0,0 +1,64 @@
+module;
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <span>
+#include <string>
+#include <vector>
+
+export module package_test;
+import metadata;
+import mirror_server;
+import package;
+import test_harness;
+
+static std::filesystem::path write_package(const std::vector<uint8_t>& data)
+{
+    auto path = scratch_dir() / "package.slp";
+    auto out = std::ofstream { path, std::ios::binary };
+    out.write((const char*)data.data(), data.size());
+    return path;
+}
+
+export std::vector<test_t> package_tests()
+{
+    auto list = std::vector<test_t> {};
+
+    // Empty files of a v2 package have no blocks.
+    list.push_back({
+        .name = "package/empty_file",
+        .run = [] {
+            auto package = make_synthetic_package("/empty/1.0/amd64/empty-1.0-amd64.slp", 2, 0, /*format_version=*/2);
+            verify_package_file(write_package(package.data), "/empty/1.0/amd64/empty-1.0-amd64.slp");
+            auto file = Metadata::File { .md5 = "d41d8cd98f00b204e9800998ecf8427e", .filepath = "empty" };
+            check(decompress_file(file, {}).empty(), "decodes to nothing");
+        },
+    });
+
+    list.push_back({
+        .name = "package/bad_v2_header",
+        .run = [] {
+            auto path = std::string { "/pkg/1.0/amd64/pkg-1.0-amd64.slp" };
+            auto package = make_synthetic_package(path, 1, 1000, /*format_version=*/2, /*block_size=*/256);
+            verify_package_file(write_package(package.data), path);
+
+            auto reserved = package.data;
+            reserved[6] = 1;
+            check_throws([&] { verify_package_file(write_package(reserved), path); }, "Invalid package header");
+
+            auto set_block_size = [&](uint32_t block_size) {
+                auto data = package.data;
+                memcpy(&data[24], &block_size, sizeof(block_size));
+                return data;
+            };
+            check_throws([&] { verify_package_file(write_package(set_block_size(0)), path); }, "Invalid package header");
+            check_throws([&] { verify_package_file(write_package(set_block_size(128 << 20)), path); }, "Invalid package header");
+            // Blocks of 256 bytes are larger than the header allows.
+            check_throws([&] { verify_package_file(write_package(set_block_size(128)), path); }, "Invalid block index");
+        },
+    });
+
+    return list;
+}
@@ -0,0 +1,58 @@
+module;
+
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+
+export module pull_test;
+import message_queue;
+import mirror_server;
+import mirrors;
+import pull;
+import test_harness;
+
+// Just over 4 GiB, so that sizes and offsets kept in 32 bits would wrap.
+constexpr uint64_t LARGE_FILE_SIZE = (4ull << 30) + (256 << 20);
+
+export std::vector<test_t> pull_tests()
+{
+    auto list = std::vector<test_t> {};
+
+    // The file is larger than the memory the pull may use, it has to be decoded, checked and
+    // written while it downloads.
+    list.push_back({
+        .name = "pull/multi_gigabyte_file",
+        .run = [] {
+            auto server = std::make_shared<mirror_server_t>(mirror_server_options_t { .files = 1, .file_size = LARGE_FILE_SIZE, .generated = true });
+            server->preload("/big/1.0/amd64/big-1.0-amd64.slp");
+            std::thread { [server] {
+                message_queue_t::current().wait(server->serve_async());
+            } }.detach();
+
+            auto home = scratch_dir();
+            setenv("HOME", home.c_str(), /*overwrite=*/1);
+            setenv("APP_MIRRORS", server->base_url().c_str(), /*overwrite=*/1);
+            mirror_list_t::current() = mirror_list_t {};
+
+            auto request = pull_request_t { .name = "big", .version = "1.0", .path = "file0.dat" };
+            message_queue_t::current().wait(run_pull_async(request));
+
+            auto path = home / ".staticlinux" / "big" / "file0.dat";
+            auto size = std::filesystem::file_size(path);
+            rusage usage {};
+            getrusage(RUSAGE_SELF, &usage);
+            // Not left behind like other scratch directories, it's too large.
+            std::filesystem::remove_all(home);
+
+            check_eq(size, LARGE_FILE_SIZE);
+            check((uint64_t)usage.ru_maxrss << 10 < 1ull << 30, "the peak RSS stays under 1 GiB");
+        },
+    });
+
+    return list;
+}
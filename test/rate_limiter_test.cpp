@@ -0,0 +1,32 @@
+module;
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+export module rate_limiter_test;
+import rate_limiter;
+import test_harness;
+
+export std::vector<test_t> rate_limiter_tests()
+{
+    auto list = std::vector<test_t> {};
+
+    list.push_back({
+        .name = "rate_limiter/parse_rate",
+        .run = [] {
+            check_eq(parse_rate("500").value_or(0), 500u);
+            check_eq(parse_rate("500K").value_or(0), 500u << 10);
+            check_eq(parse_rate("20MB/s").value_or(0), 20u << 20);
+            check_eq(parse_rate("1g").value_or(0), 1ull << 30);
+            check_eq(parse_rate("17179869183G").value_or(0), 17179869183ull << 30);
+            check(!parse_rate("0"), "zero");
+            check(!parse_rate("K"), "no digits");
+            check(!parse_rate("5T"), "unknown suffix");
+            check(!parse_rate("17179869184G"), "overflow by the suffix");
+            check(!parse_rate("18446744073709551616"), "overflow by the digits");
+        },
+    });
+
+    return list;
+}